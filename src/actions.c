@@ -25,6 +25,7 @@ void enable_debug(void) {
 void _enable_debug(void) {
   stdio_uart_init_full(UART_ONE, UART_ONE_BAUD_RATE, UART_ONE_TX_PIN,
                        UART_ONE_RX_PIN);
+  trace_enable_output();
 }
 
 /* This key combo locks both outputs simultaneously */
@@ -34,8 +35,8 @@ void lock_screen(void) {
 }
 
 void request_reboot() {
-  if (global_state.active_output == BOARD_ROLE) {
-    global_state.reboot_requested = true;
+  if (read_shared_state().active_output == BOARD_ROLE) {
+    set_reboot_requested();
   } else {
     uart_send_value(REQUEST_REBOOT_MSG, 1);
   }
@@ -43,22 +44,23 @@ void request_reboot() {
 
 void screensaver_task(device_t *state) {
   const unsigned int mouse_move_delay = 1000000;
-  uint64_t inactivity_period = time_us_64() - state->last_activity;
+  shared_state_t shared = read_shared_state();
+  uint64_t inactivity_period = time_us_64() - shared.last_activity;
 
   static mouse_report_t report = {0};
   static int last_pointer_move = 0;
   static int jitter = 1;
 
   /* If we're not enabled, nothing to do here. */
-  if (!SCREENSAVER_ENABLED)
+  if (!state->config->screensaver_enabled)
     return;
 
-  if (!state->tud_connected)
+  if (!shared.tud_connected)
     return;
 
   /* System is still not idle for long enough to activate or we've been running
    * for too long */
-  if (inactivity_period < SCREENSAVER_IDLE_TIME)
+  if (inactivity_period < state->config->screensaver_idle_us)
     return;
 
   /* We're active! Now check if it's time to move the cursor yet. */
@@ -82,7 +84,7 @@ void send_lock_screen_report(uart_packet_t *packet, device_t *state) {
   keyboard_report_t lock_report = {0}, release_keys = {0};
   uint8_t off, pos;
 
-  switch (global_state.device_config[BOARD_ROLE].os) {
+  switch (global_state.config->os[BOARD_ROLE]) {
   case LINUX:
     lock_report.modifier = KEYBOARD_MODIFIER_LEFTGUI;
     off = get_byte_offset(HID_KEY_L);
@@ -105,7 +107,7 @@ void send_lock_screen_report(uart_packet_t *packet, device_t *state) {
 }
 
 void suspend_active_pc(void) {
-  if (global_state.active_output == BOARD_ROLE) {
+  if (read_shared_state().active_output == BOARD_ROLE) {
     send_suspend_pc_report(NULL, NULL);
   } else {
     uart_send_value(SUSPEND_PC_MSG, 1);
@@ -152,7 +154,7 @@ void send_suspend_pc_report(uart_packet_t *packet, device_t *state) {
   (void)packet;
   (void)state;
 
-  switch (global_state.device_config[BOARD_ROLE].os) {
+  switch (global_state.config->os[BOARD_ROLE]) {
   case LINUX:
     _suspend_linux();
     break;
@@ -160,25 +162,30 @@ void send_suspend_pc_report(uart_packet_t *packet, device_t *state) {
     _suspend_macos();
     break;
   }
-  set_tud_connected(false);
+  disconnect_pc();
 }
 
 void set_onboard_led(device_t *state) {
-  uint8_t new_led_state = (state->active_output == BOARD_ROLE);
+  uint8_t new_led_state = (read_shared_state().active_output == BOARD_ROLE);
   gpio_put(GPIO_LED_PIN, new_led_state);
 }
 
 void switch_output_a(device_t *state) {
-  state->active_output = PICO_A;
-  uart_send_value(OUTPUT_SELECT_MSG, state->active_output);
+  bool changed = set_active_output(PICO_A);
+  uart_send_value(OUTPUT_SELECT_MSG, PICO_A);
   set_onboard_led(state);
+  if (changed) {
+    switch_held_keys(PICO_A);
+  }
 }
 
 void toggle_output(void) {
-  global_state.active_output ^= 1;
-  uart_send_value(OUTPUT_SELECT_MSG, global_state.active_output);
+  /* Only core1 ever changes the output, nobody can race us between the two */
+  uint8_t output = read_shared_state().active_output ^ 1;
+  set_active_output(output);
+  uart_send_value(OUTPUT_SELECT_MSG, output);
   set_onboard_led(&global_state);
-  release_all_keys();
+  switch_held_keys(output);
 }
 
 void query_active_output(device_t *state) {
@@ -0,0 +1,385 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+/**================================================== *
+ * ===============  Config snapshots  =============== *
+ * ================================================== */
+
+/*
+ * global_state.config points at one of two snapshots and what it points at
+ * never changes. Readers take the pointer once and go by that, core0 fills
+ * the other snapshot and swaps the pointer. Before it reuses the snapshot it
+ * swapped away from, core1 has to have gone round its loop, so nothing there
+ * can still be reading it.
+ */
+
+static struct {
+  user_config_t snapshots[2];
+  user_config_t next;   // Waiting for the spare snapshot to be free
+  bool next_pending;    // next is to be applied
+  bool next_sync;       // and then sent to the other board
+  uint64_t swapped_at;  // When the pointer was swapped last
+  /* Core1 -> core0, a config the other board sent or wiped */
+  spin_lock_t *lock;
+  user_config_t received;
+  bool received_pending;
+} snap = {0};
+
+static void config_sync_start(const user_config_t *config);
+static void config_sync_stop(void);
+
+/* Core0, before core1 runs */
+void config_init(const user_config_t *config) {
+  snap.lock = spin_lock_init(spin_lock_claim_unused(true));
+  snap.snapshots[0] = *config;
+  global_state.config = &snap.snapshots[0];
+}
+
+static bool config_swap(void) {
+  user_config_t *spare = global_state.config == &snap.snapshots[0]
+                             ? &snap.snapshots[1]
+                             : &snap.snapshots[0];
+
+  if (read_shared_state().core1_last_loop_pass <= snap.swapped_at) {
+    return false; // core1 might still be reading it
+  }
+
+  *spare = snap.next;
+  __dmb();
+  global_state.config = spare;
+  snap.swapped_at = time_us_64();
+
+  trace(TRACE_CONFIG_APPLIED, snap.next_sync, spare->hotkey_count);
+  if (snap.next_sync) {
+    config_sync_start(spare);
+  }
+  config_save_later();
+  snap.next_pending = false;
+  return true;
+}
+
+/* Core0. The config has to be valid, it's live once core1 let go of the spare
+ * snapshot, right away most of the time. */
+void config_apply(const user_config_t *config, bool sync) {
+  snap.next = *config;
+  snap.next_sync = sync;
+  snap.next_pending = true;
+  config_swap();
+}
+
+/**================================================== *
+ * =============  Config feature report  ============ *
+ * ================================================== */
+
+/* What the PC wrote since the last commit, based on the live config */
+static struct {
+  user_config_t config;
+  bool active;
+  uint8_t read_page; // 0 is the general page, then one per hotkey
+} staged = {0};
+
+static user_config_t *staged_config(void) {
+  if (!staged.active) {
+    staged.config = *global_state.config;
+    staged.active = true;
+  }
+  return &staged.config;
+}
+
+/* Core0 only, from tud_hid_get_report_cb(). Every read moves on to the next
+ * page, 1 + hotkey_count reads in a row return all of them. */
+uint16_t config_get_report(uint8_t *buffer, uint16_t reqlen) {
+  const user_config_t *config = global_state.config;
+  config_report_t report = {.version = CONFIG_VERSION};
+
+  if (reqlen < sizeof(report)) {
+    return 0;
+  }
+
+  if (staged.read_page > config->hotkey_count) {
+    staged.read_page = 0;
+  }
+
+  if (staged.read_page == 0) {
+    report.op = CONFIG_OP_GENERAL;
+    memcpy(report.general.os, config->os, sizeof(report.general.os));
+    report.general.screensaver_enabled = config->screensaver_enabled;
+    report.general.hotkey_count = config->hotkey_count;
+    report.general.screensaver_idle_s = config->screensaver_idle_us / 1000000;
+  } else {
+    const hotkey_combo_t *hotkey = &config->hotkeys[staged.read_page - 1];
+    report.op = CONFIG_OP_HOTKEY;
+    report.index = staged.read_page - 1;
+    report.hotkey.mask = hotkey->mask.report;
+    report.hotkey.action = hotkey->action;
+    report.hotkey.pass_to_os = hotkey->pass_to_os;
+  }
+  staged.read_page++;
+
+  memcpy(buffer, &report, sizeof(report));
+  return sizeof(report);
+}
+
+static bool stage_general(const config_report_t *report) {
+  for (int i = 0; i < NUM_DEVICES; i++) {
+    if (report->general.os[i] != LINUX && report->general.os[i] != MACOS) {
+      return false;
+    }
+  }
+  if (report->general.screensaver_enabled > 1 ||
+      report->general.hotkey_count > MAX_HOTKEYS ||
+      report->general.screensaver_idle_s > CONFIG_MAX_IDLE_S) {
+    return false;
+  }
+
+  user_config_t *config = staged_config();
+  memcpy(config->os, report->general.os, sizeof(config->os));
+  config->screensaver_enabled = report->general.screensaver_enabled;
+  config->hotkey_count = report->general.hotkey_count;
+  config->screensaver_idle_us =
+      (uint32_t)report->general.screensaver_idle_s * 1000000;
+  return true;
+}
+
+static bool stage_hotkey(const config_report_t *report) {
+  if (report->index >= MAX_HOTKEYS || report->hotkey.action >= ACTION_COUNT ||
+      report->hotkey.pass_to_os > 1) {
+    return false;
+  }
+
+  hotkey_combo_t *hotkey = &staged_config()->hotkeys[report->index];
+  memset(hotkey, 0, sizeof(*hotkey));
+  hotkey->mask.report = report->hotkey.mask;
+  hotkey->action = report->hotkey.action;
+  hotkey->pass_to_os = report->hotkey.pass_to_os;
+  return true;
+}
+
+/* Core0 only, from tud_hid_set_report_cb(). A page is staged only if all of
+ * it is valid, and nothing is applied before the commit. */
+void config_set_report(uint8_t const *buffer, uint16_t bufsize) {
+  config_report_t report;
+  user_config_t defaults;
+
+  if (bufsize < sizeof(report)) {
+    return;
+  }
+  memcpy(&report, buffer, sizeof(report));
+
+  if (report.version != CONFIG_VERSION) {
+    return;
+  }
+  trace(TRACE_CONFIG_SET, report.op, report.index);
+
+  switch (report.op) {
+  case CONFIG_OP_GENERAL:
+    stage_general(&report);
+    break;
+  case CONFIG_OP_HOTKEY:
+    stage_hotkey(&report);
+    break;
+  case CONFIG_OP_COMMIT:
+    if (staged.active && config_valid(&staged.config)) {
+      config_apply(&staged.config, true);
+    }
+    staged.active = false;
+    break;
+  case CONFIG_OP_WIPE:
+    staged.active = false;
+    config_sync_stop();
+    config_defaults(&defaults);
+    config_apply(&defaults, false);
+    uart_send_value(WIPE_CONFIG_MSG, 0);
+    break;
+  }
+}
+
+/**================================================== *
+ * ============  Sync with the other board  ========= *
+ * ================================================== */
+
+/*
+ * A committed config goes to the other board as CONFIG_SYNC_CHUNKS
+ * OUTPUT_CONFIG_MSG packets, its CRC-16 after it. The receiver ACKs the
+ * generation once it has all of it, until then it's all sent again every
+ * CONFIG_SYNC_RETRY_US. A newer config replaces one still in flight.
+ */
+
+/* Core0, except acked */
+static struct {
+  uint8_t image[CONFIG_SYNC_LENGTH];
+  uint8_t generation;
+  uint8_t next_chunk; // CONFIG_SYNC_CHUNKS once a round is out
+  uint8_t rounds;
+  bool active;
+  uint64_t round_at;
+  volatile uint8_t acked; // core1: generation the other board confirmed
+} sync_tx = {.acked = 0xFF};
+
+/* Core1 only */
+static struct {
+  uint8_t image[CONFIG_SYNC_LENGTH];
+  uint32_t have; // Chunks received, one bit each
+  uint8_t generation;
+  uint8_t done; // Generation applied last, 0xFF if none
+} sync_rx = {.done = 0xFF};
+
+_Static_assert(CONFIG_SYNC_CHUNKS <= 32, "sync_rx.have is 32 bits");
+
+static void config_sync_start(const user_config_t *config) {
+  /* Older boards don't ACK anything */
+  if (global_state.peer_link_version < 2) {
+    return;
+  }
+  memcpy(sync_tx.image, config, sizeof(*config));
+  uint16_t crc = calc_crc16(sync_tx.image, sizeof(*config));
+  sync_tx.image[sizeof(*config)] = crc >> 8;
+  sync_tx.image[sizeof(*config) + 1] = crc & 0xFF;
+
+  sync_tx.generation = (sync_tx.generation + 1) & CTRL_SEQ_MASK;
+  sync_tx.next_chunk = 0;
+  sync_tx.rounds = 0;
+  sync_tx.active = true;
+}
+
+static void config_sync_stop(void) { sync_tx.active = false; }
+
+/* Core0, a few chunks per call while the link isn't busy with reports */
+static void config_sync_task(device_t *state) {
+  uint8_t data[PACKET_DATA_LENGTH];
+
+  if (!sync_tx.active) {
+    return;
+  }
+  if (sync_tx.acked == sync_tx.generation) {
+    sync_tx.active = false;
+    trace(TRACE_CONFIG_SYNC, sync_tx.generation, sync_tx.rounds);
+    return;
+  }
+
+  while (sync_tx.next_chunk < CONFIG_SYNC_CHUNKS &&
+         uart_tx_backlog() < CONFIG_SYNC_BACKLOG) {
+    uint32_t offset = sync_tx.next_chunk * CONFIG_CHUNK_LENGTH;
+    uint8_t len = MIN(CONFIG_CHUNK_LENGTH, CONFIG_SYNC_LENGTH - offset);
+    data[0] = sync_tx.generation;
+    data[1] = sync_tx.next_chunk++;
+    memcpy(&data[2], &sync_tx.image[offset], len);
+    uart_send_packet(OUTPUT_CONFIG_MSG, 0, 0, 2 + len, data);
+    sync_tx.round_at = time_us_64();
+  }
+
+  if (sync_tx.next_chunk < CONFIG_SYNC_CHUNKS ||
+      time_us_64() - sync_tx.round_at < CONFIG_SYNC_RETRY_US) {
+    return;
+  }
+  if (++sync_tx.rounds == CONFIG_SYNC_ROUNDS) {
+    sync_tx.active = false;
+    state->uart_stats.ctrl_failed++;
+    trace(TRACE_CONFIG_SYNC, sync_tx.generation, sync_tx.rounds);
+    return;
+  }
+  state->uart_stats.ctrl_retransmits++;
+  sync_tx.next_chunk = 0;
+}
+
+/* Core1, from handle_uart_ack_msg() */
+void config_sync_ack(uint8_t generation) { sync_tx.acked = generation; }
+
+/* Core1, the other board rebooted and counts generations from scratch */
+void config_sync_reset(void) {
+  sync_rx.have = 0;
+  sync_rx.done = 0xFF;
+}
+
+/* Core1, core0 picks it up in config_task() */
+static void config_receive(const user_config_t *config) {
+  uint32_t irq_state = spin_lock_blocking(snap.lock);
+  snap.received = *config;
+  snap.received_pending = true;
+  spin_unlock(snap.lock, irq_state);
+}
+
+void handle_uart_output_config_msg(uart_packet_t *packet, device_t *state) {
+  uint8_t generation = packet->data[0], chunk = packet->data[1];
+  uint32_t offset = chunk * CONFIG_CHUNK_LENGTH;
+  user_config_t config;
+
+  if (chunk >= CONFIG_SYNC_CHUNKS || generation > CTRL_SEQ_MASK ||
+      packet->report_len - 2 !=
+          MIN(CONFIG_CHUNK_LENGTH, CONFIG_SYNC_LENGTH - offset)) {
+    state->uart_stats.rx_rejected++;
+    return;
+  }
+
+  /* Our ACK got lost, the config is applied already */
+  if (generation == sync_rx.done) {
+    uart_send_packet(ACK_MSG, 0, generation, 0, NULL);
+    return;
+  }
+
+  if (generation != sync_rx.generation) {
+    sync_rx.generation = generation;
+    sync_rx.have = 0;
+  }
+  memcpy(&sync_rx.image[offset], &packet->data[2], packet->report_len - 2);
+  sync_rx.have |= 1u << chunk;
+
+  if (sync_rx.have != (1u << CONFIG_SYNC_CHUNKS) - 1) {
+    return;
+  }
+
+  /* Complete, but chunks of two rounds might not fit together */
+  sync_rx.have = 0;
+  uint16_t crc = sync_rx.image[sizeof(config)] << 8 |
+                 sync_rx.image[sizeof(config) + 1];
+  memcpy(&config, sync_rx.image, sizeof(config));
+  if (crc != calc_crc16(sync_rx.image, sizeof(config)) ||
+      !config_valid(&config)) {
+    state->uart_stats.rx_rejected++;
+    return;
+  }
+
+  config_receive(&config);
+  sync_rx.done = generation;
+  uart_send_packet(ACK_MSG, 0, generation, 0, NULL);
+}
+
+void handle_uart_wipe_config_msg(uart_packet_t *packet, device_t *state) {
+  (void)packet;
+  (void)state;
+  user_config_t defaults;
+
+  config_defaults(&defaults);
+  config_receive(&defaults);
+}
+
+/* Core0, every tick */
+void config_task(device_t *state) {
+  if (snap.received_pending) {
+    user_config_t received;
+    uint32_t irq_state = spin_lock_blocking(snap.lock);
+    received = snap.received;
+    snap.received_pending = false;
+    spin_unlock(snap.lock, irq_state);
+    config_apply(&received, false);
+  } else if (snap.next_pending) {
+    config_swap();
+  }
+
+  config_sync_task(state);
+}
@@ -0,0 +1,221 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "hotkeys.h"
+#include "main.h"
+
+/*
+ * The config is appended to a ring of CONFIG_STORE_SECTORS flash sectors, one
+ * record per slot. A sector is only erased right before its first slot gets
+ * written, so the erases go round the ring evenly and the previous record is
+ * still there while the new one is written. At boot the valid record with the
+ * highest sequence number wins, one torn by a power loss fails its CRC.
+ */
+
+typedef struct {
+  uint32_t magic;   // CONFIG_STORE_MAGIC
+  uint32_t seq;     // Higher is newer, wraps around
+  uint16_t length;  // sizeof(user_config_t)
+  uint8_t version;  // CONFIG_STORE_VERSION
+  uint8_t reserved;
+  user_config_t config;
+  uint16_t crc; // calc_crc16() of everything before it
+} config_record_t;
+
+#define SLOT_SIZE                                                              \
+  ((sizeof(config_record_t) + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE *         \
+   FLASH_PAGE_SIZE)
+#define SLOTS_PER_SECTOR (FLASH_SECTOR_SIZE / SLOT_SIZE)
+#define SLOTS (CONFIG_STORE_SECTORS * SLOTS_PER_SECTOR)
+#define NO_SLOT 0xFFFF
+
+_Static_assert(CONFIG_STORE_SECTORS >= 2,
+               "the newest record has to survive the next erase");
+_Static_assert(SLOTS <= 64, "config_load() keeps rejected slots in 64 bits");
+_Static_assert(ARRAY_SIZE(default_hotkeys) <= MAX_HOTKEYS,
+               "raise MAX_HOTKEYS");
+
+/* Core0 only, config_load() sets it up */
+static struct {
+  uint16_t newest; // Slot loaded or saved last, NO_SLOT if there is none
+  uint32_t seq;    // Its sequence number
+  bool pending;    // config_save_later() was called
+  uint64_t due;    // When to save then
+} store = {.newest = NO_SLOT};
+
+static const config_record_t *slot_record(uint32_t slot) {
+  return (const config_record_t *)(XIP_BASE + CONFIG_STORE_OFFSET +
+                                   slot * SLOT_SIZE);
+}
+
+static bool slot_blank(uint32_t slot) {
+  const uint32_t *words = (const uint32_t *)slot_record(slot);
+  for (int i = 0; i < SLOT_SIZE / sizeof(uint32_t); i++) {
+    if (words[i] != 0xFFFFFFFF) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool record_valid(const config_record_t *record) {
+  return record->magic == CONFIG_STORE_MAGIC &&
+         record->version == CONFIG_STORE_VERSION &&
+         record->length == sizeof(user_config_t) &&
+         record->crc == calc_crc16((const uint8_t *)record,
+                                   offsetof(config_record_t, crc)) &&
+         config_valid(&record->config);
+}
+
+/* What the build was configured with, user_config.h and hotkeys.h */
+void config_defaults(user_config_t *config) {
+  memset(config, 0, sizeof(*config));
+  config->os[PICO_A] = PICO_A_OS;
+  config->os[PICO_B] = PICO_B_OS;
+  config->screensaver_enabled = SCREENSAVER_ENABLED;
+  config->screensaver_idle_us = SCREENSAVER_IDLE_TIME;
+  config->hotkey_count = ARRAY_SIZE(default_hotkeys);
+  memcpy(config->hotkeys, default_hotkeys, sizeof(default_hotkeys));
+}
+
+/* Anything the firmware could trip over, whoever wrote it */
+bool config_valid(const user_config_t *config) {
+  for (int i = 0; i < NUM_DEVICES; i++) {
+    if (config->os[i] != LINUX && config->os[i] != MACOS) {
+      return false;
+    }
+  }
+  if (config->hotkey_count > MAX_HOTKEYS) {
+    return false;
+  }
+  /* An empty mask would match every report */
+  static const keyboard_mask_t empty = {0};
+  for (int n = 0; n < config->hotkey_count; n++) {
+    if (config->hotkeys[n].action >= ACTION_COUNT ||
+        !memcmp(&config->hotkeys[n].mask, &empty, sizeof(empty))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Core0, before core1 runs. Only the headers are read until the newest one
+ * is found, so it's one CRC over a single record unless that one is torn.
+ * Returns false and the defaults if there is no valid record. */
+bool config_load(user_config_t *config) {
+  uint64_t rejected = 0;
+
+  store.newest = NO_SLOT;
+  store.seq = 0;
+
+  while (true) {
+    uint32_t best = NO_SLOT;
+    for (uint32_t slot = 0; slot < SLOTS; slot++) {
+      const config_record_t *record = slot_record(slot);
+      if (record->magic != CONFIG_STORE_MAGIC || rejected & (1ull << slot)) {
+        continue;
+      }
+      if (best == NO_SLOT ||
+          (int32_t)(record->seq - slot_record(best)->seq) > 0) {
+        best = slot;
+      }
+    }
+
+    if (best == NO_SLOT) {
+      break;
+    }
+    if (record_valid(slot_record(best))) {
+      store.newest = best;
+      store.seq = slot_record(best)->seq;
+      break;
+    }
+    rejected |= 1ull << best;
+  }
+
+  trace(TRACE_CONFIG_LOAD, store.newest, store.seq);
+
+  if (store.newest == NO_SLOT) {
+    config_defaults(config);
+    return false;
+  }
+  memcpy(config, &slot_record(store.newest)->config, sizeof(*config));
+  return true;
+}
+
+/* Core0, after config_load(). Both the erase and the program stall the XIP
+ * flash for everyone: core1 is parked in RAM until they're done and the
+ * interrupts here are off, their handlers live in flash. */
+void config_save(const user_config_t *config) {
+  static uint8_t page[SLOT_SIZE] __attribute__((aligned(4)));
+  config_record_t *record = (config_record_t *)page;
+  uint64_t started = time_us_64();
+
+  if (store.newest != NO_SLOT &&
+      !memcmp(&slot_record(store.newest)->config, config, sizeof(*config))) {
+    return; // spare the flash, nothing changed
+  }
+
+  /* Sector starts get erased, any other slot has to be blank already. A write
+   * that didn't finish leaves one that isn't, skip it. */
+  uint32_t slot = store.newest == NO_SLOT ? 0 : (store.newest + 1) % SLOTS;
+  while (slot % SLOTS_PER_SECTOR && !slot_blank(slot)) {
+    slot = (slot + 1) % SLOTS;
+  }
+
+  memset(page, 0xFF, sizeof(page));
+  memset(record, 0, sizeof(*record));
+  record->magic = CONFIG_STORE_MAGIC;
+  record->seq = store.seq + 1;
+  record->length = sizeof(user_config_t);
+  record->version = CONFIG_STORE_VERSION;
+  memcpy(&record->config, config, sizeof(*config));
+  record->crc = calc_crc16(page, offsetof(config_record_t, crc));
+
+  uint32_t offset = CONFIG_STORE_OFFSET + slot * SLOT_SIZE;
+
+  // A sector erase can take a few hundred ms
+  watchdog_update();
+  multicore_lockout_start_blocking();
+  uint32_t irq_state = save_and_disable_interrupts();
+
+  if (slot % SLOTS_PER_SECTOR == 0) {
+    flash_range_erase(offset, FLASH_SECTOR_SIZE);
+  }
+  flash_range_program(offset, page, SLOT_SIZE);
+
+  restore_interrupts(irq_state);
+  multicore_lockout_end_blocking();
+
+  /* If it didn't stick, the next save moves on to the slot after it */
+  if (record_valid(slot_record(slot))) {
+    store.newest = slot;
+    store.seq = record->seq;
+  }
+  trace(TRACE_CONFIG_SAVE, slot, time_us_64() - started);
+}
+
+/* Core0. Changes often come in bursts, one record covers the whole burst. */
+void config_save_later(void) {
+  store.pending = true;
+  store.due = time_us_64() + CONFIG_STORE_DELAY_US;
+}
+
+void config_store_task(device_t *state) {
+  if (store.pending && time_us_64() >= store.due) {
+    store.pending = false;
+    config_save(state->config);
+  }
+}
@@ -17,36 +17,78 @@
 
 #include "main.h"
 
-void convert_keycodes(const uint8_t *hid_report,
-                      keyboard_report_t *new_report) {
-
-  hid_keyboard_report_t *original = (hid_keyboard_report_t *)hid_report;
-  new_report->modifier = original->modifier;
-
-  for (uint8_t i = 0; i < 6; i++) {
-    uint8_t key = original->keycode[i];
-    if (key) {
-      uint8_t off = get_byte_offset(key);
-      uint8_t pos = get_pos_in_byte(key);
-      new_report->keycode[off] ^= 1 << pos;
-    }
+void handle_keyboard(uint8_t instance, uint8_t report_id, uint8_t protocol,
+                     uint8_t const *report, uint8_t len) {
+  if (process_keyboard_report(report, len)) {
+    held_keys_routed(report, len);
+    send_x_report(KEYBOARD_REPORT_MSG, instance, REPORT_ID_KEYBOARD, len,
+                  report);
   }
 }
 
-void handle_keyboard(uint8_t instance, uint8_t report_id, uint8_t protocol,
-                     uint8_t const *report, uint8_t len) {
+/* While the link is backed up, mouse motion on its way to the other board is
+ * merged into one pending report instead of piling up in the TX queue. */
+static struct {
+  bool pending;
+  uint8_t instance;
+  uint8_t report_id;
+  mouse_report_t report;
+  uint32_t since;          // first merged report was routed, for the latency
+  uint8_t sent_buttons[2]; // what the other board saw last
+} mouse_link = {0};
 
-  hid_keyboard_report_t *original = (hid_keyboard_report_t *)report;
-  keyboard_report_t pressed = {original->modifier, {0}};
+static void mouse_link_flush(void) {
+  if (!mouse_link.pending) {
+    return;
+  }
+  mouse_link.pending = false;
+
+  memcpy(mouse_link.sent_buttons, mouse_link.report.buttons,
+         sizeof(mouse_link.sent_buttons));
+  uart_send_packet(MOUSE_REPORT_MSG, mouse_link.instance, mouse_link.report_id,
+                   sizeof(mouse_report_t), (uint8_t *)&mouse_link.report);
+  latency_record(LATENCY_ROUTED_TO_LINK, mouse_link.since);
+}
+
+static void send_mouse_over_link(uint8_t instance, uint8_t report_id,
+                                 const mouse_report_t *report) {
+  uint32_t since = latency_routed();
 
-  if (len == 8) {
-    convert_keycodes(report, &pressed);
-    report = (uint8_t *)&pressed;
-    len = 16;
+  /* Same buttons and same mouse, so the motion just adds up */
+  if (mouse_link.pending && mouse_link.instance == instance &&
+      mouse_link.report_id == report_id &&
+      merge_mouse_report(&mouse_link.report, report)) {
+    global_state.uart_stats.mouse_coalesced++;
+  } else {
+    mouse_link_flush();
+    mouse_link.pending = true;
+    mouse_link.instance = instance;
+    mouse_link.report_id = report_id;
+    mouse_link.report = *report;
+    mouse_link.since = since;
   }
-  if (process_keyboard_report(report, len)) {
-    send_x_report(KEYBOARD_REPORT_MSG, instance, REPORT_ID_KEYBOARD, len,
-                  report);
+
+  /* Button changes can't wait */
+  if (memcmp(report->buttons, mouse_link.sent_buttons, sizeof(report->buttons)) ||
+      uart_tx_backlog() < MOUSE_LINK_BACKLOG) {
+    mouse_link_flush();
+  }
+}
+
+/* Send the merged motion as soon as the link has room again */
+void mouse_link_task(device_t *state) {
+  if (!mouse_link.pending) {
+    return;
+  }
+
+  /* The output changed meanwhile, the motion is meant for the old screen */
+  if (read_shared_state().active_output == BOARD_ROLE) {
+    mouse_link.pending = false;
+    return;
+  }
+
+  if (uart_tx_backlog() < MOUSE_LINK_BACKLOG) {
+    mouse_link_flush();
   }
 }
 
@@ -55,6 +97,9 @@ void handle_mouse(uint8_t instance, uint8_t report_id, uint8_t protocol,
   (void)protocol;
   if (report[0] == MOUSE_BUTTON_MIDDLE) {
     toggle_output();
+  } else if (read_shared_state().active_output != BOARD_ROLE &&
+             len == sizeof(mouse_report_t)) {
+    send_mouse_over_link(instance, report_id, (const mouse_report_t *)report);
   } else {
     send_x_report(MOUSE_REPORT_MSG, instance, report_id, len, report);
   }
@@ -76,18 +121,31 @@ void handle_uart_generic_msg(uart_packet_t *packet, device_t *state) {
 }
 
 void handle_uart_output_select_msg(uart_packet_t *packet, device_t *state) {
-  release_all_keys();
+  if (set_active_output(packet->data[0])) {
+    switch_held_keys(packet->data[0]);
+  }
 
-  state->active_output = packet->data[0];
+  shared_state_t shared = read_shared_state();
   // we are on duty but we are not connected => try remote wakeup
-  if (state->active_output == BOARD_ROLE && !state->tud_connected) {
-    remote_wakeup();
+  if (shared.active_output == BOARD_ROLE && !shared.tud_connected) {
+    request_remote_wakeup();
   }
   set_onboard_led(state);
 }
 
 void handle_uart_output_get_msg(uart_packet_t *packet, device_t *state) {
-  uart_send_value(OUTPUT_SELECT_MSG, state->active_output);
+  uart_send_value(OUTPUT_SELECT_MSG, read_shared_state().active_output);
+}
+
+void handle_uart_link_version_msg(uart_packet_t *packet, device_t *state) {
+  state->peer_link_version = MIN(packet->data[0], LINK_VERSION);
+
+  // answer a fresh announcement, so a rebooted board learns about us too
+  if (!packet->data[1]) {
+    uart_control_reset();
+    config_sync_reset();
+    uart_send_link_version(true);
+  }
 }
 
 void handle_uart_enable_debug_msg(uart_packet_t *packet, device_t *state) {
@@ -0,0 +1,575 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+/* Report descriptor items we care about, HID 1.11 chapter 6.2.2 */
+enum {
+  ITEM_INPUT = 0x80,
+  ITEM_COLLECTION = 0xA0,
+  ITEM_END_COLLECTION = 0xC0,
+  ITEM_USAGE_PAGE = 0x04,
+  ITEM_LOGICAL_MIN = 0x14,
+  ITEM_REPORT_SIZE = 0x74,
+  ITEM_REPORT_ID = 0x84,
+  ITEM_REPORT_COUNT = 0x94,
+  ITEM_USAGE = 0x08,
+  ITEM_USAGE_MIN = 0x18,
+  ITEM_USAGE_MAX = 0x28,
+  ITEM_LONG = 0xFC, // 0xFE, with the size bits
+};
+
+#define INPUT_CONSTANT 0x01
+#define INPUT_VARIABLE 0x02
+
+#define MAX_USAGES 16     // Usages listed for one main item
+#define MAX_REPORT_IDS 16 // Input reports we keep the length of
+#define MAX_FIELD_BITS 24 // Read with one 32 bit load at any bit offset
+#define NO_KEY_BIT 0xFF
+
+typedef struct {
+  /* Global items */
+  uint16_t usage_page;
+  int32_t logical_min;
+  uint32_t report_size;
+  uint32_t report_count;
+  uint8_t report_id;
+  bool report_ids;
+  /* Local items, gone after every main item */
+  uint32_t usages[MAX_USAGES]; // page << 16 | usage
+  uint8_t usage_count;
+  uint32_t usage_min;
+  uint32_t usage_max;
+  bool usage_range;
+  /* Collections */
+  uint8_t depth;
+  uint8_t route; // of the top level collection we are in
+  /* Input reports so far, the bits of each */
+  struct {
+    uint8_t id;
+    uint16_t bits;
+  } inputs[MAX_REPORT_IDS];
+  uint8_t input_count;
+  /* What comes out */
+  hid_plan_t *plans;
+  uint8_t max_plans;
+  uint8_t plan_count;
+} parser_t;
+
+/**================================================== *
+ * ===============  Our own layout  ================= *
+ * ================================================== */
+
+/* Where a key goes in keyboard_report_t, counted in bits from the modifiers,
+ * it's the layout of TUD_HID_REPORT_DESC_LOGI_KB */
+uint8_t hid_key_bit(uint16_t usage) {
+  if (usage >= HID_KEY_A && usage <= HID_KEY_F24) {
+    return 8 + usage - HID_KEY_A;
+  }
+  if (usage >= HID_KEY_CONTROL_LEFT && usage <= HID_KEY_GUI_RIGHT) {
+    return usage - HID_KEY_CONTROL_LEFT;
+  }
+  if (usage >= HID_KEY_KANJI1 && usage <= HID_KEY_KANJI5) {
+    return 120 + usage - HID_KEY_KANJI1;
+  }
+  if (usage >= HID_KEY_LANG1 && usage <= HID_KEY_LANG3) {
+    return 125 + usage - HID_KEY_LANG1;
+  }
+  return NO_KEY_BIT;
+}
+
+static enum hid_route_e route_for(uint32_t usage) {
+  switch (usage) {
+  case HID_USAGE_PAGE_DESKTOP << 16 | HID_USAGE_DESKTOP_KEYBOARD:
+    return ROUTE_KEYBOARD;
+  case HID_USAGE_PAGE_DESKTOP << 16 | HID_USAGE_DESKTOP_MOUSE:
+    return ROUTE_MOUSE;
+  case HID_USAGE_PAGE_CONSUMER << 16 | HID_USAGE_CONSUMER_CONTROL:
+    return ROUTE_CONSUMER;
+  default:
+    return ROUTE_NONE;
+  }
+}
+
+/* Byte of mouse_report_t an axis goes to, 0 for none */
+static uint8_t mouse_axis(uint32_t usage, uint8_t *dst_size) {
+  switch (usage) {
+  case HID_USAGE_PAGE_DESKTOP << 16 | HID_USAGE_DESKTOP_X:
+    *dst_size = sizeof(int16_t);
+    return offsetof(mouse_report_t, x);
+  case HID_USAGE_PAGE_DESKTOP << 16 | HID_USAGE_DESKTOP_Y:
+    *dst_size = sizeof(int16_t);
+    return offsetof(mouse_report_t, y);
+  case HID_USAGE_PAGE_DESKTOP << 16 | HID_USAGE_DESKTOP_WHEEL:
+    *dst_size = sizeof(int8_t);
+    return offsetof(mouse_report_t, wheel);
+  case HID_USAGE_PAGE_CONSUMER << 16 | HID_USAGE_CONSUMER_AC_PAN:
+    *dst_size = sizeof(int8_t);
+    return offsetof(mouse_report_t, pan);
+  default:
+    return 0;
+  }
+}
+
+/**================================================== *
+ * ================  Compiling  ===================== *
+ * ================================================== */
+
+static hid_field_t *add_field(hid_plan_t *plan, uint16_t offset, uint8_t size,
+                              uint8_t count, uint8_t kind) {
+  if (plan->field_count == HID_PLAN_FIELDS ||
+      offset + size * count > 8 * CFG_TUH_HID_EPIN_BUFSIZE) {
+    return NULL;
+  }
+
+  hid_field_t *field = &plan->fields[plan->field_count++];
+  field->offset = offset;
+  field->size = size;
+  field->count = count;
+  field->kind = kind;
+  return field;
+}
+
+/* One bit of the report to one bit of ours, runs of them become one field */
+static void add_bit(hid_plan_t *plan, uint16_t offset, uint8_t dst) {
+  if (plan->field_count) {
+    hid_field_t *last = &plan->fields[plan->field_count - 1];
+    if (last->kind == HID_FIELD_BITS && last->offset + last->count == offset &&
+        last->dst + last->count == dst &&
+        offset < 8 * CFG_TUH_HID_EPIN_BUFSIZE) {
+      last->count++;
+      return;
+    }
+  }
+
+  hid_field_t *field = add_field(plan, offset, 1, 1, HID_FIELD_BITS);
+  if (field) {
+    field->dst = dst;
+  }
+}
+
+static void add_variable(parser_t *p, hid_plan_t *plan, uint32_t usage,
+                         uint16_t offset) {
+  uint16_t page = usage >> 16, id = usage & 0xFFFF;
+  uint8_t dst, dst_size;
+
+  if (plan->route == ROUTE_KEYBOARD) {
+    if (page == HID_USAGE_PAGE_KEYBOARD && p->report_size == 1 &&
+        (dst = hid_key_bit(id)) != NO_KEY_BIT) {
+      add_bit(plan, offset, dst);
+    }
+  } else if (plan->route == ROUTE_MOUSE) {
+    if (page == HID_USAGE_PAGE_BUTTON && p->report_size == 1 && id >= 1 &&
+        id <= 8 * sizeof(((mouse_report_t *)0)->buttons)) {
+      add_bit(plan, offset, id - 1);
+    } else if ((dst = mouse_axis(usage, &dst_size)) &&
+               p->report_size <= MAX_FIELD_BITS) {
+      hid_field_t *field =
+          add_field(plan, offset, p->report_size, 1, HID_FIELD_AXIS);
+      if (field) {
+        field->dst = dst;
+        field->dst_size = dst_size;
+        field->is_signed = p->logical_min < 0;
+      }
+    }
+  } else if (plan->route == ROUTE_CONSUMER) {
+    if (page == HID_USAGE_PAGE_CONSUMER && p->report_size == 1 && id &&
+        id <= CONSUMER_USAGE_MAX) {
+      hid_field_t *field = add_field(plan, offset, 1, 1, HID_FIELD_USAGE);
+      if (field) {
+        field->usage_base = id;
+      }
+    }
+  }
+}
+
+static hid_plan_t *plan_for(parser_t *p) {
+  for (uint8_t i = 0; i < p->plan_count; i++) {
+    if (p->plans[i].report_id == p->report_id) {
+      return p->plans[i].route == p->route ? &p->plans[i] : NULL;
+    }
+  }
+  if (p->plan_count == p->max_plans) {
+    return NULL;
+  }
+
+  hid_plan_t *plan = &p->plans[p->plan_count++];
+  memset(plan, 0, sizeof(*plan));
+  plan->report_id = p->report_id;
+  plan->route = p->route;
+  return plan;
+}
+
+static uint16_t *input_bits(parser_t *p) {
+  for (uint8_t i = 0; i < p->input_count; i++) {
+    if (p->inputs[i].id == p->report_id) {
+      return &p->inputs[i].bits;
+    }
+  }
+  if (p->input_count == MAX_REPORT_IDS) {
+    return NULL;
+  }
+  p->inputs[p->input_count].id = p->report_id;
+  p->inputs[p->input_count].bits = 0;
+  return &p->inputs[p->input_count++].bits;
+}
+
+static void parse_input(parser_t *p, uint32_t flags) {
+  uint16_t *bits = input_bits(p);
+  if (!bits) {
+    return;
+  }
+
+  uint16_t offset = *bits;
+  *bits += p->report_size * p->report_count;
+
+  hid_plan_t *plan = p->route != ROUTE_NONE ? plan_for(p) : NULL;
+  if (!plan || flags & INPUT_CONSTANT || !p->report_size) {
+    return;
+  }
+
+  /* An array of pressed keys, the value is the usage */
+  if (!(flags & INPUT_VARIABLE)) {
+    uint32_t first = p->usage_range ? p->usage_min : p->usages[0];
+    uint8_t kind;
+    if (plan->route == ROUTE_KEYBOARD &&
+        first >> 16 == HID_USAGE_PAGE_KEYBOARD) {
+      kind = HID_FIELD_KEYS;
+    } else if (plan->route == ROUTE_CONSUMER &&
+               first >> 16 == HID_USAGE_PAGE_CONSUMER) {
+      kind = HID_FIELD_USAGES;
+    } else {
+      return;
+    }
+    if (p->report_size <= MAX_FIELD_BITS && p->report_count <= UINT8_MAX) {
+      hid_field_t *field =
+          add_field(plan, offset, p->report_size, p->report_count, kind);
+      if (field) {
+        field->usage_base = (first & 0xFFFF) - p->logical_min;
+      }
+    }
+    return;
+  }
+
+  for (uint32_t i = 0; i < p->report_count; i++) {
+    uint32_t usage;
+    if (p->usage_range) {
+      usage = p->usage_min + i;
+      if (usage > p->usage_max) {
+        break;
+      }
+    } else if (p->usage_count) {
+      usage = p->usages[i < p->usage_count ? i : p->usage_count - 1];
+    } else {
+      break;
+    }
+    add_variable(p, plan, usage, offset + i * p->report_size);
+  }
+}
+
+/* Usages without a page of their own use the current one */
+static uint32_t full_usage(parser_t *p, uint8_t size, uint32_t data) {
+  return size == 4 ? data : (uint32_t)p->usage_page << 16 | data;
+}
+
+static void parse_item(parser_t *p, uint8_t item, uint8_t size,
+                       uint32_t data) {
+  switch (item) {
+  case ITEM_INPUT:
+    parse_input(p, data);
+    break;
+  case ITEM_COLLECTION:
+    if (p->depth++ == 0) {
+      p->route = route_for(p->usage_range ? p->usage_min : p->usages[0]);
+    }
+    break;
+  case ITEM_END_COLLECTION:
+    if (p->depth && --p->depth == 0) {
+      p->route = ROUTE_NONE;
+    }
+    break;
+  case ITEM_USAGE_PAGE:
+    p->usage_page = data;
+    break;
+  case ITEM_LOGICAL_MIN:
+    /* Sign extended from however many bytes it came in */
+    p->logical_min = size == 1   ? (int8_t)data
+                     : size == 2 ? (int16_t)data
+                                 : (int32_t)data;
+    break;
+  case ITEM_REPORT_SIZE:
+    p->report_size = data;
+    break;
+  case ITEM_REPORT_ID:
+    p->report_id = data;
+    p->report_ids = true;
+    break;
+  case ITEM_REPORT_COUNT:
+    p->report_count = data;
+    break;
+  case ITEM_USAGE:
+    if (p->usage_count < MAX_USAGES) {
+      p->usages[p->usage_count++] = full_usage(p, size, data);
+    }
+    break;
+  case ITEM_USAGE_MIN:
+    p->usage_min = full_usage(p, size, data);
+    p->usage_range = true;
+    break;
+  case ITEM_USAGE_MAX:
+    p->usage_max = full_usage(p, size, data);
+    break;
+  }
+
+  /* Main items use up the local ones */
+  if ((item & 0x0C) == 0) {
+    p->usage_count = 0;
+    p->usage_min = p->usage_max = 0;
+    p->usage_range = false;
+  }
+}
+
+static uint8_t compile(hid_plan_t *plans, uint8_t max_plans, bool *report_ids,
+                       uint8_t const *desc, uint16_t desc_len) {
+  parser_t p = {.plans = plans, .max_plans = max_plans};
+
+  while (desc_len) {
+    uint8_t header = *desc++;
+    desc_len--;
+
+    if ((header & 0xFC) == ITEM_LONG) {
+      /* Never used for anything we need, skip it */
+      uint16_t skip = desc_len >= 2 ? 2 + desc[0] : desc_len;
+      if (skip > desc_len) {
+        break;
+      }
+      desc += skip;
+      desc_len -= skip;
+      continue;
+    }
+
+    uint8_t size = header & 0x03;
+    size = size == 3 ? 4 : size;
+    if (size > desc_len) {
+      break;
+    }
+
+    uint32_t data = 0;
+    for (uint8_t i = 0; i < size; i++) {
+      data |= (uint32_t)desc[i] << (8 * i);
+    }
+    parse_item(&p, header & 0xFC, size, data);
+
+    desc += size;
+    desc_len -= size;
+  }
+
+  /* Shortest report that holds every field */
+  for (uint8_t i = 0; i < p.plan_count; i++) {
+    hid_plan_t *plan = &plans[i];
+    for (uint8_t f = 0; f < plan->field_count; f++) {
+      const hid_field_t *field = &plan->fields[f];
+      uint16_t end = field->offset + field->size * field->count;
+      if ((end + 7) / 8 > plan->min_len) {
+        plan->min_len = (end + 7) / 8;
+      }
+    }
+  }
+
+  if (report_ids) {
+    *report_ids = p.report_ids;
+  }
+  return p.plan_count;
+}
+
+/* Reports laid out like the ones we send are passed on as they are */
+static bool like_ours(const hid_plan_t *plan) {
+  static const uint8_t desc_kb[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+  static const uint8_t desc_ms[] = {TUD_HID_REPORT_DESC_LOGI_MS()};
+  static hid_plan_t ours[3]; // keyboard, mouse and consumer control
+  static bool compiled = false;
+
+  if (!compiled) {
+    compile(&ours[0], 1, NULL, desc_kb, sizeof(desc_kb));
+    compile(&ours[1], 2, NULL, desc_ms, sizeof(desc_ms));
+    compiled = true;
+  }
+
+  for (int i = 0; i < ARRAY_SIZE(ours); i++) {
+    if (plan->route == ours[i].route &&
+        plan->field_count == ours[i].field_count &&
+        !memcmp(plan->fields, ours[i].fields,
+                plan->field_count * sizeof(hid_field_t))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Plans for the input reports we pass on, at most max_plans. Core1, from
+ * tuh_hid_mount_cb(). */
+uint8_t parse_report_descriptor(hid_plan_t *plans, uint8_t max_plans,
+                                bool *report_ids, uint8_t const *desc,
+                                uint16_t desc_len) {
+  uint8_t count = compile(plans, max_plans, report_ids, desc, desc_len);
+
+  for (uint8_t i = 0; i < count; i++) {
+    plans[i].passthrough = like_ours(&plans[i]);
+  }
+  return count;
+}
+
+/* In boot protocol, devices send the layout of HID 1.11 appendix B */
+const hid_plan_t *hid_boot_plan(uint8_t itf_protocol) {
+  static const uint8_t desc_kb[] = {
+      0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+      0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+      0x75, 0x08, 0x81, 0x01, 0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65,
+      0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0};
+  static const uint8_t desc_ms[] = {
+      0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+      0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+      0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+      0x09, 0x31, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x02, 0x81, 0x06,
+      0xC0, 0xC0};
+  static hid_plan_t keyboard, mouse;
+
+  if (itf_protocol == HID_ITF_PROTOCOL_KEYBOARD) {
+    if (!keyboard.route) {
+      compile(&keyboard, 1, NULL, desc_kb, sizeof(desc_kb));
+    }
+    return &keyboard;
+  }
+  if (itf_protocol == HID_ITF_PROTOCOL_MOUSE) {
+    if (!mouse.route) {
+      compile(&mouse, 1, NULL, desc_ms, sizeof(desc_ms));
+    }
+    return &mouse;
+  }
+  return NULL;
+}
+
+/**================================================== *
+ * ===============  Translating  ==================== *
+ * ================================================== */
+
+/* Fields are at most MAX_FIELD_BITS wide, one load at the byte they start in
+ * always holds all of them */
+static inline uint32_t read_bits(const uint8_t *raw, uint16_t offset,
+                                 uint8_t size) {
+  uint32_t word;
+  memcpy(&word, &raw[offset >> 3], sizeof(word));
+  return (word >> (offset & 7)) & ((1u << size) - 1);
+}
+
+static inline int32_t clamp(int32_t value, int32_t min, int32_t max) {
+  return value < min ? min : value > max ? max : value;
+}
+
+/* Into the next free usage slot of consumer_report_t, what doesn't fit is
+ * left out */
+static inline void add_usage(hid_translated_t *out, uint8_t *slots,
+                             int32_t usage) {
+  if (usage <= 0 || usage > CONSUMER_USAGE_MAX ||
+      *slots == CONSUMER_USAGE_SLOTS) {
+    return;
+  }
+  uint16_t value = usage;
+  memcpy(&out->consumer.logitech[sizeof(value) * (*slots)++], &value,
+         sizeof(value));
+}
+
+/* A report of a device laid out differently into ours, returns its length.
+ * The caller made sure the report is at least plan->min_len long. Core1. */
+uint8_t __not_in_flash_func(hid_translate)(const hid_plan_t *plan,
+                                           uint8_t const *report, uint16_t len,
+                                           hid_translated_t *out) {
+  /* Padded, so reads near the end don't need a check */
+  uint8_t raw[CFG_TUH_HID_EPIN_BUFSIZE + sizeof(uint32_t)];
+  len = len < CFG_TUH_HID_EPIN_BUFSIZE ? len : CFG_TUH_HID_EPIN_BUFSIZE;
+  memcpy(raw, report, len);
+  memset(&raw[len], 0, sizeof(uint32_t));
+
+  memset(out, 0, sizeof(*out));
+  uint8_t slots = 0;
+
+  for (uint8_t i = 0; i < plan->field_count; i++) {
+    const hid_field_t *field = &plan->fields[i];
+
+    switch (field->kind) {
+    case HID_FIELD_BITS:
+      /* A byte at a time, it can straddle two of ours */
+      for (uint8_t done = 0; done < field->count; done += 8) {
+        uint8_t count = field->count - done < 8 ? field->count - done : 8;
+        uint16_t dst = field->dst + done;
+        uint16_t bits = read_bits(raw, field->offset + done, count)
+                        << (dst & 7);
+        out->bytes[dst >> 3] |= bits;
+        out->bytes[(dst >> 3) + 1] |= bits >> 8;
+      }
+      break;
+
+    case HID_FIELD_KEYS:
+      for (uint8_t k = 0; k < field->count; k++) {
+        uint32_t value =
+            read_bits(raw, field->offset + k * field->size, field->size);
+        uint8_t bit = hid_key_bit(value + field->usage_base);
+        if (bit != NO_KEY_BIT) {
+          out->bytes[bit >> 3] |= 1 << (bit & 7);
+        }
+      }
+      break;
+
+    case HID_FIELD_AXIS: {
+      int32_t value = read_bits(raw, field->offset, field->size);
+      if (field->is_signed) {
+        uint8_t shift = 32 - field->size;
+        value = (int32_t)((uint32_t)value << shift) >> shift;
+      }
+      if (field->dst_size == sizeof(int16_t)) {
+        int16_t axis = clamp(value, INT16_MIN, INT16_MAX);
+        memcpy(&out->bytes[field->dst], &axis, sizeof(axis));
+      } else {
+        out->bytes[field->dst] = (int8_t)clamp(value, INT8_MIN, INT8_MAX);
+      }
+      break;
+    }
+
+    case HID_FIELD_USAGES:
+      for (uint8_t k = 0; k < field->count; k++) {
+        uint32_t value =
+            read_bits(raw, field->offset + k * field->size, field->size);
+        add_usage(out, &slots, (int32_t)value + field->usage_base);
+      }
+      break;
+
+    case HID_FIELD_USAGE:
+      if (read_bits(raw, field->offset, 1)) {
+        add_usage(out, &slots, field->usage_base);
+      }
+      break;
+    }
+  }
+
+  switch (plan->route) {
+  case ROUTE_KEYBOARD:
+    return sizeof(keyboard_report_t);
+  case ROUTE_CONSUMER:
+    return sizeof(consumer_report_t);
+  default:
+    return sizeof(mouse_report_t);
+  }
+}
@@ -0,0 +1,57 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Small helpers shared by the host benchmarks */
+
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* Keeps the compiler from optimizing away a computed value */
+static inline void bench_keep(const void *p) {
+  __asm__ volatile("" : : "r"(p) : "memory");
+}
+
+static inline void bench_print(const char *name, uint64_t elapsed_ns,
+                               uint64_t iterations) {
+  printf("%-40s %10.1f ns/op  (%llu ops)\n", name,
+         (double)elapsed_ns / (double)iterations,
+         (unsigned long long)iterations);
+}
+
+static int bench_cmp_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/* Sorts samples in place, p is given in percent */
+static inline uint64_t bench_percentile(uint64_t *samples, size_t count,
+                                        double p) {
+  if (!count) {
+    return 0;
+  }
+  qsort(samples, count, sizeof(uint64_t), bench_cmp_u64);
+  size_t idx = (size_t)((p / 100.0) * (double)(count - 1) + 0.5);
+  return samples[idx];
+}
@@ -0,0 +1,258 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compiles the report descriptors of a few real devices into plans, checks
+ * that a sample report of each comes out in our layout, and times both the
+ * compiling (once per mount) and the translating (once per report). Exits
+ * non-zero if a report comes out wrong.
+ */
+
+#include "bench.h"
+#include "host.h"
+
+#define MOUNTS 100000
+#define ITERATIONS 10000000
+#define MAX_PLANS 32 // MAX_REPORT of tusb_h.c
+
+typedef struct {
+  const char *name;
+  const uint8_t *desc;
+  uint16_t desc_len;
+  const uint8_t *report; // with the report ID, if the device uses them
+  uint16_t len;
+  hid_translated_t expected;
+} sample_t;
+
+/* HID 1.11 appendix B.1, what most cheap keyboards send in report protocol
+ * too. Left shift, A and B held. */
+static const uint8_t boot_kb_desc[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x08, 0x81, 0x01, 0x95, 0x05, 0x75, 0x01, 0x05, 0x08, 0x19, 0x01,
+    0x29, 0x05, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x01, 0x95, 0x06,
+    0x75, 0x08, 0x15, 0x00, 0x25, 0x65, 0x05, 0x07, 0x19, 0x00, 0x29, 0x65,
+    0x81, 0x00, 0xC0};
+static const uint8_t boot_kb_report[] = {0x02, 0, 0x04, 0x05, 0, 0, 0, 0};
+
+/* QMK's NKRO keyboard: a bitmap of usages 0x00-0xEF behind report ID 6 */
+static const uint8_t nkro_kb_desc[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x85, 0x06, 0x05, 0x07, 0x19, 0xE0,
+    0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x95, 0x08, 0x75, 0x01, 0x81, 0x02,
+    0x05, 0x07, 0x19, 0x00, 0x29, 0xEF, 0x15, 0x00, 0x25, 0x01, 0x95, 0xF0,
+    0x75, 0x01, 0x81, 0x02, 0x05, 0x08, 0x19, 0x01, 0x29, 0x05, 0x95, 0x05,
+    0x75, 0x01, 0x91, 0x02, 0x95, 0x01, 0x75, 0x03, 0x91, 0x03, 0xC0};
+/* Left shift, A and B, LANG1 */
+static const uint8_t nkro_kb_report[] = {
+    0x06, 0x02, 0x30, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0,    0,    0,    0, 0x01, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
+
+/* Three buttons, 8 bit axes and a wheel, the usual cheap optical mouse.
+ * Left button, x -5, y 3, wheel 1. */
+static const uint8_t basic_ms_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x09, 0x01, 0xA1, 0x00, 0x05, 0x09,
+    0x19, 0x01, 0x29, 0x03, 0x15, 0x00, 0x25, 0x01, 0x95, 0x03, 0x75, 0x01,
+    0x81, 0x02, 0x95, 0x01, 0x75, 0x05, 0x81, 0x01, 0x05, 0x01, 0x09, 0x30,
+    0x09, 0x31, 0x09, 0x38, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x03,
+    0x81, 0x06, 0xC0, 0xC0};
+static const uint8_t basic_ms_report[] = {0x01, 0xFB, 0x03, 0x01};
+
+/* Mouse of a Logitech Unifying receiver: report ID 2, 16 buttons, 12 bit
+ * axes. Left button, x -5, y 3, wheel 1. */
+static const uint8_t unifying_ms_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x02, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x10, 0x15, 0x00, 0x25, 0x01, 0x95, 0x10,
+    0x75, 0x01, 0x81, 0x02, 0x05, 0x01, 0x16, 0x01, 0xF8, 0x26, 0xFF, 0x07,
+    0x75, 0x0C, 0x95, 0x02, 0x09, 0x30, 0x09, 0x31, 0x81, 0x06, 0x15, 0x81,
+    0x25, 0x7F, 0x75, 0x08, 0x95, 0x01, 0x09, 0x38, 0x81, 0x06, 0x05, 0x0C,
+    0x0A, 0x38, 0x02, 0x95, 0x01, 0x81, 0x06, 0xC0, 0xC0};
+static const uint8_t unifying_ms_report[] = {0x02, 0x01, 0x00, 0xFB,
+                                             0x3F, 0x00, 0x01, 0x00};
+
+/* Gaming mouse with report ID 1, five buttons and 16 bit axes. Right button,
+ * x -300, y 200, wheel -1, pan 2. */
+static const uint8_t gaming_ms_desc[] = {
+    0x05, 0x01, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x01, 0x09, 0x01, 0xA1, 0x00,
+    0x05, 0x09, 0x19, 0x01, 0x29, 0x05, 0x15, 0x00, 0x25, 0x01, 0x95, 0x05,
+    0x75, 0x01, 0x81, 0x02, 0x95, 0x01, 0x75, 0x03, 0x81, 0x01, 0x05, 0x01,
+    0x16, 0x01, 0x80, 0x26, 0xFF, 0x7F, 0x75, 0x10, 0x95, 0x02, 0x09, 0x30,
+    0x09, 0x31, 0x81, 0x06, 0x15, 0x81, 0x25, 0x7F, 0x75, 0x08, 0x95, 0x01,
+    0x09, 0x38, 0x81, 0x06, 0x05, 0x0C, 0x0A, 0x38, 0x02, 0x95, 0x01, 0x81,
+    0x06, 0xC0, 0xC0};
+static const uint8_t gaming_ms_report[] = {0x01, 0x02, 0xD4, 0xFE,
+                                           0xC8, 0x00, 0xFF, 0x02};
+
+/* Consumer control of most keyboards and receivers: one 16 bit usage behind
+ * report ID 2, 2 bytes. Volume up. */
+static const uint8_t generic_cc_desc[] = {
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x85, 0x02, 0x15, 0x00, 0x26, 0x3C,
+    0x02, 0x19, 0x00, 0x2A, 0x3C, 0x02, 0x75, 0x10, 0x95, 0x01, 0x81, 0x00,
+    0xC0};
+static const uint8_t generic_cc_report[] = {0x02, 0xE9, 0x00};
+
+/* Media keys as a bitmap: next, previous, stop, play/pause, mute, volume up
+ * and down, one padding bit. Mute and volume down held. */
+static const uint8_t bitmap_cc_desc[] = {
+    0x05, 0x0C, 0x09, 0x01, 0xA1, 0x01, 0x15, 0x00, 0x25, 0x01, 0x75,
+    0x01, 0x95, 0x07, 0x09, 0xB5, 0x09, 0xB6, 0x09, 0xB7, 0x09, 0xCD,
+    0x09, 0xE2, 0x09, 0xE9, 0x09, 0xEA, 0x81, 0x02, 0x95, 0x01, 0x81,
+    0x01, 0xC0};
+static const uint8_t bitmap_cc_report[] = {0x50};
+
+/* Ours, as the Logitech MX devices send them */
+static const uint8_t logi_kb_desc[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+static const uint8_t logi_kb_report[16] = {0x02, 0x03};
+static const uint8_t logi_ms_desc[] = {TUD_HID_REPORT_DESC_LOGI_MS()};
+static const uint8_t logi_ms_report[] = {0x00, 0x01, 0x00, 0xFB, 0xFF,
+                                         0x03, 0x00, 0x01, 0x00};
+static const uint8_t logi_cc_report[] = {0x03, 0xE9, 0x00, 0x00, 0x00, 0x08};
+
+#define SAMPLE(_name, _desc, _report, ...)                                     \
+  {_name, _desc, sizeof(_desc), _report, sizeof(_report), {__VA_ARGS__}}
+
+static const sample_t samples[] = {
+    SAMPLE("boot keyboard", boot_kb_desc, boot_kb_report,
+           .keyboard = {0x02, {0x03}}),
+    SAMPLE("QMK NKRO keyboard", nkro_kb_desc, nkro_kb_report,
+           .keyboard = {0x02, {0x03, [14] = 0x20}}),
+    SAMPLE("basic mouse, 8 bit axes", basic_ms_desc, basic_ms_report,
+           .mouse = {{0x01, 0}, -5, 3, 1, 0}),
+    SAMPLE("Unifying mouse, 12 bit axes", unifying_ms_desc, unifying_ms_report,
+           .mouse = {{0x01, 0}, -5, 3, 1, 0}),
+    SAMPLE("gaming mouse, 16 bit axes", gaming_ms_desc, gaming_ms_report,
+           .mouse = {{0x02, 0}, -300, 200, -1, 2}),
+    SAMPLE("Logitech MX keyboard (ours)", logi_kb_desc, logi_kb_report,
+           .keyboard = {0x02, {0x03}}),
+    SAMPLE("Logitech MX mouse (ours)", logi_ms_desc, logi_ms_report,
+           .mouse = {{0x01, 0}, -5, 3, 1, 0}),
+    SAMPLE("consumer control, one usage", generic_cc_desc, generic_cc_report,
+           .consumer = {{0xE9, 0x00}, 0}),
+    SAMPLE("consumer control, bitmap", bitmap_cc_desc, bitmap_cc_report,
+           .consumer = {{0xE2, 0x00, 0xEA, 0x00}, 0}),
+    SAMPLE("Logitech MX consumer control (ours)", logi_ms_desc, logi_cc_report,
+           .consumer = {{0xE9, 0x00}, 0x08}),
+};
+
+static const char *const route_names[ROUTE_COUNT] = {
+    [ROUTE_NONE] = "none",
+    [ROUTE_KEYBOARD] = "keyboard",
+    [ROUTE_MOUSE] = "mouse",
+    [ROUTE_CONSUMER] = "consumer",
+};
+
+/* The plan for the sample's report, like tuh_hid_report_received_cb() */
+static const hid_plan_t *find_plan(const hid_plan_t *plans, uint8_t count,
+                                   bool report_ids, const uint8_t **report,
+                                   uint16_t *len) {
+  uint8_t report_id = 0;
+  if (report_ids) {
+    report_id = (*report)[0];
+    (*report)++;
+    (*len)--;
+  }
+  for (uint8_t i = 0; i < count; i++) {
+    if (plans[i].report_id == report_id) {
+      return &plans[i];
+    }
+  }
+  return NULL;
+}
+
+static bool run_sample(const sample_t *sample) {
+  hid_plan_t plans[MAX_PLANS];
+  bool report_ids;
+  char name[64];
+
+  uint8_t count = parse_report_descriptor(
+      plans, MAX_PLANS, &report_ids, sample->desc, sample->desc_len);
+
+  const uint8_t *report = sample->report;
+  uint16_t len = sample->len;
+  const hid_plan_t *plan = find_plan(plans, count, report_ids, &report, &len);
+  if (!plan) {
+    printf("%s: no plan for the report\n", sample->name);
+    return false;
+  }
+
+  printf("%s: %u plan(s), %s, %u fields, min %u bytes%s\n", sample->name,
+         count, route_names[plan->route], plan->field_count, plan->min_len,
+         plan->passthrough ? ", passed on as it is" : "");
+
+  /* Passed on reports have to be ours already */
+  hid_translated_t out;
+  uint8_t out_len = len;
+  if (plan->passthrough) {
+    memset(&out, 0, sizeof(out));
+    memcpy(out.bytes, report, len);
+  } else {
+    out_len = hid_translate(plan, report, len, &out);
+  }
+
+  size_t ours = plan->route == ROUTE_KEYBOARD   ? sizeof(keyboard_report_t)
+                : plan->route == ROUTE_CONSUMER ? sizeof(consumer_report_t)
+                                                : sizeof(mouse_report_t);
+  bool ok = out_len == ours && !memcmp(&out, &sample->expected, ours);
+  if (!ok) {
+    printf("  WRONG:");
+    for (size_t i = 0; i < ours; i++) {
+      printf(" %02x/%02x", out.bytes[i], sample->expected.bytes[i]);
+    }
+    printf(" (got/expected)\n");
+  }
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < MOUNTS; i++) {
+    parse_report_descriptor(plans, MAX_PLANS, &report_ids, sample->desc,
+                            sample->desc_len);
+    bench_keep(plans);
+  }
+  snprintf(name, sizeof(name), "  compile, %u byte descriptor",
+           sample->desc_len);
+  bench_print(name, bench_now_ns() - start, MOUNTS);
+
+  if (!plan->passthrough) {
+    start = bench_now_ns();
+    for (int i = 0; i < ITERATIONS; i++) {
+      hid_translate(plan, report, len, &out);
+      bench_keep(&out);
+    }
+    bench_print("  translate a report", bench_now_ns() - start, ITERATIONS);
+  }
+  return ok;
+}
+
+int main(void) {
+  bool ok = true;
+
+  /* The baseline, what a report passed on as it is costs */
+  hid_translated_t out;
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    memcpy(out.bytes, logi_kb_report, sizeof(logi_kb_report));
+    bench_keep(&out);
+  }
+  bench_print("memcpy of a keyboard report", bench_now_ns() - start,
+              ITERATIONS);
+  printf("\n");
+
+  for (int i = 0; i < ARRAY_SIZE(samples); i++) {
+    ok &= run_sample(&samples[i]);
+  }
+
+  printf("\n%s\n", ok ? "all reports translated correctly"
+                      : "some reports came out wrong");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,145 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Cost of the hotkey check per keyboard report, the firmware's mask table
+ * against the previous per key byte compare (kept here as a reference).
+ */
+
+#include "bench.h"
+#include "host.h"
+
+#define ITERATIONS 10000000
+
+/* The previous layout of hotkeys.h, same combos in the same order */
+typedef struct {
+  uint8_t modifier;
+  uint8_t keys[14];
+  uint8_t key_count;
+} byte_hotkey_t;
+
+#define RALT_RSHIFT (KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT)
+
+static byte_hotkey_t byte_hotkeys[] = {
+    {0, {HID_KEY_CAPS_LOCK}, 1},   {RALT_RSHIFT, {HID_KEY_L}, 1},
+    {RALT_RSHIFT, {HID_KEY_Q}, 1}, {RALT_RSHIFT, {HID_KEY_S}, 1},
+    {RALT_RSHIFT, {HID_KEY_D}, 1}, {RALT_RSHIFT, {HID_KEY_R}, 1},
+};
+
+static bool byte_key_in_report(uint8_t key, const keyboard_report_t *report) {
+  uint8_t val = 1 << get_pos_in_byte(key);
+  return report->keycode[get_byte_offset(key)] == val;
+}
+
+static bool byte_check_hotkey(byte_hotkey_t keypress,
+                              const keyboard_report_t *report) {
+  if (keypress.modifier != (report->modifier & keypress.modifier))
+    return false;
+
+  for (int n = 0; n < keypress.key_count; n++) {
+    if (!byte_key_in_report(keypress.keys[n], report)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static int byte_check_all(const keyboard_report_t *report) {
+  for (int n = 0; n < ARRAY_SIZE(byte_hotkeys); n++) {
+    if (byte_check_hotkey(byte_hotkeys[n], report)) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+static keyboard_report_t make_report(uint8_t modifier, uint8_t key1,
+                                     uint8_t key2) {
+  keyboard_report_t report = {.modifier = modifier};
+  uint8_t keys[] = {key1, key2};
+  for (int i = 0; i < 2; i++) {
+    if (keys[i]) {
+      report.keycode[get_byte_offset(keys[i])] |= 1 << get_pos_in_byte(keys[i]);
+    }
+  }
+  return report;
+}
+
+/* Index into byte_hotkeys of whatever the firmware matched */
+static int mask_check_all(const keyboard_report_t *report) {
+  const hotkey_combo_t *hotkey = check_all_hotkeys(report);
+  for (int n = 0; hotkey && n < ARRAY_SIZE(byte_hotkeys); n++) {
+    keyboard_report_t mask = make_report(byte_hotkeys[n].modifier,
+                                         byte_hotkeys[n].keys[0], 0);
+    if (!memcmp(&mask, &hotkey->mask.report, sizeof(mask))) {
+      return n;
+    }
+  }
+  return -1;
+}
+
+typedef struct {
+  const char *name;
+  keyboard_report_t report;
+} sample_t;
+
+int main(void) {
+  const sample_t samples[] = {
+      {"no key", make_report(0, 0, 0)},
+      {"one letter", make_report(0, HID_KEY_E, 0)},
+      {"shift + two letters", make_report(KEYBOARD_MODIFIER_LEFTSHIFT,
+                                          HID_KEY_E, HID_KEY_X)},
+      {"caps lock", make_report(0, HID_KEY_CAPS_LOCK, 0)},
+      {"caps lock + slash", make_report(0, HID_KEY_CAPS_LOCK, HID_KEY_SLASH)},
+      {"ralt+rshift+R", make_report(RALT_RSHIFT, HID_KEY_R, 0)},
+      {"ralt+rshift+R + T", make_report(RALT_RSHIFT, HID_KEY_R, HID_KEY_T)},
+  };
+
+  /* The hotkeys come from the config the board boots with */
+  host_boot();
+
+  printf("%-24s %10s %10s\n", "report", "byte", "mask");
+  for (size_t i = 0; i < ARRAY_SIZE(samples); i++) {
+    printf("%-24s %10d %10d\n", samples[i].name,
+           byte_check_all(&samples[i].report),
+           mask_check_all(&samples[i].report));
+  }
+  printf("(index of the matching hotkey, -1 for none)\n\n");
+
+  volatile int sink = 0;
+  for (size_t i = 0; i < ARRAY_SIZE(samples); i++) {
+    char name[64];
+    const keyboard_report_t *report = &samples[i].report;
+
+    uint64_t start = bench_now_ns();
+    for (int n = 0; n < ITERATIONS; n++) {
+      bench_keep(report);
+      sink += byte_check_all(report);
+    }
+    snprintf(name, sizeof(name), "byte compare, %s", samples[i].name);
+    bench_print(name, bench_now_ns() - start, ITERATIONS);
+
+    start = bench_now_ns();
+    for (int n = 0; n < ITERATIONS; n++) {
+      bench_keep(report);
+      sink += check_all_hotkeys(report) != NULL;
+    }
+    snprintf(name, sizeof(name), "mask table, %s", samples[i].name);
+    bench_print(name, bench_now_ns() - start, ITERATIONS);
+  }
+
+  return 0;
+}
@@ -0,0 +1,231 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * UART link integrity: CRC-16 throughput, and how fast the receiver gets
+ * back in sync after a corrupted byte, for both packet versions.
+ *
+ * The resync test encodes a stream of mouse frames with uart_send_packet(),
+ * corrupts one byte (flipped or dropped) every CORRUPT_EVERY frames and feeds
+ * it back one byte at a time, running a core1 pass after every byte.
+ */
+
+#include "bench.h"
+#include "host.h"
+
+#define ITERATIONS 1000000
+#define FRAMES 100000
+#define CORRUPT_EVERY 50
+#define BAUD 3686400
+#define BITS_PER_BYTE 10
+
+static uint8_t frame[64];
+static size_t frame_len;
+
+static uint8_t stream[FRAMES * RAW_PACKET_LENGTH];
+static size_t stream_len;
+static size_t stream_pos;
+
+static mouse_report_t sent[FRAMES];
+static size_t delivered_at[FRAMES]; // stream offset, 0 if never delivered
+static uint32_t delivered_bad;
+
+static device_t *state;
+static uint32_t rand_state = 1;
+
+static uint32_t rand_next(void) {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 17;
+  rand_state ^= rand_state << 5;
+  return rand_state;
+}
+
+static void capture_uart(void *ctx, const uint8_t *src, size_t len) {
+  (void)ctx;
+  if (frame_len + len <= sizeof(frame)) {
+    memcpy(&frame[frame_len], src, len);
+    frame_len += len;
+  }
+}
+
+static bool capture_report(void *ctx, uint8_t instance, uint8_t report_id,
+                           void const *report, uint16_t len) {
+  (void)ctx;
+  (void)report_id;
+  mouse_report_t ms;
+  if (instance != ITF_NUM_HID_MS || len != sizeof(ms)) {
+    return true;
+  }
+
+  memcpy(&ms, report, sizeof(ms));
+  size_t seq = (size_t)ms.buttons[1] << 16 | (uint16_t)ms.x;
+  if (seq < FRAMES && !delivered_at[seq] &&
+      !memcmp(&sent[seq], &ms, sizeof(ms))) {
+    delivered_at[seq] = stream_pos;
+  } else {
+    delivered_bad++;
+  }
+  return true;
+}
+
+/**================================================== *
+ * =================  CRC throughput  =============== *
+ * ================================================== */
+
+static void bench_crc(void) {
+  static const uint8_t check[] = "123456789";
+  uint16_t crc = calc_crc16(check, sizeof(check) - 1);
+  printf("crc16 check value 0x%04X (%s)\n", crc,
+         crc == 0x29B1 ? "ok" : "expected 0x29B1");
+
+  static uint8_t data[4096];
+  for (size_t i = 0; i < sizeof(data); i++) {
+    data[i] = (uint8_t)rand_next();
+  }
+
+  volatile uint32_t sink = 0;
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += calc_crc16(&data[i & 0xFF], COBS_DATA_LENGTH - CRC_LENGTH);
+  }
+  bench_print("crc16 over one packet", bench_now_ns() - start, ITERATIONS);
+
+  start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    sink += calc_checksum(&data[i & 0xFF], PACKET_DATA_LENGTH);
+  }
+  bench_print("xor checksum over one packet", bench_now_ns() - start,
+              ITERATIONS);
+
+  int rounds = ITERATIONS / 100;
+  start = bench_now_ns();
+  for (int i = 0; i < rounds; i++) {
+    sink += calc_crc16(data, sizeof(data));
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  printf("%-40s %10.1f MB/s\n", "crc16 bulk",
+         (double)rounds * sizeof(data) * 1000.0 / (double)elapsed);
+  bench_keep((const void *)&sink);
+}
+
+/**================================================== *
+ * ===================  Resync  ===================== *
+ * ================================================== */
+
+static void run_resync(uint8_t version) {
+  size_t corrupt_at[FRAMES / CORRUPT_EVERY + 1];
+  size_t corrupt_frame[FRAMES / CORRUPT_EVERY + 1];
+  size_t frame_end[FRAMES];
+  size_t events = 0;
+
+  rand_state = 1;
+  stream_len = 0;
+  memset(delivered_at, 0, sizeof(delivered_at));
+  delivered_bad = 0;
+
+  /* Payloads carry 0xAA 0x55 and zeros on purpose */
+  for (size_t i = 0; i < FRAMES; i++) {
+    sent[i] = (mouse_report_t){
+        .buttons = {0, (uint8_t)(i >> 16)}, .x = (int16_t)i, .y = 0x55AA};
+
+    state->peer_link_version = version;
+    frame_len = 0;
+    uart_send_packet(MOUSE_REPORT_MSG, ITF_NUM_HID_MS, REPORT_ID_MOUSE,
+                     sizeof(mouse_report_t), (uint8_t *)&sent[i]);
+
+    size_t start = stream_len;
+    memcpy(&stream[stream_len], frame, frame_len);
+    stream_len += frame_len;
+
+    if (i % CORRUPT_EVERY == CORRUPT_EVERY / 2) {
+      size_t pos = start + rand_next() % frame_len;
+      if (rand_next() & 1) {
+        stream[pos] ^= 1 + rand_next() % 0xFF;
+      } else {
+        memmove(&stream[pos], &stream[pos + 1], stream_len - pos - 1);
+        stream_len--;
+      }
+      corrupt_at[events] = pos;
+      corrupt_frame[events++] = i;
+    }
+    frame_end[i] = stream_len;
+  }
+
+  for (stream_pos = 0; stream_pos < stream_len; stream_pos++) {
+    host_uart_rx_push(&stream[stream_pos], 1);
+    host_core1_pass();
+    host_core0_pass();
+    /* the PC picked it up, so the next one isn't merged into a queue */
+    tud_hid_report_complete_cb(ITF_NUM_HID_MS, NULL, 0);
+  }
+
+  /* Everything between a corrupted byte and the next delivered frame */
+  uint64_t lost = 0, resync_bytes = 0, resync_max = 0;
+  for (size_t e = 0; e < events; e++) {
+    size_t f = corrupt_frame[e];
+    while (f < FRAMES && !delivered_at[f]) {
+      lost++;
+      f++;
+    }
+    if (f == FRAMES) {
+      continue;
+    }
+    /* Ideally the frame after the corrupted one is complete at frame_end */
+    size_t bytes = delivered_at[f] - corrupt_at[e];
+    size_t ideal = frame_end[corrupt_frame[e] + 1] - 1 - corrupt_at[e];
+    size_t extra = bytes > ideal ? bytes - ideal : 0;
+    resync_bytes += extra;
+    resync_max = extra > resync_max ? extra : resync_max;
+  }
+
+  uint64_t delivered = 0;
+  for (size_t i = 0; i < FRAMES; i++) {
+    delivered += delivered_at[i] != 0;
+  }
+
+  uart_stats_t *stats = &state->uart_stats;
+  printf("version %u: %d frames, %zu bytes, %zu corrupted\n", version, FRAMES,
+         stream_len, events);
+  printf("  delivered %llu, corrupt delivered %u, lost per error %.2f\n",
+         (unsigned long long)delivered, delivered_bad,
+         events ? (double)lost / (double)events : 0.0);
+  printf("  resync beyond the next frame: mean %.1f bytes (%.1f us), "
+         "max %llu bytes (%.1f us)\n",
+         events ? (double)resync_bytes / (double)events : 0.0,
+         events ? (double)resync_bytes * BITS_PER_BYTE * 1e6 / BAUD / events
+                : 0.0,
+         (unsigned long long)resync_max,
+         (double)resync_max * BITS_PER_BYTE * 1e6 / BAUD);
+  printf("  rx packets %u, checksum errors %u, resyncs %u, rejected %u\n",
+         stats->rx_packets, stats->rx_checksum_errors, stats->rx_resyncs,
+         stats->rx_rejected);
+  memset(stats, 0, sizeof(*stats));
+}
+
+int main(void) {
+  host_hooks_t hooks = {.uart_write = capture_uart,
+                        .hid_report = capture_report};
+  state = host_board()->state;
+  host_set_hooks(&hooks);
+  host_boot();
+  tud_mount_cb();
+
+  bench_crc();
+  run_resync(1);
+  run_resync(2);
+
+  return 0;
+}
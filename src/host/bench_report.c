@@ -0,0 +1,139 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hot path micro benchmarks for the report pipeline of one board:
+ * host report -> hotkeys -> local device report or UART frame,
+ * and UART frame -> parser -> device report. Exits non-zero if the suspend
+ * hotkey's report doesn't reach the PC.
+ */
+
+#include "bench.h"
+#include "host.h"
+
+#define ITERATIONS 1000000
+
+static const uint8_t desc_kb[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+/* The HID 1.11 appendix B layout most keyboards use, translated into ours */
+static const uint8_t desc_kb_6kro[] = {
+    0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, 0x05, 0x07, 0x19, 0xE0, 0x29, 0xE7,
+    0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02, 0x95, 0x01,
+    0x75, 0x08, 0x81, 0x01, 0x95, 0x06, 0x75, 0x08, 0x15, 0x00, 0x25, 0x65,
+    0x05, 0x07, 0x19, 0x00, 0x29, 0x65, 0x81, 0x00, 0xC0};
+static const uint8_t desc_ms[] = {
+    TUD_HID_REPORT_DESC_LOGI_MS(HID_REPORT_ID(REPORT_ID_MOUSE))};
+
+static uint8_t last_frame[64];
+static size_t last_frame_len;
+
+static void capture_uart(void *ctx, const uint8_t *src, size_t len) {
+  (void)ctx;
+  last_frame_len = len < sizeof(last_frame) ? len : sizeof(last_frame);
+  memcpy(last_frame, src, last_frame_len);
+}
+
+static keyboard_report_t last_keyboard;
+static uint32_t keyboard_reports;
+
+static bool capture_hid(void *ctx, uint8_t instance, uint8_t report_id,
+                        void const *report, uint16_t len) {
+  (void)ctx;
+  if (instance == ITF_NUM_HID_KB && report_id == REPORT_ID_KEYBOARD &&
+      len == sizeof(last_keyboard)) {
+    memcpy(&last_keyboard, report, len);
+    keyboard_reports++;
+  }
+  return true;
+}
+
+static void bench_host_report(const char *name, uint8_t dev_addr,
+                              uint8_t instance, const uint8_t *report,
+                              uint16_t len) {
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    tuh_hid_report_received_cb(dev_addr, instance, report, len);
+    host_core0_pass();
+    /* the PC picked it up, so the next one isn't merged into a queue */
+    tud_hid_report_complete_cb(instance, report, len);
+  }
+  bench_print(name, bench_now_ns() - start, ITERATIONS);
+}
+
+int main(void) {
+  host_hooks_t hooks = {.uart_write = capture_uart, .hid_report = capture_hid};
+  host_set_hooks(&hooks);
+  host_boot();
+
+  tud_mount_cb();
+  tuh_hid_mount_cb(1, 0, desc_kb, sizeof(desc_kb));
+  tuh_hid_mount_cb(1, 1, desc_ms, sizeof(desc_ms));
+  tuh_hid_mount_cb(2, 0, desc_kb_6kro, sizeof(desc_kb_6kro));
+
+  const uint8_t kb_boot[8] = {0, 0, HID_KEY_A};
+  uint8_t kb_bitmap[16] = {0};
+  kb_bitmap[1 + get_byte_offset(HID_KEY_A)] = 1 << get_pos_in_byte(HID_KEY_A);
+  const uint8_t ms[9] = {REPORT_ID_MOUSE, 0, 0, 3, 0, 0xfd, 0xff, 0, 0};
+
+  printf("%s, %d iterations\n", BOARD_NAME, ITERATIONS);
+
+  set_active_output(BOARD_ROLE);
+  bench_host_report("keyboard 6KRO -> local device", 2, 0, kb_boot,
+                    sizeof(kb_boot));
+  bench_host_report("keyboard bitmap -> local device", 1, 0, kb_bitmap,
+                    sizeof(kb_bitmap));
+  bench_host_report("mouse -> local device", 1, 1, ms, sizeof(ms));
+
+  set_active_output(BOARD_ROLE ^ 1);
+  bench_host_report("keyboard 6KRO -> uart", 2, 0, kb_boot, sizeof(kb_boot));
+  bench_host_report("mouse -> uart", 1, 1, ms, sizeof(ms));
+
+  /* Feed the last mouse frame back in, the RX interrupt fills the ring
+   * buffer and a single core1 pass has to dispatch it */
+  set_active_output(BOARD_ROLE);
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    host_uart_rx_push(last_frame, last_frame_len);
+    host_core1_pass();
+    host_core0_pass();
+    tud_hid_report_complete_cb(1, NULL, 0);
+  }
+  bench_print("uart frame -> local device", bench_now_ns() - start,
+              ITERATIONS);
+
+  /* Behind a hub every device is HID instance 0 at its own address, the
+   * more there are the longer tuh_task() takes, but not our callback */
+  char name[64];
+  for (uint8_t addr = 2; addr <= CFG_TUH_DEVICE_MAX; addr++) {
+    tuh_hid_mount_cb(addr, 0, desc_kb_6kro, sizeof(desc_kb_6kro));
+    snprintf(name, sizeof(name), "keyboard 6KRO, device %d of %d", addr, addr);
+    bench_host_report(name, addr, 0, kb_boot, sizeof(kb_boot));
+  }
+
+  /* Sent from core1 like the hotkey does, the PC has to get the report
+   * before we stop sending to it. A is a Linux PC. */
+  set_active_output(BOARD_ROLE);
+  keyboard_reports = 0;
+  suspend_active_pc();
+  host_core0_pass();
+  bool suspended = keyboard_reports == 1 &&
+                   last_keyboard.modifier == (KEYBOARD_MODIFIER_LEFTGUI |
+                                              KEYBOARD_MODIFIER_LEFTCTRL |
+                                              KEYBOARD_MODIFIER_LEFTSHIFT);
+  printf("suspend hotkey -> local device: %u reports, %s\n",
+         keyboard_reports, suspended ? "ok" : "FAILED");
+
+  return suspended ? 0 : 1;
+}
@@ -0,0 +1,574 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Talks to a running board through the vendor feature reports on its
+ * consumer control interface, over Linux hidraw:
+ *
+ *   deskhopl_ctl counters            link and queue counters
+ *   deskhopl_ctl latency             per stage latency histograms
+ *   deskhopl_ctl trace [--follow]    the trace, like trace_decode
+ *   deskhopl_ctl config [OPTIONS]    show the config, or change it on
+ *                                    both boards, see --help
+ *
+ * The board is found by its VID/PID, --device picks a /dev/hidrawN instead.
+ * It needs read/write access to the node, e.g. through a udev rule.
+ *
+ * --loopback runs board A in-process instead and calls its report callbacks
+ * directly, after sending some reports through it. That tests the tool and
+ * the firmware side of the reports without any hardware.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/hidraw.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "host.h"
+#include "reports.h"
+
+#define HIDRAW_MAX 64
+#define REPORT_MAX 64
+#define FOLLOW_POLL_US 20000
+
+extern tusb_desc_device_t const desc_device;
+
+/* Reports go in and out with the report ID in front, like hidraw wants them.
+ * Both return the length including the ID, or -1. */
+typedef struct {
+  int fd;
+  int (*get_feature)(int fd, uint8_t *report, size_t len);
+  int (*set_feature)(int fd, const uint8_t *report, size_t len);
+} transport_t;
+
+/**================================================== *
+ * ==================  Transports  ================== *
+ * ================================================== */
+
+static int hidraw_get_feature(int fd, uint8_t *report, size_t len) {
+  return ioctl(fd, HIDIOCGFEATURE(len), report);
+}
+
+static int hidraw_set_feature(int fd, const uint8_t *report, size_t len) {
+  return ioctl(fd, HIDIOCSFEATURE(len), report);
+}
+
+/* Only the consumer control interface answers our feature reports */
+static bool hidraw_is_board(int fd) {
+  struct hidraw_devinfo info;
+  uint8_t report[1 + sizeof(telemetry_report_t)] = {REPORT_ID_TELEMETRY};
+
+  return ioctl(fd, HIDIOCGRAWINFO, &info) == 0 &&
+         (uint16_t)info.vendor == desc_device.idVendor &&
+         (uint16_t)info.product == desc_device.idProduct &&
+         hidraw_get_feature(fd, report, sizeof(report)) > 0;
+}
+
+static int hidraw_open(const char *device) {
+  char path[32];
+
+  if (device) {
+    int fd = open(device, O_RDWR);
+    if (fd < 0) {
+      perror(device);
+    }
+    return fd;
+  }
+
+  for (int i = 0; i < HIDRAW_MAX; i++) {
+    snprintf(path, sizeof(path), "/dev/hidraw%d", i);
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+      continue;
+    }
+    if (hidraw_is_board(fd)) {
+      return fd;
+    }
+    close(fd);
+  }
+
+  fprintf(stderr, "no board found (%04x:%04x), is it plugged in and can we "
+                  "open its /dev/hidraw node?\n",
+          desc_device.idVendor, desc_device.idProduct);
+  return -1;
+}
+
+static int loopback_get_feature(int fd, uint8_t *report, size_t len) {
+  (void)fd;
+  uint16_t got = tud_hid_get_report_cb(ITF_NUM_HID_CD, report[0],
+                                       HID_REPORT_TYPE_FEATURE, &report[1],
+                                       len - 1);
+  if (!got) {
+    errno = EPIPE; // the device would STALL the request
+    return -1;
+  }
+  return got + 1;
+}
+
+/* The board goes round its loops after every write, like the real one */
+static int loopback_set_feature(int fd, const uint8_t *report, size_t len) {
+  (void)fd;
+  tud_hid_set_report_cb(ITF_NUM_HID_CD, report[0], HID_REPORT_TYPE_FEATURE,
+                        &report[1], len - 1);
+  sleep_us(CORE0_TICK_US);
+  host_core1_pass();
+  host_core0_pass();
+  return len;
+}
+
+/* Board A with a keyboard attached, half of the reports go to its own PC and
+ * half over the link, so every counter and histogram has something in it */
+static void loopback_boot(void) {
+  static const uint8_t desc_kb[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+  uint8_t report[8] = {0};
+
+  host_boot();
+  tud_mount_cb();
+  tuh_hid_mount_cb(1, ITF_NUM_HID_KB, desc_kb, sizeof(desc_kb));
+
+  for (int i = 0; i < 200; i++) {
+    if (i == 100) {
+      set_active_output(PICO_B);
+    }
+    report[2] = i & 1 ? HID_KEY_A : 0;
+    tuh_hid_report_received_cb(1, ITF_NUM_HID_KB, report, sizeof(report));
+    host_core1_pass();
+    host_core0_pass();
+    tud_hid_report_complete_cb(ITF_NUM_HID_KB, report, sizeof(report));
+    host_uart_irq();
+  }
+}
+
+/**================================================== *
+ * ===================  Commands  =================== *
+ * ================================================== */
+
+static int read_feature(const transport_t *t, uint8_t report_id, void *dst,
+                        size_t len) {
+  uint8_t report[REPORT_MAX] = {report_id};
+  int got = t->get_feature(t->fd, report, len + 1);
+
+  if (got < 1 || report[0] != report_id) {
+    fprintf(stderr, "reading report %#04x failed: %s\n", report_id,
+            got < 0 ? strerror(errno) : "short read");
+    return -1;
+  }
+  memcpy(dst, &report[1], got - 1);
+  return got - 1;
+}
+
+static int cmd_counters(const transport_t *t) {
+  telemetry_report_t report;
+
+  if (read_feature(t, REPORT_ID_TELEMETRY, &report, sizeof(report)) !=
+      sizeof(report)) {
+    return 1;
+  }
+  if (report.version != TELEMETRY_VERSION) {
+    fprintf(stderr, "unknown telemetry version %u\n", report.version);
+    return 1;
+  }
+
+  telemetry_print("board", &report);
+  printf("checksum errors %u, resyncs %u, overruns %u, rejected %u, "
+         "control messages failed %u\n",
+         report.rx_checksum_errors, report.rx_resyncs, report.rx_overruns,
+         report.rx_rejected, report.ctrl_failed);
+  return 0;
+}
+
+static int cmd_latency(const transport_t *t) {
+  latency_hist_t hist[LATENCY_STAGE_COUNT] = {0};
+  uint8_t page[LATENCY_PAGE_LENGTH];
+
+  for (int i = 0; i < LATENCY_PAGES; i++) {
+    int len = read_feature(t, REPORT_ID_LATENCY, page, sizeof(page));
+    if (len < 0 || !latency_page_add(hist, page, len)) {
+      fprintf(stderr, "bad latency page\n");
+      return 1;
+    }
+  }
+
+  latency_print("board", hist);
+  return 0;
+}
+
+static int cmd_trace(const transport_t *t, bool follow) {
+  uint8_t report[TRACE_REPORT_LENGTH];
+  trace_record_t record;
+  char line[128];
+
+  while (true) {
+    if (read_feature(t, REPORT_ID_TRACE, report, sizeof(report)) !=
+            sizeof(report) ||
+        report[0] > TRACE_REPORT_RECORDS) {
+      return 1;
+    }
+
+    for (int i = 0; i < report[0]; i++) {
+      memcpy(&record, &report[1 + i * sizeof(record)], sizeof(record));
+      trace_format(&record, line, sizeof(line));
+      printf("%s\n", line);
+    }
+
+    if (!report[0]) {
+      if (!follow) {
+        return 0;
+      }
+      fflush(stdout);
+      usleep(FOLLOW_POLL_US);
+    }
+  }
+}
+
+/* What cmd_config() is to change, -1 (false) leaves it alone */
+typedef struct {
+  int os[NUM_DEVICES];
+  int screensaver;
+  long idle_s;
+  int hotkey_count;
+  bool set_hotkey[MAX_HOTKEYS];
+  config_report_t hotkeys[MAX_HOTKEYS];
+  bool wipe;
+} config_change_t;
+
+/* The config as the board reports it, the general page and the hotkeys */
+typedef struct {
+  config_report_t general;
+  config_report_t hotkeys[MAX_HOTKEYS];
+} config_pages_t;
+
+static const char *const action_names[ACTION_COUNT] = {
+    [ACTION_TOGGLE_OUTPUT] = "toggle_output",
+    [ACTION_LOCK_SCREEN] = "lock_screen",
+    [ACTION_SUSPEND_ACTIVE_PC] = "suspend_active_pc",
+    [ACTION_SUSPEND_ALL_PCS] = "suspend_all_pcs",
+    [ACTION_ENABLE_DEBUG] = "enable_debug",
+    [ACTION_REQUEST_REBOOT] = "request_reboot",
+};
+
+static int parse_os(const char *name) {
+  if (!strcmp(name, "linux")) {
+    return LINUX;
+  }
+  if (!strcmp(name, "macos")) {
+    return MACOS;
+  }
+  fprintf(stderr, "unknown OS '%s', linux or macos\n", name);
+  return -1;
+}
+
+static const char *os_name(uint8_t os) {
+  return os == LINUX ? "linux" : os == MACOS ? "macos" : "undefined";
+}
+
+/* INDEX:MODIFIER:KEY[+KEY...]:ACTION[:pass], numbers in C notation */
+static bool parse_hotkey(char *spec, config_change_t *change) {
+  char *save = NULL, *end;
+  char *index = strtok_r(spec, ":", &save);
+  char *modifier = strtok_r(NULL, ":", &save);
+  char *keys = strtok_r(NULL, ":", &save);
+  char *action = strtok_r(NULL, ":", &save);
+  char *pass = strtok_r(NULL, ":", &save);
+  config_report_t page = {.version = CONFIG_VERSION, .op = CONFIG_OP_HOTKEY};
+
+  if (!action || (pass && strcmp(pass, "pass"))) {
+    return false;
+  }
+
+  unsigned long n = strtoul(index, &end, 0);
+  if (*end || n >= MAX_HOTKEYS) {
+    return false;
+  }
+  page.index = n;
+  page.hotkey.mask.modifier = strtoul(modifier, &end, 0);
+  if (*end) {
+    return false;
+  }
+
+  for (char *key = strtok_r(keys, "+", &save); key;
+       key = strtok_r(NULL, "+", &save)) {
+    unsigned long usage = strtoul(key, &end, 0);
+    if (*end || usage < HID_KEY_A ||
+        usage >= HID_KEY_A + 8 * sizeof(page.hotkey.mask.keycode)) {
+      return false;
+    }
+    page.hotkey.mask.keycode[get_byte_offset(usage)] |=
+        1 << get_pos_in_byte(usage);
+  }
+
+  page.hotkey.action = ACTION_COUNT;
+  for (int i = 0; i < ACTION_COUNT; i++) {
+    if (!strcmp(action, action_names[i])) {
+      page.hotkey.action = i;
+    }
+  }
+  if (page.hotkey.action == ACTION_COUNT) {
+    return false;
+  }
+  page.hotkey.pass_to_os = pass != NULL;
+
+  change->set_hotkey[n] = true;
+  change->hotkeys[n] = page;
+  return true;
+}
+
+static int write_config(const transport_t *t, const config_report_t *page) {
+  uint8_t report[1 + sizeof(*page)] = {REPORT_ID_CONFIG};
+
+  memcpy(&report[1], page, sizeof(*page));
+  if (t->set_feature(t->fd, report, sizeof(report)) < 0) {
+    perror("writing the config");
+    return -1;
+  }
+  return 0;
+}
+
+/* Reads go round the pages, the general one comes first */
+static int read_config(const transport_t *t, config_pages_t *pages) {
+  config_report_t page = {0};
+
+  for (int i = 0; i < 2 + MAX_HOTKEYS; i++) {
+    if (read_feature(t, REPORT_ID_CONFIG, &page, sizeof(page)) !=
+        sizeof(page)) {
+      return -1;
+    }
+    if (page.version != CONFIG_VERSION) {
+      fprintf(stderr, "unknown config version %u\n", page.version);
+      return -1;
+    }
+    if (page.op == CONFIG_OP_GENERAL) {
+      break;
+    }
+  }
+  pages->general = page;
+
+  for (int n = 0; n < pages->general.general.hotkey_count; n++) {
+    if (read_feature(t, REPORT_ID_CONFIG, &page, sizeof(page)) !=
+            sizeof(page) ||
+        page.op != CONFIG_OP_HOTKEY || page.index != n) {
+      fprintf(stderr, "bad config page\n");
+      return -1;
+    }
+    pages->hotkeys[n] = page;
+  }
+  return 0;
+}
+
+static void print_config(const config_pages_t *pages) {
+  const config_report_t *general = &pages->general;
+
+  printf("os A %s, os B %s\n", os_name(general->general.os[PICO_A]),
+         os_name(general->general.os[PICO_B]));
+  printf("screensaver %s, after %u s\n",
+         general->general.screensaver_enabled ? "on" : "off",
+         general->general.screensaver_idle_s);
+
+  for (int n = 0; n < general->general.hotkey_count; n++) {
+    const config_report_t *page = &pages->hotkeys[n];
+    printf("hotkey %d: modifier 0x%02x, keys", n, page->hotkey.mask.modifier);
+    for (int key = 0; key < 8 * sizeof(page->hotkey.mask.keycode); key++) {
+      if (page->hotkey.mask.keycode[key / 8] & 1 << key % 8) {
+        printf(" 0x%02x", HID_KEY_A + key);
+      }
+    }
+    printf(" -> %s%s\n",
+           page->hotkey.action < ACTION_COUNT
+               ? action_names[page->hotkey.action]
+               : "unknown",
+           page->hotkey.pass_to_os ? ", passed on" : "");
+  }
+}
+
+/* Stages the changes page by page, the commit applies all of them at once
+ * on both boards */
+static int cmd_config(const transport_t *t, const config_change_t *change) {
+  config_pages_t pages;
+  config_report_t *general = &pages.general;
+  bool changed = false;
+
+  if (read_config(t, &pages) < 0) {
+    return 1;
+  }
+
+  if (change->wipe) {
+    config_report_t wipe = {.version = CONFIG_VERSION, .op = CONFIG_OP_WIPE};
+    if (write_config(t, &wipe) < 0 || read_config(t, &pages) < 0) {
+      return 1;
+    }
+    print_config(&pages);
+    return 0;
+  }
+
+  for (int i = 0; i < NUM_DEVICES; i++) {
+    if (change->os[i] > 0) {
+      general->general.os[i] = change->os[i];
+      changed = true;
+    }
+  }
+  if (change->screensaver >= 0) {
+    general->general.screensaver_enabled = change->screensaver;
+    changed = true;
+  }
+  if (change->idle_s >= 0) {
+    general->general.screensaver_idle_s = change->idle_s;
+    changed = true;
+  }
+  if (change->hotkey_count >= 0) {
+    general->general.hotkey_count = change->hotkey_count;
+    changed = true;
+  }
+  for (int n = 0; n < MAX_HOTKEYS; n++) {
+    if (!change->set_hotkey[n]) {
+      continue;
+    }
+    /* No gaps, an empty entry isn't a valid hotkey */
+    if (n > general->general.hotkey_count) {
+      fprintf(stderr, "hotkey %d would leave a gap, there are %u\n", n,
+              general->general.hotkey_count);
+      return 1;
+    }
+    if (n == general->general.hotkey_count && change->hotkey_count < 0) {
+      general->general.hotkey_count++;
+    }
+    changed = true;
+  }
+
+  if (changed) {
+    config_report_t commit = {.version = CONFIG_VERSION,
+                              .op = CONFIG_OP_COMMIT};
+    general->op = CONFIG_OP_GENERAL;
+    if (write_config(t, general) < 0) {
+      return 1;
+    }
+    for (int n = 0; n < MAX_HOTKEYS; n++) {
+      if (change->set_hotkey[n] && write_config(t, &change->hotkeys[n]) < 0) {
+        return 1;
+      }
+    }
+    /* Read it back, the board ignores anything it doesn't like */
+    if (write_config(t, &commit) < 0 || read_config(t, &pages) < 0) {
+      return 1;
+    }
+  }
+
+  print_config(&pages);
+  return 0;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [--device PATH | --loopback] COMMAND\n"
+          "  counters                       link and queue counters\n"
+          "  latency                        per stage latency histograms\n"
+          "  trace [--follow]               read the trace, keep polling\n"
+          "  config [OPTIONS]               show or change the config, on "
+          "both boards\n"
+          "    --os-a OS, --os-b OS         linux or macos\n"
+          "    --screensaver on|off\n"
+          "    --idle SECONDS               until the screensaver starts\n"
+          "    --hotkeys COUNT              drop the hotkeys from COUNT on\n"
+          "    --hotkey INDEX:MODIFIER:KEY[+KEY...]:ACTION[:pass]\n"
+          "                                 e.g. 1:0x60:0x0f:lock_screen\n"
+          "    --wipe                       back to the defaults\n",
+          prog);
+}
+
+int main(int argc, char **argv) {
+  const char *device = NULL;
+  bool loopback = false, follow = false, bad = false;
+  config_change_t change = {
+      .screensaver = -1, .idle_s = -1, .hotkey_count = -1};
+  char *end;
+
+  static const struct option options[] = {
+      {"device", required_argument, 0, 'd'},
+      {"loopback", no_argument, 0, 'l'},
+      {"follow", no_argument, 0, 'f'},
+      {"os-a", required_argument, 0, 'a'},
+      {"os-b", required_argument, 0, 'b'},
+      {"screensaver", required_argument, 0, 's'},
+      {"idle", required_argument, 0, 'i'},
+      {"hotkeys", required_argument, 0, 'n'},
+      {"hotkey", required_argument, 0, 'k'},
+      {"wipe", no_argument, 0, 'w'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    switch (opt) {
+    case 'd': device = optarg; break;
+    case 'l': loopback = true; break;
+    case 'f': follow = true; break;
+    case 'a': change.os[PICO_A] = parse_os(optarg); break;
+    case 'b': change.os[PICO_B] = parse_os(optarg); break;
+    case 's':
+      change.screensaver = !strcmp(optarg, "on") ? 1 : 0;
+      bad |= strcmp(optarg, "on") && strcmp(optarg, "off");
+      break;
+    case 'i':
+      change.idle_s = strtol(optarg, &end, 0);
+      bad |= *end || change.idle_s < 0 || change.idle_s > CONFIG_MAX_IDLE_S;
+      break;
+    case 'n':
+      change.hotkey_count = strtol(optarg, &end, 0);
+      bad |= *end || change.hotkey_count < 0 ||
+             change.hotkey_count > MAX_HOTKEYS;
+      break;
+    case 'k': bad |= !parse_hotkey(optarg, &change); break;
+    case 'w': change.wipe = true; break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  if (optind != argc - 1 || change.os[PICO_A] < 0 || change.os[PICO_B] < 0 ||
+      bad) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  transport_t t = {-1, hidraw_get_feature, hidraw_set_feature};
+  if (loopback) {
+    t = (transport_t){-1, loopback_get_feature, loopback_set_feature};
+    loopback_boot();
+    /* Nothing new will show up, the trace ends where the records do */
+    follow = false;
+  } else if ((t.fd = hidraw_open(device)) < 0) {
+    return 1;
+  }
+
+  const char *command = argv[optind];
+  int result = 1;
+  if (!strcmp(command, "counters")) {
+    result = cmd_counters(&t);
+  } else if (!strcmp(command, "latency")) {
+    result = cmd_latency(&t);
+  } else if (!strcmp(command, "trace")) {
+    result = cmd_trace(&t, follow);
+  } else if (!strcmp(command, "config")) {
+    result = cmd_config(&t, &change);
+  } else {
+    usage(argv[0]);
+  }
+
+  if (t.fd >= 0) {
+    close(t.fd);
+  }
+  return result;
+}
@@ -0,0 +1,508 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "host.h"
+#include <stdarg.h>
+
+static host_hooks_t hooks = {0};
+static uint64_t virtual_time_us = 0;
+static bool tud_is_ready = true;
+static bool led_state = false;
+/* Tools calling into the firmware directly play the USB host side, core1 */
+static uint current_core = 1;
+/* Where the core0 loop went to sleep, see host_core0_wake_us() */
+static bool core0_event = true;
+static absolute_time_t core0_timeout = 0;
+
+static uint8_t host_flash[PICO_FLASH_SIZE_BYTES] __attribute__((aligned(4)));
+static bool flash_ready = false;
+static int64_t flash_budget = -1; // Bytes until the power goes, -1 never
+static bool flash_cut = false;
+static uint32_t flash_erases[PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE];
+static bool interrupts_off = false;
+static bool core1_parked = false;
+
+static irq_handler_t uart0_irq_handler = NULL;
+static bool uart0_irq_enabled = false;
+static bool uart0_rx_irq = false;
+static bool uart0_tx_irq = false;
+
+#define UART_RX_BUFSIZE 4096
+static struct {
+  uint8_t data[UART_RX_BUFSIZE];
+  size_t head;
+  size_t tail;
+} uart_rx = {0};
+
+/**================================================== *
+ * ================  Harness control  =============== *
+ * ================================================== */
+
+/* Bring the board up the way main() does, minus the super loops */
+void host_boot(void) {
+  if (!flash_ready) {
+    host_flash_reset();
+  }
+  initial_setup(&global_state);
+  tud_init(BOARD_TUD_RHPORT);
+}
+
+void host_set_hooks(const host_hooks_t *new_hooks) {
+  hooks = new_hooks ? *new_hooks : (host_hooks_t){0};
+}
+
+void host_uart_rx_push(const uint8_t *src, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    size_t next = (uart_rx.head + 1) % UART_RX_BUFSIZE;
+    if (next == uart_rx.tail) {
+      return; // overrun, the real FIFO would drop too
+    }
+    uart_rx.data[uart_rx.head] = src[i];
+    uart_rx.head = next;
+  }
+
+  /* RX interrupt fires as soon as data is there */
+  if (uart0_irq_handler && uart0_irq_enabled && uart0_rx_irq) {
+    uart0_irq_handler();
+  }
+}
+
+/* Whoever models the wire calls this when the TX FIFO has drained */
+void host_uart_irq(void) {
+  if (uart0_irq_handler && uart0_irq_enabled && uart0_tx_irq) {
+    uart0_irq_handler();
+  }
+}
+
+size_t host_uart_rx_pending(void) {
+  return (uart_rx.head + UART_RX_BUFSIZE - uart_rx.tail) % UART_RX_BUFSIZE;
+}
+
+void host_set_tud_ready(bool ready) { tud_is_ready = ready; }
+
+bool host_get_led(void) { return led_state; }
+
+void host_flash_reset(void) {
+  memset(host_flash, 0xFF, sizeof(host_flash));
+  memset(flash_erases, 0, sizeof(flash_erases));
+  flash_ready = true;
+  host_flash_cut(-1);
+}
+
+void host_flash_cut(int32_t bytes) {
+  flash_budget = bytes;
+  flash_cut = false;
+}
+
+bool host_flash_was_cut(void) { return flash_cut; }
+
+uint32_t host_flash_erases(uint32_t sector) { return flash_erases[sector]; }
+
+uint8_t *host_flash_base(void) { return host_flash; }
+
+/* Same as one iteration of the loop in main(), including the wait at its
+ * end. The wait returns right away, the caller decides when to run the next
+ * pass, see host_core0_wake_us(). */
+void host_core0_pass(void) {
+  static absolute_time_t next_tick = 0;
+  uint64_t woke = time_us_64();
+
+  current_core = 0;
+  core0_event = false;
+  tud_task();
+  hid_queue_task();
+
+  if (time_reached(next_tick)) {
+    next_tick = make_timeout_time_us(CORE0_TICK_US);
+    kick_watchdog_task(&global_state);
+    screensaver_task(&global_state);
+    held_keys_task(&global_state);
+    config_task(&global_state);
+    config_store_task(&global_state);
+    trace_task();
+  }
+
+  record_loop_time(&global_state.loop_stats.core0_max_us, woke);
+  best_effort_wfe_or_timeout(next_tick);
+  current_core = 1;
+}
+
+/* When the core0 loop would wake up again, 0 if an event is already pending */
+uint64_t host_core0_wake_us(void) { return core0_event ? 0 : core0_timeout; }
+
+/* Same as one iteration of the loop in core1_main() */
+void host_core1_pass(void) {
+  static uart_packet_t in_packet = {0};
+  static uint64_t last_pass = 0;
+
+  tuh_task();
+  if (last_pass) {
+    record_loop_time(&global_state.loop_stats.core1_max_us, last_pass);
+  }
+  last_pass = time_us_64();
+  set_core1_last_loop_pass(last_pass);
+  uart_receive_packets(&in_packet, &global_state);
+  uart_retransmit_task(&global_state);
+  mouse_link_task(&global_state);
+  held_keys_refresh_task(&global_state);
+}
+
+/* In the firmware the transfer complete interrupt wakes the core0 loop, and
+ * tud_task() runs the callback there. Whatever waited for the endpoint is
+ * handed over in that pass. */
+static void host_report_complete(uint8_t instance, uint8_t const *report,
+                                 uint16_t len) {
+  current_core = 0;
+  tud_hid_report_complete_cb(instance, report, len);
+  current_core = 1;
+  core0_event = true;
+}
+
+const host_board_t *host_board(void) {
+  static const host_board_t board = {
+      .name = BOARD_NAME,
+      .role = BOARD_ROLE,
+      .state = &global_state,
+      .set_hooks = host_set_hooks,
+      .boot = host_boot,
+      .uart_rx_push = host_uart_rx_push,
+      .uart_rx_pending = host_uart_rx_pending,
+      .uart_irq = host_uart_irq,
+      .set_tud_ready = host_set_tud_ready,
+      .get_led = host_get_led,
+      .core0_pass = host_core0_pass,
+      .core0_wake_us = host_core0_wake_us,
+      .core1_pass = host_core1_pass,
+      .tud_mount_cb = tud_mount_cb,
+      .tuh_hid_mount_cb = tuh_hid_mount_cb,
+      .tuh_hid_report_received_cb = tuh_hid_report_received_cb,
+      .tud_hid_report_complete_cb = host_report_complete,
+      .tud_hid_get_report_cb = tud_hid_get_report_cb,
+      .tud_hid_set_report_cb = tud_hid_set_report_cb,
+  };
+  return &board;
+}
+
+/* Firmware output is only interesting when debugging the harness itself */
+int host_printf(const char *format, ...) {
+  static int verbose = -1;
+  if (verbose < 0) {
+    verbose = getenv("DH_HOST_VERBOSE") != NULL;
+  }
+  if (!verbose) {
+    return 0;
+  }
+
+  va_list args;
+  va_start(args, format);
+  int ret = vprintf(format, args);
+  va_end(args);
+  return ret;
+}
+
+int host_puts(const char *s) { return host_printf("%s\n", s); }
+
+/**================================================== *
+ * ==================  Pico SDK  ==================== *
+ * ================================================== */
+
+void gpio_init(uint gpio) { (void)gpio; }
+
+void gpio_set_dir(uint gpio, bool out) {
+  (void)gpio;
+  (void)out;
+}
+
+void gpio_set_function(uint gpio, enum gpio_function fn) {
+  (void)gpio;
+  (void)fn;
+}
+
+void gpio_put(uint gpio, bool value) {
+  if (gpio == GPIO_LED_PIN) {
+    led_state = value;
+  }
+}
+
+uint uart_init(uart_inst_t *uart, uint baudrate) {
+  (void)uart;
+  return baudrate;
+}
+
+bool uart_is_readable(uart_inst_t *uart) {
+  return uart == UART_ZERO && uart_rx.head != uart_rx.tail;
+}
+
+char uart_getc(uart_inst_t *uart) {
+  (void)uart;
+  /* the SDK blocks here, nobody calls us without checking first */
+  if (uart_rx.head == uart_rx.tail) {
+    return 0;
+  }
+  uint8_t c = uart_rx.data[uart_rx.tail];
+  uart_rx.tail = (uart_rx.tail + 1) % UART_RX_BUFSIZE;
+  return (char)c;
+}
+
+bool uart_is_writable(uart_inst_t *uart) {
+  if (uart == UART_ZERO && hooks.uart_tx_space) {
+    return hooks.uart_tx_space(hooks.ctx) > 0;
+  }
+  return true;
+}
+
+void uart_putc_raw(uart_inst_t *uart, char c) {
+  uint8_t byte = (uint8_t)c;
+  uart_write_blocking(uart, &byte, 1);
+}
+
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len) {
+  if (uart == UART_ZERO && hooks.uart_write) {
+    hooks.uart_write(hooks.ctx, src, len);
+  }
+}
+
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data,
+                          bool tx_needs_data) {
+  if (uart == UART_ZERO) {
+    uart0_rx_irq = rx_has_data;
+    uart0_tx_irq = tx_needs_data;
+  }
+}
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler) {
+  if (num == UART0_IRQ) {
+    uart0_irq_handler = handler;
+  }
+}
+
+void irq_set_enabled(uint num, bool enabled) {
+  if (num == UART0_IRQ) {
+    uart0_irq_enabled = enabled;
+  }
+}
+
+int spin_lock_claim_unused(bool required) {
+  static int next_lock = 0;
+  (void)required;
+  return next_lock++;
+}
+
+spin_lock_t *spin_lock_init(uint lock_num) {
+  static spin_lock_t locks[32];
+  return &locks[lock_num % 32];
+}
+
+/* Real locks, stress tools run the firmware from several threads */
+uint32_t spin_lock_blocking(spin_lock_t *lock) {
+  while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+  }
+  return 0;
+}
+
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq) {
+  (void)saved_irq;
+  __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+uint get_core_num(void) { return current_core; }
+
+void stdio_uart_init_full(uart_inst_t *uart, uint baud_rate, int tx_pin,
+                          int rx_pin) {
+  (void)uart;
+  (void)baud_rate;
+  (void)tx_pin;
+  (void)rx_pin;
+}
+
+void stdio_flush(void) { fflush(stdout); }
+
+uint64_t time_us_64(void) {
+  if (hooks.time_us) {
+    return hooks.time_us(hooks.ctx);
+  }
+  return virtual_time_us;
+}
+
+uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+
+void sleep_us(uint64_t us) {
+  if (hooks.sleep_us) {
+    hooks.sleep_us(hooks.ctx, us);
+  } else {
+    virtual_time_us += us;
+  }
+}
+
+void sleep_ms(uint32_t ms) { sleep_us((uint64_t)ms * 1000); }
+
+absolute_time_t get_absolute_time(void) { return time_us_64(); }
+
+absolute_time_t make_timeout_time_us(uint64_t us) { return time_us_64() + us; }
+
+bool time_reached(absolute_time_t t) { return time_us_64() >= t; }
+
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp) {
+  core0_timeout = timeout_timestamp;
+  return time_reached(timeout_timestamp);
+}
+
+void __sev(void) { core0_event = true; }
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required) {
+  (void)freq_khz;
+  (void)required;
+  return true;
+}
+
+/* core1 is driven through host_core1_pass() instead */
+void multicore_reset_core1(void) {}
+
+void multicore_launch_core1(void (*entry)(void)) { (void)entry; }
+
+void *alarm_pool_create(uint hardware_alarm_num, uint max_timers) {
+  (void)hardware_alarm_num;
+  (void)max_timers;
+  return NULL;
+}
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug) {
+  (void)delay_ms;
+  (void)pause_on_debug;
+}
+
+void watchdog_update(void) {}
+
+uint32_t save_and_disable_interrupts(void) {
+  bool was_off = interrupts_off;
+  interrupts_off = true;
+  return was_off;
+}
+
+void restore_interrupts(uint32_t status) { interrupts_off = status; }
+
+void multicore_lockout_victim_init(void) {}
+
+void multicore_lockout_start_blocking(void) { core1_parked = true; }
+
+void multicore_lockout_end_blocking(void) { core1_parked = false; }
+
+/* The real flash can't be read while it's busy, so nothing may run from it.
+ * Misuse the SDK wouldn't catch in a release build stops the tool here. */
+static void flash_check(const char *op, uint32_t flash_offs, size_t count,
+                        uint32_t align) {
+  if (flash_offs % align || count % align ||
+      (uint64_t)flash_offs + count > PICO_FLASH_SIZE_BYTES) {
+    fprintf(stderr, "%s: bad range %#x + %zu\n", op, flash_offs, count);
+    abort();
+  }
+  if (!interrupts_off || !core1_parked) {
+    fprintf(stderr, "%s: core1 running or interrupts on\n", op);
+    abort();
+  }
+}
+
+/* False once the power is gone, see host_flash_cut() */
+static bool flash_powered(void) {
+  if (flash_budget == 0) {
+    flash_cut = true;
+  }
+  if (flash_cut) {
+    return false;
+  }
+  if (flash_budget > 0) {
+    flash_budget--;
+  }
+  return true;
+}
+
+void flash_range_erase(uint32_t flash_offs, size_t count) {
+  flash_check("flash_range_erase", flash_offs, count, FLASH_SECTOR_SIZE);
+  for (size_t i = 0; i < count; i += FLASH_SECTOR_SIZE) {
+    flash_erases[(flash_offs + i) / FLASH_SECTOR_SIZE]++;
+  }
+  for (size_t i = 0; i < count && flash_powered(); i++) {
+    host_flash[flash_offs + i] = 0xFF;
+  }
+}
+
+/* NOR flash, programming can only clear bits */
+void flash_range_program(uint32_t flash_offs, const uint8_t *data,
+                         size_t count) {
+  flash_check("flash_range_program", flash_offs, count, FLASH_PAGE_SIZE);
+  for (size_t i = 0; i < count && flash_powered(); i++) {
+    host_flash[flash_offs + i] &= data[i];
+  }
+}
+
+/**================================================== *
+ * ==================  TinyUSB  ===================== *
+ * ================================================== */
+
+bool tud_init(uint8_t rhport) {
+  (void)rhport;
+  return true;
+}
+
+void tud_task(void) {}
+
+bool tud_ready(void) { return tud_is_ready; }
+
+bool tud_remote_wakeup(void) { return true; }
+
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const *report,
+                      uint16_t len) {
+  if (hooks.hid_report) {
+    return hooks.hid_report(hooks.ctx, instance, report_id, report, len);
+  }
+  return true;
+}
+
+bool tuh_init(uint8_t rhport) {
+  (void)rhport;
+  return true;
+}
+
+bool tuh_inited(void) { return true; }
+
+bool tuh_configure(uint8_t rhport, uint32_t cfg_id, const void *cfg_param) {
+  (void)rhport;
+  (void)cfg_id;
+  (void)cfg_param;
+  return true;
+}
+
+void tuh_task(void) {}
+
+uint8_t tuh_hid_get_protocol(uint8_t dev_addr, uint8_t instance) {
+  (void)dev_addr;
+  (void)instance;
+  return HID_PROTOCOL_REPORT;
+}
+
+uint8_t tuh_hid_interface_protocol(uint8_t dev_addr, uint8_t instance) {
+  (void)dev_addr;
+  (void)instance;
+  return HID_ITF_PROTOCOL_NONE;
+}
+
+bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t instance) {
+  (void)dev_addr;
+  (void)instance;
+  return true;
+}
+
+void tuh_hid_set_default_protocol(uint8_t protocol) { (void)protocol; }
@@ -0,0 +1,326 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Host-native stand-in for the parts of the Pico SDK and TinyUSB that the
+ * firmware uses. Only what main.h and the sources built into the host
+ * libraries need is declared here, the implementation lives in hal.c.
+ */
+
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+//--------------------------------------------------------------------+
+// Pico SDK
+//--------------------------------------------------------------------+
+typedef unsigned int uint;
+typedef struct uart_inst uart_inst_t;
+
+#define uart0 ((uart_inst_t *)0)
+#define uart1 ((uart_inst_t *)1)
+
+enum gpio_function { GPIO_FUNC_UART = 2 };
+#define GPIO_OUT 1
+
+#define MIN(a, b) ((b) > (a) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define bi_decl(...)
+#define __not_in_flash_func(func_name) func_name
+#define __dmb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+enum irq_num { UART0_IRQ = 20, UART1_IRQ = 21 };
+typedef void (*irq_handler_t)(void);
+
+void irq_set_exclusive_handler(uint num, irq_handler_t handler);
+void irq_set_enabled(uint num, bool enabled);
+
+typedef volatile uint32_t spin_lock_t;
+int spin_lock_claim_unused(bool required);
+spin_lock_t *spin_lock_init(uint lock_num);
+uint32_t spin_lock_blocking(spin_lock_t *lock);
+void spin_unlock(spin_lock_t *lock, uint32_t saved_irq);
+uint get_core_num(void);
+
+void gpio_init(uint gpio);
+void gpio_set_dir(uint gpio, bool out);
+void gpio_set_function(uint gpio, enum gpio_function fn);
+void gpio_put(uint gpio, bool value);
+
+uint uart_init(uart_inst_t *uart, uint baudrate);
+bool uart_is_readable(uart_inst_t *uart);
+char uart_getc(uart_inst_t *uart);
+bool uart_is_writable(uart_inst_t *uart);
+void uart_putc_raw(uart_inst_t *uart, char c);
+void uart_write_blocking(uart_inst_t *uart, const uint8_t *src, size_t len);
+void uart_set_irq_enables(uart_inst_t *uart, bool rx_has_data,
+                          bool tx_needs_data);
+
+void stdio_uart_init_full(uart_inst_t *uart, uint baud_rate, int tx_pin,
+                          int rx_pin);
+void stdio_flush(void);
+
+uint64_t time_us_64(void);
+uint32_t time_us_32(void);
+void sleep_ms(uint32_t ms);
+void sleep_us(uint64_t us);
+
+typedef uint64_t absolute_time_t;
+absolute_time_t get_absolute_time(void);
+absolute_time_t make_timeout_time_us(uint64_t us);
+bool time_reached(absolute_time_t t);
+bool best_effort_wfe_or_timeout(absolute_time_t timeout_timestamp);
+void __sev(void);
+
+bool set_sys_clock_khz(uint32_t freq_khz, bool required);
+void multicore_reset_core1(void);
+void multicore_launch_core1(void (*entry)(void));
+void *alarm_pool_create(uint hardware_alarm_num, uint max_timers);
+
+void watchdog_enable(uint32_t delay_ms, bool pause_on_debug);
+void watchdog_update(void);
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+void multicore_lockout_victim_init(void);
+void multicore_lockout_start_blocking(void);
+void multicore_lockout_end_blocking(void);
+
+/* RAM-backed, see host_flash_reset(). A function rather than the array
+ * itself, a tool would get its own copy of the array. */
+#define PICO_FLASH_SIZE_BYTES (64 * 1024)
+#define FLASH_PAGE_SIZE 256
+#define FLASH_SECTOR_SIZE 4096
+uint8_t *host_flash_base(void);
+#define XIP_BASE ((uintptr_t)host_flash_base())
+
+void flash_range_erase(uint32_t flash_offs, size_t count);
+void flash_range_program(uint32_t flash_offs, const uint8_t *data,
+                         size_t count);
+
+//--------------------------------------------------------------------+
+// TinyUSB common
+//--------------------------------------------------------------------+
+#define OPT_MCU_NONE 0
+#define OPT_MCU_RP2040 1800
+#define OPT_OS_NONE 1
+#define OPT_MODE_DEFAULT_SPEED 0
+#define CFG_TUSB_MCU OPT_MCU_NONE
+#include "tusb_config.h"
+
+#define TU_ATTR_PACKED __attribute__((packed))
+#define TU_U16_LOW(u16) ((uint8_t)((u16) & 0x00ff))
+#define TU_U16_HIGH(u16) ((uint8_t)(((u16) >> 8) & 0x00ff))
+#define U16_TO_U8S_LE(u16) TU_U16_LOW(u16), TU_U16_HIGH(u16)
+
+typedef struct TU_ATTR_PACKED {
+  uint8_t bLength;
+  uint8_t bDescriptorType;
+  uint16_t bcdUSB;
+  uint8_t bDeviceClass;
+  uint8_t bDeviceSubClass;
+  uint8_t bDeviceProtocol;
+  uint8_t bMaxPacketSize0;
+  uint16_t idVendor;
+  uint16_t idProduct;
+  uint16_t bcdDevice;
+  uint8_t iManufacturer;
+  uint8_t iProduct;
+  uint8_t iSerialNumber;
+  uint8_t bNumConfigurations;
+} tusb_desc_device_t;
+
+enum {
+  TUSB_DESC_DEVICE = 0x01,
+  TUSB_DESC_CONFIGURATION = 0x02,
+  TUSB_DESC_STRING = 0x03,
+  TUSB_DESC_INTERFACE = 0x04,
+  TUSB_DESC_ENDPOINT = 0x05,
+};
+enum { TUSB_CLASS_HID = 3 };
+enum { TUSB_XFER_INTERRUPT = 3 };
+enum { TUSB_DESC_CONFIG_ATT_REMOTE_WAKEUP = 1 << 5 };
+
+#define TUD_CONFIG_DESC_LEN (9)
+#define TUD_CONFIG_DESCRIPTOR(config_num, _itfcount, _stridx, _total_len,     \
+                              _attribute, _power_ma)                           \
+  9, TUSB_DESC_CONFIGURATION, U16_TO_U8S_LE(_total_len), _itfcount,            \
+      config_num, _stridx, (1 << 7) | (_attribute), (_power_ma) / 2
+
+//--------------------------------------------------------------------+
+// TinyUSB HID
+//--------------------------------------------------------------------+
+typedef struct TU_ATTR_PACKED {
+  uint8_t modifier;
+  uint8_t reserved;
+  uint8_t keycode[6];
+} hid_keyboard_report_t;
+
+typedef enum {
+  HID_REPORT_TYPE_INVALID = 0,
+  HID_REPORT_TYPE_INPUT,
+  HID_REPORT_TYPE_OUTPUT,
+  HID_REPORT_TYPE_FEATURE
+} hid_report_type_t;
+
+enum { HID_PROTOCOL_BOOT = 0, HID_PROTOCOL_REPORT = 1 };
+enum { HID_SUBCLASS_BOOT = 1 };
+enum {
+  HID_ITF_PROTOCOL_NONE = 0,
+  HID_ITF_PROTOCOL_KEYBOARD = 1,
+  HID_ITF_PROTOCOL_MOUSE = 2
+};
+enum { HID_DESC_TYPE_HID = 0x21, HID_DESC_TYPE_REPORT = 0x22 };
+
+enum {
+  HID_USAGE_PAGE_DESKTOP = 0x01,
+  HID_USAGE_PAGE_KEYBOARD = 0x07,
+  HID_USAGE_PAGE_BUTTON = 0x09,
+  HID_USAGE_PAGE_CONSUMER = 0x0c,
+  HID_USAGE_PAGE_VENDOR = 0xFF00
+};
+enum {
+  HID_USAGE_DESKTOP_POINTER = 0x01,
+  HID_USAGE_DESKTOP_MOUSE = 0x02,
+  HID_USAGE_DESKTOP_KEYBOARD = 0x06,
+  HID_USAGE_DESKTOP_X = 0x30,
+  HID_USAGE_DESKTOP_Y = 0x31,
+  HID_USAGE_DESKTOP_WHEEL = 0x38,
+  HID_USAGE_DESKTOP_SYSTEM_CONTROL = 0x80
+};
+enum {
+  HID_USAGE_CONSUMER_CONTROL = 0x0001,
+  HID_USAGE_CONSUMER_AC_PAN = 0x0238
+};
+
+typedef enum {
+  KEYBOARD_MODIFIER_LEFTCTRL = 1 << 0,
+  KEYBOARD_MODIFIER_LEFTSHIFT = 1 << 1,
+  KEYBOARD_MODIFIER_LEFTALT = 1 << 2,
+  KEYBOARD_MODIFIER_LEFTGUI = 1 << 3,
+  KEYBOARD_MODIFIER_RIGHTCTRL = 1 << 4,
+  KEYBOARD_MODIFIER_RIGHTSHIFT = 1 << 5,
+  KEYBOARD_MODIFIER_RIGHTALT = 1 << 6,
+  KEYBOARD_MODIFIER_RIGHTGUI = 1 << 7
+} hid_keyboard_modifier_bm_t;
+
+typedef enum {
+  MOUSE_BUTTON_LEFT = 1 << 0,
+  MOUSE_BUTTON_RIGHT = 1 << 1,
+  MOUSE_BUTTON_MIDDLE = 1 << 2,
+  MOUSE_BUTTON_BACKWARD = 1 << 3,
+  MOUSE_BUTTON_FORWARD = 1 << 4,
+} hid_mouse_button_bm_t;
+
+#define HID_KEY_NONE 0x00
+#define HID_KEY_A 0x04
+#define HID_KEY_B 0x05
+#define HID_KEY_C 0x06
+#define HID_KEY_D 0x07
+#define HID_KEY_E 0x08
+#define HID_KEY_F 0x09
+#define HID_KEY_G 0x0A
+#define HID_KEY_H 0x0B
+#define HID_KEY_I 0x0C
+#define HID_KEY_J 0x0D
+#define HID_KEY_K 0x0E
+#define HID_KEY_L 0x0F
+#define HID_KEY_M 0x10
+#define HID_KEY_N 0x11
+#define HID_KEY_O 0x12
+#define HID_KEY_P 0x13
+#define HID_KEY_Q 0x14
+#define HID_KEY_R 0x15
+#define HID_KEY_S 0x16
+#define HID_KEY_T 0x17
+#define HID_KEY_U 0x18
+#define HID_KEY_V 0x19
+#define HID_KEY_W 0x1A
+#define HID_KEY_X 0x1B
+#define HID_KEY_Y 0x1C
+#define HID_KEY_Z 0x1D
+#define HID_KEY_ENTER 0x28
+#define HID_KEY_ESCAPE 0x29
+#define HID_KEY_SPACE 0x2C
+#define HID_KEY_SLASH 0x38
+#define HID_KEY_CAPS_LOCK 0x39
+#define HID_KEY_F12 0x45
+#define HID_KEY_F24 0x73
+#define HID_KEY_KANJI1 0x87
+#define HID_KEY_KANJI5 0x8B
+#define HID_KEY_LANG1 0x90
+#define HID_KEY_LANG3 0x92
+#define HID_KEY_CONTROL_LEFT 0xE0
+#define HID_KEY_GUI_RIGHT 0xE7
+
+#define HID_REPORT_ID(x) 0x85, x,
+
+#define TUD_HID_DESC_LEN (9 + 9 + 7)
+#define TUD_HID_DESCRIPTOR(_itfnum, _stridx, _boot_protocol,                   \
+                           _report_desc_len, _epin, _epsize, _ep_interval)     \
+  9, TUSB_DESC_INTERFACE, _itfnum, 0, 1, TUSB_CLASS_HID,                       \
+      (uint8_t)((_boot_protocol) ? HID_SUBCLASS_BOOT : 0), _boot_protocol,     \
+      _stridx, 9, HID_DESC_TYPE_HID, U16_TO_U8S_LE(0x0111), 0, 1,              \
+      HID_DESC_TYPE_REPORT, U16_TO_U8S_LE(_report_desc_len), 7,                \
+      TUSB_DESC_ENDPOINT, _epin, TUSB_XFER_INTERRUPT, U16_TO_U8S_LE(_epsize),  \
+      _ep_interval
+
+// PIO-USB
+typedef struct {
+  uint8_t pin_dp;
+  void *alarm_pool;
+} pio_usb_configuration_t;
+#define PIO_USB_DEFAULT_CONFIG {0}
+#define TUH_CFGID_RPI_PIO_USB_CONFIGURATION 100
+
+// device stack
+bool tud_init(uint8_t rhport);
+void tud_task(void);
+bool tud_ready(void);
+bool tud_remote_wakeup(void);
+bool tud_hid_n_report(uint8_t instance, uint8_t report_id, void const *report,
+                      uint16_t len);
+
+// host stack
+bool tuh_init(uint8_t rhport);
+bool tuh_inited(void);
+bool tuh_configure(uint8_t rhport, uint32_t cfg_id, const void *cfg_param);
+void tuh_task(void);
+uint8_t tuh_hid_get_protocol(uint8_t dev_addr, uint8_t instance);
+uint8_t tuh_hid_interface_protocol(uint8_t dev_addr, uint8_t instance);
+bool tuh_hid_receive_report(uint8_t dev_addr, uint8_t instance);
+void tuh_hid_set_default_protocol(uint8_t protocol);
+
+// application callbacks, implemented by the firmware
+void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance,
+                      uint8_t const *desc_report, uint16_t desc_len);
+void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance);
+void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance,
+                                uint8_t const *report, uint16_t len);
+void tud_mount_cb(void);
+void tud_umount_cb(void);
+void tud_suspend_cb(bool remote_wakeup_en);
+void tud_resume_cb(void);
+void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report,
+                                uint16_t len);
+uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id,
+                               hid_report_type_t report_type, uint8_t *buffer,
+                               uint16_t reqlen);
+void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id,
+                           hid_report_type_t report_type, uint8_t const *buffer,
+                           uint16_t bufsize);
@@ -0,0 +1,93 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Harness interface of the host-native firmware libraries (board_A_host,
+ * board_B_host). Tools either link one of them directly, or dlopen() both
+ * and reach everything through host_board().
+ */
+
+#pragma once
+#include "main.h"
+
+/* Everything the stub HAL hands off to the outside world. Unset members fall
+ * back to the built-in defaults: a free-running virtual clock, a discarding
+ * UART TX that never fills up and an always idle HID endpoint. */
+typedef struct {
+  void *ctx;
+  uint64_t (*time_us)(void *ctx);
+  void (*sleep_us)(void *ctx, uint64_t us);
+  void (*uart_write)(void *ctx, const uint8_t *src, size_t len);
+  size_t (*uart_tx_space)(void *ctx); // free slots in the TX FIFO
+  bool (*hid_report)(void *ctx, uint8_t instance, uint8_t report_id,
+                     void const *report, uint16_t len);
+} host_hooks_t;
+
+void host_set_hooks(const host_hooks_t *hooks);
+void host_boot(void);
+void host_uart_rx_push(const uint8_t *src, size_t len);
+size_t host_uart_rx_pending(void);
+void host_uart_irq(void);
+void host_set_tud_ready(bool ready);
+bool host_get_led(void);
+
+/* The flash is blank at the first host_boot(). Power loss is modelled by
+ * cutting it off after a number of erased or programmed bytes, it stays off
+ * until host_flash_cut(-1). */
+void host_flash_reset(void);
+void host_flash_cut(int32_t bytes);
+bool host_flash_was_cut(void);
+uint32_t host_flash_erases(uint32_t sector);
+
+/* One pass of the core0/core1 super loops in main.c */
+void host_core0_pass(void);
+void host_core1_pass(void);
+uint64_t host_core0_wake_us(void);
+
+/* Entry points of one board, for tools that dlopen() both libraries into the
+ * same process. Both libraries export the very same symbol names, so
+ * everything else has to go through this table. */
+typedef struct {
+  const char *name;
+  uint8_t role;
+  device_t *state;
+  void (*set_hooks)(const host_hooks_t *hooks);
+  void (*boot)(void);
+  void (*uart_rx_push)(const uint8_t *src, size_t len);
+  size_t (*uart_rx_pending)(void);
+  void (*uart_irq)(void);
+  void (*set_tud_ready)(bool ready);
+  bool (*get_led)(void);
+  void (*core0_pass)(void);
+  uint64_t (*core0_wake_us)(void);
+  void (*core1_pass)(void);
+  void (*tud_mount_cb)(void);
+  void (*tuh_hid_mount_cb)(uint8_t dev_addr, uint8_t instance,
+                           uint8_t const *desc_report, uint16_t desc_len);
+  void (*tuh_hid_report_received_cb)(uint8_t dev_addr, uint8_t instance,
+                                     uint8_t const *report, uint16_t len);
+  void (*tud_hid_report_complete_cb)(uint8_t instance, uint8_t const *report,
+                                     uint16_t len);
+  uint16_t (*tud_hid_get_report_cb)(uint8_t instance, uint8_t report_id,
+                                    hid_report_type_t report_type,
+                                    uint8_t *buffer, uint16_t reqlen);
+  void (*tud_hid_set_report_cb)(uint8_t instance, uint8_t report_id,
+                                hid_report_type_t report_type,
+                                uint8_t const *buffer, uint16_t bufsize);
+} host_board_t;
+
+typedef const host_board_t *(*host_board_fn_t)(void);
+const host_board_t *host_board(void);
@@ -0,0 +1,81 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Decoding the vendor feature reports, shared by the host tools */
+
+#pragma once
+#include "main.h"
+
+static const char *const latency_stage_names[LATENCY_STAGE_COUNT] = {
+    [LATENCY_HOST_TO_ROUTED] = "host->routed",
+    [LATENCY_ROUTED_TO_LINK] = "routed->link",
+    [LATENCY_LINK_TX] = "link tx",
+    [LATENCY_LINK_RX] = "link rx",
+    [LATENCY_TO_DEVICE] = "->device",
+};
+
+/* One REPORT_ID_LATENCY page (without the ID) into its place in hist */
+static inline bool latency_page_add(latency_hist_t hist[LATENCY_STAGE_COUNT],
+                                    const uint8_t *page, size_t len) {
+  if (len < 3 || page[0] >= LATENCY_STAGE_COUNT ||
+      page[1] + page[2] > LATENCY_WORDS || len < 3u + 4 * page[2]) {
+    return false;
+  }
+  memcpy((uint32_t *)&hist[page[0]] + page[1], &page[3], 4 * page[2]);
+  return true;
+}
+
+/* Upper bound of the bucket the percentile falls into */
+static inline uint32_t latency_percentile(const latency_hist_t *hist,
+                                          int percent) {
+  uint64_t count = 0, seen = 0;
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    count += hist->buckets[i];
+  }
+  for (int i = 0; i < LATENCY_BUCKETS; i++) {
+    seen += hist->buckets[i];
+    if (seen * 100 >= count * percent) {
+      return 1u << i;
+    }
+  }
+  return 1u << (LATENCY_BUCKETS - 1);
+}
+
+static inline void latency_print(const char *name,
+                                 const latency_hist_t hist[LATENCY_STAGE_COUNT]) {
+  for (int i = 0; i < LATENCY_STAGE_COUNT; i++) {
+    uint64_t count = 0;
+    for (int b = 0; b < LATENCY_BUCKETS; b++) {
+      count += hist[i].buckets[b];
+    }
+    if (!count) {
+      continue;
+    }
+    printf("%-9s %-12s %8llu  p50 < %6u  p90 < %6u  p99 < %6u  max %6u us\n",
+           name, latency_stage_names[i], (unsigned long long)count,
+           latency_percentile(&hist[i], 50), latency_percentile(&hist[i], 90),
+           latency_percentile(&hist[i], 99), hist[i].max_us);
+  }
+}
+
+static inline void telemetry_print(const char *name,
+                                   const telemetry_report_t *t) {
+  printf("%s telemetry: output %s, tx %u rx %u, dropped %u, high water tx "
+         "%u B hid %u core %u, loop max core0 %u core1 %u us\n",
+         name, t->active_output == PICO_A ? "A" : "B", t->tx_packets,
+         t->rx_packets, t->dropped, t->tx_high_water, t->hid_high_water,
+         t->core_high_water, t->core0_loop_max_us, t->core1_loop_max_us);
+}
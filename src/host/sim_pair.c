@@ -0,0 +1,870 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Two-board pair simulator.
+ *
+ * Loads board_A_host and board_B_host into one process and joins them with a
+ * virtual UART that models the UART_ZERO line rate. Reports are generated on
+ * A's USB host side, each board's USB device side is polled by a virtual PC
+ * at the bInterval found in its configuration descriptor. Everything runs on
+ * one virtual clock, so results are deterministic for a given seed.
+ *
+ * --switch-hz presses the output toggle hotkey on A's keyboard with shift and
+ * the last key still held, --byte-errors corrupts bytes on the wire. Together
+ * they show whether both boards keep agreeing on the active output, how long
+ * the old output takes to let go of the keys and the new one to get shift.
+ * After the inputs stop, the simulation runs until a stuck key would have
+ * timed out. Keys still held on a PC that shouldn't hold them then make it
+ * exit with 1, so does a report that reached a PC under a report ID that
+ * isn't ours.
+ *
+ * --hub attaches keyboard and mouse as two devices behind a hub instead of
+ * two interfaces of one receiver, both are HID instance 0 of their device.
+ *
+ * --core0 picks how the core0 loop is scheduled. "event" follows the
+ * firmware: a pass runs when core1 sent an event or the tick is due. "poll"
+ * runs a pass every 10 us like the old sleep_us(10) loop did. Compare the
+ * core1 -> core0 wait and the core0 wakeups between the two.
+ *
+ * The cost model is deliberately simple:
+ *  - one core1 loop pass (tuh_task + uart_receive_packets) costs --loop-ns
+ *  - reports generated by a device are picked up by the next core1 pass
+ *  - a core0 pass takes no time, nor does waking up from __wfe()
+ *  - the UART TX FIFO holds 32 bytes, the TX interrupt refills it
+ *  - a blocking UART write stalls the writer until its data fits the FIFO
+ *  - every byte occupies the line for 10 bit times
+ */
+
+#include "bench.h"
+#include "host.h"
+#include "reports.h"
+#include <dlfcn.h>
+#include <getopt.h>
+
+#define NS_PER_S 1000000000ull
+#define UART_FIFO_DEPTH 32
+#define UART_BITS_PER_BYTE 10
+#define PIPE_SIZE 65536
+#define PENDING_SIZE 1024
+#define REPORT_MAX 64
+#define SETTLE_NS (50 * 1000000ull) // boot and link negotiation
+#define QUIET_NS (HELD_KEYS_TIMEOUT_US * 1000ull + NS_PER_S / 2) // no inputs
+#define CORE0_POLL_NS 10000         // the old loop slept 10 us per pass
+
+typedef struct {
+  uint64_t arrival_ns[PIPE_SIZE];
+  uint8_t data[PIPE_SIZE];
+  size_t head, tail;
+  uint64_t line_free_ns; // when the last queued byte has left the wire
+  uint64_t bytes;
+} pipe_t;
+
+typedef struct {
+  bool busy;
+  uint64_t accepted_ns;
+  uint64_t next_poll_ns;
+  uint8_t report_id;
+  uint8_t data[REPORT_MAX];
+  uint16_t len;
+} endpoint_t;
+
+typedef struct sim_board_s sim_board_t;
+
+typedef struct {
+  uint64_t created_ns;
+  uint8_t instance;
+  uint8_t data[REPORT_MAX];
+  uint16_t len;
+} input_t;
+
+/* Reports still expected to show up on the remote PC, in generation order */
+typedef struct {
+  input_t entries[PENDING_SIZE];
+  size_t head, tail;
+} expect_t;
+
+typedef struct {
+  const char *name;
+  uint64_t *samples;
+  size_t count;
+  size_t capacity;
+} series_t;
+
+struct sim_board_s {
+  const host_board_t *fw;
+  host_hooks_t hooks;
+  pipe_t *tx;
+  pipe_t *rx;
+  uint64_t ready_ns; // core1 is busy until then
+  uint64_t core0_next_ns; // when the core0 loop runs again
+  uint64_t core0_wakeups;
+  endpoint_t ep[ITF_NUM_TOTAL];
+  uint32_t ep_interval_us[ITF_NUM_TOTAL];
+  input_t inputs[PENDING_SIZE]; // generated, not yet seen by tuh_task
+  size_t in_head, in_tail;
+  uint64_t report_rejected;
+  uint64_t wrong_report_id; // the PC got a report under an ID not ours
+  keyboard_report_t pc_keys; // what its PC holds
+};
+
+static struct {
+  uint64_t now_ns;
+  uint64_t byte_ns;
+  uint64_t loop_ns;
+  sim_board_t a, b;
+  pipe_t a_to_b, b_to_a;
+  expect_t expect[ITF_NUM_TOTAL];
+  series_t to_device[ITF_NUM_TOTAL];
+  series_t to_pc[ITF_NUM_TOTAL];
+  uint64_t generated[ITF_NUM_TOTAL];
+  uint64_t lost[ITF_NUM_TOTAL];
+  uint64_t merged[ITF_NUM_TOTAL]; // delivered as part of a later report
+  bool core0_poll;
+  bool hub; // every interface is a device of its own
+  uint32_t byte_errors; // per million bytes on the wire
+  uint64_t corrupted;
+  uint64_t switches;
+  uint64_t config_changes;
+  uint64_t disagree_ns; // boards had different ideas of the active output
+  keyboard_report_t kbd_state; // what the active output's PC should hold
+  struct {
+    bool pending;
+    uint64_t at_ns;
+    sim_board_t *from, *to; // the old and the new output
+    bool from_held;         // the old output got shift before the switch
+    bool released, reasserted;
+  } sw;
+  series_t sw_released, sw_reasserted;
+  uint64_t sw_incomplete;
+  uint32_t rng;
+} sim;
+
+static uint32_t rand_next(void) {
+  sim.rng ^= sim.rng << 13;
+  sim.rng ^= sim.rng >> 17;
+  sim.rng ^= sim.rng << 5;
+  return sim.rng;
+}
+
+static void series_add(series_t *s, uint64_t value) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? 2 * s->capacity : 1024;
+    s->samples = realloc(s->samples, s->capacity * sizeof(uint64_t));
+  }
+  s->samples[s->count++] = value;
+}
+
+static void series_print(const char *stage, series_t *s) {
+  if (!s->count) {
+    return;
+  }
+  size_t n = s->count;
+  uint64_t p50 = bench_percentile(s->samples, n, 50);
+  uint64_t p90 = bench_percentile(s->samples, n, 90);
+  uint64_t p99 = bench_percentile(s->samples, n, 99);
+  uint64_t max = s->samples[n - 1];
+  printf("%-9s %-10s %8zu  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f us\n",
+         s->name, stage, n, p50 / 1e3, p90 / 1e3, p99 / 1e3, max / 1e3);
+}
+
+/* What the boards measured themselves, read like a PC would */
+static void board_latency_print(const host_board_t *fw) {
+  latency_hist_t hist[LATENCY_STAGE_COUNT] = {0};
+  uint8_t page[LATENCY_PAGE_LENGTH];
+
+  for (int i = 0; i < LATENCY_PAGES; i++) {
+    uint16_t len = fw->tud_hid_get_report_cb(ITF_NUM_HID_CD, REPORT_ID_LATENCY,
+                                             HID_REPORT_TYPE_FEATURE, page,
+                                             sizeof(page));
+    if (!latency_page_add(hist, page, len)) {
+      printf("%s: bad latency report\n", fw->name);
+      return;
+    }
+  }
+  latency_print(fw->name, hist);
+}
+
+static void board_telemetry_print(const host_board_t *fw) {
+  telemetry_report_t t;
+  if (fw->tud_hid_get_report_cb(ITF_NUM_HID_CD, REPORT_ID_TELEMETRY,
+                                HID_REPORT_TYPE_FEATURE, (uint8_t *)&t,
+                                sizeof(t)) != sizeof(t)) {
+    printf("%s: bad telemetry report\n", fw->name);
+    return;
+  }
+  telemetry_print(fw->name, &t);
+}
+
+/**================================================== *
+ * ===============  Virtual UART link  ============== *
+ * ================================================== */
+
+static uint64_t hook_time_us(void *ctx) {
+  (void)ctx;
+  return sim.now_ns / 1000;
+}
+
+static void hook_sleep_us(void *ctx, uint64_t us) {
+  sim_board_t *board = ctx;
+  uint64_t until = sim.now_ns + us * 1000;
+  if (board->ready_ns < until) {
+    board->ready_ns = until;
+  }
+}
+
+static void hook_uart_write(void *ctx, const uint8_t *src, size_t len) {
+  sim_board_t *board = ctx;
+  pipe_t *pipe = board->tx;
+
+  uint64_t t = pipe->line_free_ns > sim.now_ns ? pipe->line_free_ns
+                                               : sim.now_ns;
+  for (size_t i = 0; i < len; i++) {
+    size_t next = (pipe->head + 1) % PIPE_SIZE;
+    if (next == pipe->tail) {
+      break;
+    }
+    t += sim.byte_ns;
+    pipe->arrival_ns[pipe->head] = t;
+    pipe->data[pipe->head] = src[i];
+    pipe->head = next;
+  }
+  pipe->line_free_ns = t;
+  pipe->bytes += len;
+
+  /* Blocking write returns once the rest fits into the TX FIFO */
+  uint64_t fifo_ns = UART_FIFO_DEPTH * sim.byte_ns;
+  if (t > sim.now_ns + fifo_ns) {
+    if (board->ready_ns < t - fifo_ns) {
+      board->ready_ns = t - fifo_ns;
+    }
+  }
+}
+
+static size_t hook_uart_tx_space(void *ctx) {
+  sim_board_t *board = ctx;
+  pipe_t *pipe = board->tx;
+  if (pipe->line_free_ns <= sim.now_ns) {
+    return UART_FIFO_DEPTH;
+  }
+  uint64_t queued = (pipe->line_free_ns - sim.now_ns + sim.byte_ns - 1) /
+                    sim.byte_ns;
+  return queued >= UART_FIFO_DEPTH ? 0 : UART_FIFO_DEPTH - queued;
+}
+
+static void pipe_deliver(pipe_t *pipe, sim_board_t *to) {
+  while (pipe->tail != pipe->head && pipe->arrival_ns[pipe->tail] <= sim.now_ns) {
+    if (sim.byte_errors && rand_next() % 1000000 < sim.byte_errors) {
+      pipe->data[pipe->tail] ^= 1 + rand_next() % 0xFF;
+      sim.corrupted++;
+    }
+    to->fw->uart_rx_push(&pipe->data[pipe->tail], 1);
+    pipe->tail = (pipe->tail + 1) % PIPE_SIZE;
+  }
+}
+
+/**================================================== *
+ * ===============  Virtual remote PC  ============== *
+ * ================================================== */
+
+static bool hook_hid_report(void *ctx, uint8_t instance, uint8_t report_id,
+                            void const *report, uint16_t len) {
+  sim_board_t *board = ctx;
+  if (instance >= ITF_NUM_TOTAL || len > REPORT_MAX) {
+    return false;
+  }
+
+  endpoint_t *ep = &board->ep[instance];
+  if (ep->busy) {
+    board->report_rejected++;
+    return false;
+  }
+
+  ep->busy = true;
+  ep->accepted_ns = sim.now_ns;
+  ep->report_id = report_id;
+  ep->len = len;
+  memcpy(ep->data, report, len);
+  return true;
+}
+
+/* Motion of all mouse reports between first and last, inclusive */
+static bool mouse_sum_matches(expect_t *e, size_t first, size_t last,
+                              const mouse_report_t *delivered) {
+  int32_t x = 0, y = 0;
+  for (size_t i = first;; i = (i + 1) % PENDING_SIZE) {
+    const mouse_report_t *m = (const mouse_report_t *)e->entries[i].data;
+    if (memcmp(m->buttons, delivered->buttons, sizeof(m->buttons))) {
+      return false;
+    }
+    x += m->x;
+    y += m->y;
+    if (i == last) {
+      break;
+    }
+  }
+  return x == delivered->x && y == delivered->y;
+}
+
+static void expect_consume(expect_t *e, uint8_t itf, size_t first,
+                           size_t last) {
+  while (e->tail != first) {
+    sim.lost[itf]++;
+    e->tail = (e->tail + 1) % PENDING_SIZE;
+  }
+  while (e->tail != last) {
+    sim.merged[itf]++;
+    e->tail = (e->tail + 1) % PENDING_SIZE;
+  }
+  e->tail = (e->tail + 1) % PENDING_SIZE;
+}
+
+/* Match a delivered report against what was generated, reports skipped on
+ * the way are counted as lost. Mouse reports may have been merged by the
+ * firmware, then the oldest one of them is returned. */
+static input_t *expect_match(uint8_t itf, const endpoint_t *ep) {
+  expect_t *e = &sim.expect[itf];
+  bool mouse = itf == ITF_NUM_HID_MS && ep->len == sizeof(mouse_report_t);
+
+  for (size_t i = e->tail; i != e->head; i = (i + 1) % PENDING_SIZE) {
+    input_t *in = &e->entries[i];
+    if (in->created_ns > ep->accepted_ns) {
+      break; // e.g. a key release sent by the firmware itself
+    }
+    if (in->len == ep->len && !memcmp(in->data, ep->data, ep->len)) {
+      expect_consume(e, itf, i, i);
+      return in;
+    }
+    if (!mouse || in->len != ep->len) {
+      continue;
+    }
+    for (size_t j = (i + 1) % PENDING_SIZE; j != e->head;
+         j = (j + 1) % PENDING_SIZE) {
+      if (e->entries[j].created_ns > ep->accepted_ns) {
+        break;
+      }
+      if (mouse_sum_matches(e, i, j, (const mouse_report_t *)ep->data)) {
+        expect_consume(e, itf, i, j);
+        return in;
+      }
+    }
+  }
+  return NULL;
+}
+
+static void host_poll(sim_board_t *board, bool measure) {
+  for (uint8_t itf = 0; itf < ITF_NUM_TOTAL; itf++) {
+    endpoint_t *ep = &board->ep[itf];
+    if (sim.now_ns < ep->next_poll_ns) {
+      continue;
+    }
+    ep->next_poll_ns += board->ep_interval_us[itf] * 1000ull;
+    if (!ep->busy) {
+      continue;
+    }
+
+    ep->busy = false;
+    if ((itf == ITF_NUM_HID_KB && ep->report_id != REPORT_ID_KEYBOARD) ||
+        (itf == ITF_NUM_HID_MS && ep->len == sizeof(mouse_report_t) &&
+         ep->report_id != REPORT_ID_MOUSE)) {
+      board->wrong_report_id++;
+    }
+    if (itf == ITF_NUM_HID_KB && ep->len == sizeof(keyboard_report_t)) {
+      memcpy(&board->pc_keys, ep->data, sizeof(board->pc_keys));
+    }
+    input_t *in = measure ? expect_match(itf, ep) : NULL;
+    if (in) {
+      series_add(&sim.to_device[itf], ep->accepted_ns - in->created_ns);
+      series_add(&sim.to_pc[itf], sim.now_ns - in->created_ns);
+    }
+    board->fw->tud_hid_report_complete_cb(itf, ep->data, ep->len);
+  }
+}
+
+/* Endpoint polling intervals straight from the firmware's descriptor */
+static void read_intervals(void *lib, sim_board_t *board) {
+  const uint8_t *desc = dlsym(lib, "desc_configuration");
+  for (uint8_t itf = 0; itf < ITF_NUM_TOTAL; itf++) {
+    board->ep_interval_us[itf] = 1000;
+  }
+  if (!desc) {
+    return;
+  }
+
+  uint16_t total = desc[2] | desc[3] << 8;
+  for (uint16_t i = 0; i < total && desc[i]; i += desc[i]) {
+    if (desc[i + 1] == TUSB_DESC_ENDPOINT) {
+      uint8_t itf = (desc[i + 2] & 0x7f) - 1;
+      if (itf < ITF_NUM_TOTAL) {
+        board->ep_interval_us[itf] = desc[i + 6] * 1000;
+      }
+    }
+  }
+}
+
+/**================================================== *
+ * ================  Input devices  ================= *
+ * ================================================== */
+
+/* Like a receiver's mouse, under the report ID that is our keyboard's. The
+ * PCs must only ever see our own IDs. */
+#define SIM_MOUSE_REPORT_ID REPORT_ID_KEYBOARD
+
+static const uint8_t desc_kb[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+static const uint8_t desc_ms[] = {
+    TUD_HID_REPORT_DESC_LOGI_MS(HID_REPORT_ID(SIM_MOUSE_REPORT_ID))};
+
+static void generate(sim_board_t *board, uint8_t instance, const uint8_t *data,
+                     uint16_t len, uint16_t payload_offset, bool expected) {
+  size_t next = (board->in_head + 1) % PENDING_SIZE;
+  expect_t *e = &sim.expect[instance];
+  size_t e_next = (e->head + 1) % PENDING_SIZE;
+  if (next == board->in_tail || e_next == e->tail) {
+    return;
+  }
+
+  input_t *in = &board->inputs[board->in_head];
+  in->created_ns = sim.now_ns;
+  in->instance = instance;
+  in->len = len;
+  memcpy(in->data, data, len);
+  board->in_head = next;
+  if (!expected) {
+    return;
+  }
+
+  /* What the remote PC should see: the payload, without report ID */
+  input_t *out = &e->entries[e->head];
+  *out = *in;
+  out->len = len - payload_offset;
+  memcpy(out->data, data + payload_offset, out->len);
+  e->head = e_next;
+  sim.generated[instance]++;
+}
+
+static void generate_keyboard(sim_board_t *board, uint64_t seq) {
+  keyboard_report_t report = {0};
+  if (!(seq & 1)) {
+    /* bitmap starts at HID_KEY_A, skip the hotkey letters */
+    uint8_t bit = (HID_KEY_E - HID_KEY_A) + (seq / 2) % 6;
+    report.keycode[bit / 8] = 1 << (bit % 8);
+  }
+  generate(board, ITF_NUM_HID_KB, (uint8_t *)&report, sizeof(report), 0, true);
+  sim.kbd_state = report;
+}
+
+/* Shift goes down on top of whatever is held, then CAPS_LOCK, the output
+ * toggle hotkey that never reaches a PC. The old output should let go of it
+ * all, the new one only gets shift. */
+static void generate_switch(sim_board_t *board) {
+  keyboard_report_t report = sim.kbd_state;
+  uint8_t bit = HID_KEY_CAPS_LOCK - HID_KEY_A;
+
+  report.modifier = KEYBOARD_MODIFIER_LEFTSHIFT;
+  generate(board, ITF_NUM_HID_KB, (uint8_t *)&report, sizeof(report), 0, false);
+  report.keycode[bit / 8] |= 1 << (bit % 8);
+  generate(board, ITF_NUM_HID_KB, (uint8_t *)&report, sizeof(report), 0, false);
+
+  if (sim.sw.pending) {
+    sim.sw_incomplete++;
+  }
+  uint8_t from = board->fw->state->shared.active_output;
+  sim.sw.pending = true;
+  sim.sw.at_ns = sim.now_ns;
+  sim.sw.from = from == PICO_A ? &sim.a : &sim.b;
+  sim.sw.to = from == PICO_A ? &sim.b : &sim.a;
+  sim.sw.from_held = sim.sw.released = sim.sw.reasserted = false;
+  sim.kbd_state = (keyboard_report_t){.modifier = KEYBOARD_MODIFIER_LEFTSHIFT};
+  sim.switches++;
+}
+
+/* Watch both PCs during a switch */
+static void switch_check(void) {
+  static const keyboard_report_t released = {0};
+  keyboard_report_t *from = &sim.sw.from->pc_keys, *to = &sim.sw.to->pc_keys;
+
+  if (!sim.sw.pending) {
+    return;
+  }
+  if (from->modifier & KEYBOARD_MODIFIER_LEFTSHIFT) {
+    sim.sw.from_held = true;
+  }
+  if (sim.sw.from_held && !sim.sw.released &&
+      !memcmp(from, &released, sizeof(released))) {
+    sim.sw.released = true;
+    series_add(&sim.sw_released, sim.now_ns - sim.sw.at_ns);
+  }
+  /* Shift and nothing else, a key pressed again would be typed */
+  if (!sim.sw.reasserted && to->modifier == KEYBOARD_MODIFIER_LEFTSHIFT &&
+      !memcmp(to->keycode, released.keycode, sizeof(released.keycode))) {
+    sim.sw.reasserted = true;
+    series_add(&sim.sw_reasserted, sim.now_ns - sim.sw.at_ns);
+  }
+  sim.sw.pending = !sim.sw.released || !sim.sw.reasserted;
+}
+
+/* What deskhopl_ctl does, a general page and a commit. A applies it and
+ * sends it over to B. */
+static void generate_config(sim_board_t *board, uint64_t seq) {
+  const user_config_t *config = board->fw->state->config;
+  config_report_t page = {.version = CONFIG_VERSION, .op = CONFIG_OP_GENERAL};
+  config_report_t commit = {.version = CONFIG_VERSION, .op = CONFIG_OP_COMMIT};
+
+  memcpy(page.general.os, config->os, sizeof(page.general.os));
+  page.general.os[PICO_B] = seq & 1 ? MACOS : LINUX;
+  page.general.screensaver_enabled = config->screensaver_enabled;
+  page.general.hotkey_count = config->hotkey_count;
+  page.general.screensaver_idle_s = 60 + seq % CONFIG_MAX_IDLE_S;
+
+  board->fw->tud_hid_set_report_cb(ITF_NUM_HID_CD, REPORT_ID_CONFIG,
+                                   HID_REPORT_TYPE_FEATURE,
+                                   (const uint8_t *)&page, sizeof(page));
+  board->fw->tud_hid_set_report_cb(ITF_NUM_HID_CD, REPORT_ID_CONFIG,
+                                   HID_REPORT_TYPE_FEATURE,
+                                   (const uint8_t *)&commit, sizeof(commit));
+  sim.config_changes++;
+}
+
+static void generate_mouse(sim_board_t *board, uint64_t seq) {
+  uint8_t report[1 + sizeof(mouse_report_t)] = {SIM_MOUSE_REPORT_ID};
+  mouse_report_t *mouse = (mouse_report_t *)&report[1];
+  mouse->x = (int16_t)(1 + seq % 64);
+  mouse->y = -(int16_t)(seq % 7);
+  generate(board, ITF_NUM_HID_MS, report, sizeof(report), 1, true);
+}
+
+/* The device address and HID instance reports for interface itf come from */
+static uint8_t source_addr(uint8_t itf) { return sim.hub ? 2 + itf : 1; }
+static uint8_t source_instance(uint8_t itf) { return sim.hub ? 0 : itf; }
+
+/* tuh_task(): hand over what the devices produced since the last pass */
+static void board_pass(sim_board_t *board) {
+  while (board->in_tail != board->in_head) {
+    input_t *in = &board->inputs[board->in_tail];
+    board->in_tail = (board->in_tail + 1) % PENDING_SIZE;
+    board->fw->tuh_hid_report_received_cb(source_addr(in->instance),
+                                          source_instance(in->instance),
+                                          in->data, in->len);
+  }
+  board->fw->core1_pass();
+}
+
+/* Run the core0 loop if it is awake, and work out when it wakes up next */
+static void core0_pass(sim_board_t *board) {
+  if (!sim.core0_poll) {
+    board->core0_next_ns = board->fw->core0_wake_us() * 1000;
+  }
+  if (sim.now_ns < board->core0_next_ns) {
+    return;
+  }
+
+  board->fw->core0_pass();
+  board->core0_wakeups++;
+  board->core0_next_ns = sim.core0_poll ? sim.now_ns + CORE0_POLL_NS
+                                        : board->fw->core0_wake_us() * 1000;
+}
+
+/**================================================== *
+ * ===================  Driver  ===================== *
+ * ================================================== */
+
+static void *load_board(const char *path, sim_board_t *board, pipe_t *tx,
+                        pipe_t *rx) {
+  void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (!lib) {
+    fprintf(stderr, "%s\n", dlerror());
+    exit(1);
+  }
+  host_board_fn_t fn = (host_board_fn_t)dlsym(lib, "host_board");
+  if (!fn) {
+    fprintf(stderr, "%s: no host_board()\n", path);
+    exit(1);
+  }
+
+  board->fw = fn();
+  board->tx = tx;
+  board->rx = rx;
+  board->hooks = (host_hooks_t){.ctx = board,
+                                .time_us = hook_time_us,
+                                .sleep_us = hook_sleep_us,
+                                .uart_write = hook_uart_write,
+                                .uart_tx_space = hook_uart_tx_space,
+                                .hid_report = hook_hid_report};
+  board->fw->set_hooks(&board->hooks);
+  board->fw->boot();
+  read_intervals(lib, board);
+  for (uint8_t itf = 0; itf < ITF_NUM_TOTAL; itf++) {
+    board->ep[itf].next_poll_ns = rand_next() % (board->ep_interval_us[itf] * 1000);
+  }
+  return lib;
+}
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+          "usage: %s [options]\n"
+          "  --seconds N     simulated time (default 10)\n"
+          "  --kbd-hz N      keyboard reports per second (default 20)\n"
+          "  --mouse-hz N    mouse reports per second (default 1000)\n"
+          "  --loop-ns N     cost of one core1 loop pass (default 2000)\n"
+          "  --baud N        UART_ZERO baud rate (default %d)\n"
+          "  --switch-hz N   output switches per second (default 0)\n"
+          "  --config-hz N   config changes on A per second (default 0)\n"
+          "  --byte-errors N corrupted bytes per million on the wire "
+          "(default 0)\n"
+          "  --hub           keyboard and mouse are separate devices\n"
+          "  --core0 MODE    event or poll, see above (default event)\n"
+          "  --seed N        random seed (default 1)\n",
+          prog, UART_ZERO_BAUD_RATE);
+}
+
+int main(int argc, char **argv) {
+  double seconds = 10;
+  double kbd_hz = 20, mouse_hz = 1000, switch_hz = 0, config_hz = 0;
+  uint64_t baud = UART_ZERO_BAUD_RATE;
+  sim.loop_ns = 2000;
+  sim.rng = 1;
+
+  static const struct option options[] = {
+      {"seconds", required_argument, 0, 's'},
+      {"kbd-hz", required_argument, 0, 'k'},
+      {"mouse-hz", required_argument, 0, 'm'},
+      {"loop-ns", required_argument, 0, 'l'},
+      {"baud", required_argument, 0, 'b'},
+      {"switch-hz", required_argument, 0, 'w'},
+      {"config-hz", required_argument, 0, 'g'},
+      {"byte-errors", required_argument, 0, 'e'},
+      {"hub", no_argument, 0, 'u'},
+      {"core0", required_argument, 0, 'c'},
+      {"seed", required_argument, 0, 'r'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "h", options, NULL)) != -1) {
+    switch (opt) {
+    case 's': seconds = atof(optarg); break;
+    case 'k': kbd_hz = atof(optarg); break;
+    case 'm': mouse_hz = atof(optarg); break;
+    case 'l': sim.loop_ns = strtoull(optarg, NULL, 0); break;
+    case 'b': baud = strtoull(optarg, NULL, 0); break;
+    case 'w': switch_hz = atof(optarg); break;
+    case 'g': config_hz = atof(optarg); break;
+    case 'e': sim.byte_errors = (uint32_t)strtoul(optarg, NULL, 0); break;
+    case 'u': sim.hub = true; break;
+    case 'c': sim.core0_poll = !strcmp(optarg, "poll"); break;
+    case 'r': sim.rng = (uint32_t)strtoul(optarg, NULL, 0) | 1; break;
+    default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+    }
+  }
+
+  sim.byte_ns = UART_BITS_PER_BYTE * NS_PER_S / baud;
+  sim.to_device[ITF_NUM_HID_KB].name = sim.to_pc[ITF_NUM_HID_KB].name = "keyboard";
+  sim.to_device[ITF_NUM_HID_MS].name = sim.to_pc[ITF_NUM_HID_MS].name = "mouse";
+  sim.to_device[ITF_NUM_HID_CD].name = sim.to_pc[ITF_NUM_HID_CD].name = "consumer";
+  sim.sw_released.name = sim.sw_reasserted.name = "switch";
+
+  load_board(BOARD_A_LIB, &sim.a, &sim.a_to_b, &sim.b_to_a);
+  load_board(BOARD_B_LIB, &sim.b, &sim.b_to_a, &sim.a_to_b);
+
+  /* Input devices hang off A, the active output is B */
+  sim.a.fw->tuh_hid_mount_cb(source_addr(ITF_NUM_HID_KB),
+                             source_instance(ITF_NUM_HID_KB), desc_kb,
+                             sizeof(desc_kb));
+  sim.a.fw->tuh_hid_mount_cb(source_addr(ITF_NUM_HID_MS),
+                             source_instance(ITF_NUM_HID_MS), desc_ms,
+                             sizeof(desc_ms));
+  sim.a.fw->tud_mount_cb();
+  sim.b.fw->tud_mount_cb();
+  sim.a.fw->state->shared.active_output = PICO_B;
+  sim.b.fw->state->shared.active_output = PICO_B;
+
+  uint64_t end_ns = (uint64_t)(seconds * NS_PER_S) + SETTLE_NS;
+  uint64_t quiet_ns = end_ns + QUIET_NS;
+  uint64_t kbd_period = kbd_hz > 0 ? (uint64_t)(NS_PER_S / kbd_hz) : UINT64_MAX;
+  uint64_t mouse_period =
+      mouse_hz > 0 ? (uint64_t)(NS_PER_S / mouse_hz) : UINT64_MAX;
+  uint64_t switch_period =
+      switch_hz > 0 ? (uint64_t)(NS_PER_S / switch_hz) : UINT64_MAX;
+  uint64_t next_kbd = SETTLE_NS + kbd_period / 3, next_mouse = SETTLE_NS;
+  uint64_t next_switch = switch_hz > 0 ? SETTLE_NS + switch_period / 2
+                                       : UINT64_MAX;
+  uint64_t config_period =
+      config_hz > 0 ? (uint64_t)(NS_PER_S / config_hz) : UINT64_MAX;
+  uint64_t next_config = config_hz > 0 ? SETTLE_NS + config_period / 3
+                                       : UINT64_MAX;
+  uint64_t kbd_seq = 0, mouse_seq = 0, config_seq = 0;
+
+  while (sim.now_ns < quiet_ns) {
+    pipe_deliver(&sim.a_to_b, &sim.b);
+    pipe_deliver(&sim.b_to_a, &sim.a);
+    host_poll(&sim.b, true);
+    host_poll(&sim.a, true);
+    switch_check();
+    if (sim.now_ns >= end_ns) {
+      next_kbd = next_mouse = next_switch = next_config = UINT64_MAX;
+    }
+    sim.a.fw->uart_irq();
+    sim.b.fw->uart_irq();
+
+    if (sim.now_ns >= next_kbd) {
+      generate_keyboard(&sim.a, kbd_seq++);
+      /* a bit of jitter, so we don't stay phase locked to the mouse */
+      next_kbd += kbd_period - kbd_period / 8 + rand_next() % (kbd_period / 4 + 1);
+    }
+    if (sim.now_ns >= next_mouse) {
+      generate_mouse(&sim.a, mouse_seq++);
+      next_mouse += mouse_period;
+    }
+    if (sim.now_ns >= next_switch) {
+      generate_switch(&sim.a);
+      next_switch += switch_period;
+    }
+    /* Leave the last second for the sync to settle */
+    if (sim.now_ns >= next_config) {
+      generate_config(&sim.a, config_seq++);
+      next_config += config_period;
+    }
+
+    sim_board_t *boards[] = {&sim.a, &sim.b};
+    for (int i = 0; i < 2; i++) {
+      if (sim.now_ns >= boards[i]->ready_ns) {
+        boards[i]->ready_ns = sim.now_ns + sim.loop_ns;
+        board_pass(boards[i]);
+      }
+      core0_pass(boards[i]);
+    }
+
+    /* Jump ahead to whatever happens next */
+    uint64_t next = sim.a.ready_ns < sim.b.ready_ns ? sim.a.ready_ns
+                                                    : sim.b.ready_ns;
+    next = next_kbd < next ? next_kbd : next;
+    next = next_mouse < next ? next_mouse : next;
+    next = next_switch < next ? next_switch : next;
+    next = next_config < next ? next_config : next;
+    next = sim.a.core0_next_ns < next ? sim.a.core0_next_ns : next;
+    next = sim.b.core0_next_ns < next ? sim.b.core0_next_ns : next;
+    next = next > sim.now_ns ? next : sim.now_ns + 1;
+    if (sim.a.fw->state->shared.active_output != sim.b.fw->state->shared.active_output) {
+      sim.disagree_ns += next - sim.now_ns;
+    }
+    sim.now_ns = next;
+  }
+
+  printf("simulated %.1f s, baud %llu, loop %llu ns, "
+         "keyboard %.0f Hz, mouse %.0f Hz%s\n",
+         seconds, (unsigned long long)baud, (unsigned long long)sim.loop_ns,
+         kbd_hz, mouse_hz, sim.hub ? ", behind a hub" : "");
+  printf("link A->B: %llu bytes, %.1f%% occupied\n",
+         (unsigned long long)sim.a_to_b.bytes,
+         100.0 * sim.a_to_b.bytes * sim.byte_ns / (seconds * NS_PER_S));
+  for (uint8_t itf = 0; itf < ITF_NUM_TOTAL; itf++) {
+    if (!sim.generated[itf]) {
+      continue;
+    }
+    printf("%-9s generated %llu, delivered %zu (+%llu merged), lost %llu\n",
+           sim.to_pc[itf].name, (unsigned long long)sim.generated[itf],
+           sim.to_pc[itf].count, (unsigned long long)sim.merged[itf],
+           (unsigned long long)sim.lost[itf]);
+    printf("%-9s B polled every %u us, %.0f reports per second reached the "
+           "PC\n",
+           sim.to_pc[itf].name, sim.b.ep_interval_us[itf],
+           sim.to_pc[itf].count / seconds);
+    hid_queue_stats_t *q = &sim.b.fw->state->hid_stats[itf];
+    printf("%-9s B queue: %u queued, %u coalesced, %u dropped, high water "
+           "%u\n",
+           sim.to_pc[itf].name, q->queued, q->coalesced, q->dropped,
+           q->high_water);
+  }
+  printf("B endpoint busy, report rejected: %llu\n",
+         (unsigned long long)sim.b.report_rejected);
+  printf("wrong report ID: A %llu, B %llu\n",
+         (unsigned long long)sim.a.wrong_report_id,
+         (unsigned long long)sim.b.wrong_report_id);
+  core_queue_stats_t *core = &sim.b.fw->state->core_queue_stats;
+  printf("B core1 -> core0: %u reports, %u dropped, high water %u, "
+         "wait mean %.1f max %u us\n",
+         core->handed_over, core->dropped, core->high_water,
+         core->handed_over
+             ? (double)core->wait_total_us / (double)core->handed_over
+             : 0.0,
+         core->wait_max_us);
+  printf("core0 loop (%s): A %.0f, B %.0f wakeups per second\n",
+         sim.core0_poll ? "poll" : "event",
+         sim.a.core0_wakeups * (double)NS_PER_S / quiet_ns,
+         sim.b.core0_wakeups * (double)NS_PER_S / quiet_ns);
+  uart_stats_t *tx_stats = &sim.a.fw->state->uart_stats;
+  printf("A TX queue: %u packets, %u dropped, high water %u bytes\n",
+         tx_stats->tx_packets, tx_stats->tx_dropped, tx_stats->tx_high_water);
+  if (sim.switches || sim.byte_errors) {
+    printf("output switches %llu, corrupted bytes %llu, boards disagreed "
+           "%.3f ms, now on %s/%s\n",
+           (unsigned long long)sim.switches,
+           (unsigned long long)sim.corrupted, sim.disagree_ns / 1e6,
+           sim.a.fw->state->shared.active_output == PICO_A ? "A" : "B",
+           sim.b.fw->state->shared.active_output == PICO_A ? "A" : "B");
+    sim_board_t *boards[] = {&sim.a, &sim.b};
+    for (int i = 0; i < 2; i++) {
+      uart_stats_t *stats = &boards[i]->fw->state->uart_stats;
+      printf("%s link: %u checksum errors, %u rejected, "
+             "%u control retransmits, %u duplicates, %u failed\n",
+             boards[i]->fw->name, stats->rx_checksum_errors,
+             stats->rx_rejected, stats->ctrl_retransmits,
+             stats->ctrl_duplicates, stats->ctrl_failed);
+    }
+  }
+  if (sim.config_changes) {
+    const user_config_t *a = sim.a.fw->state->config;
+    const user_config_t *b = sim.b.fw->state->config;
+    printf("config changes %llu, B %s A, idle %u/%u s\n",
+           (unsigned long long)sim.config_changes,
+           memcmp(a, b, sizeof(*a)) ? "differs from" : "matches",
+           (unsigned)(a->screensaver_idle_us / 1000000),
+           (unsigned)(b->screensaver_idle_us / 1000000));
+  }
+  if (sim.switches) {
+    printf("switches: %llu incomplete, latency from the hotkey press\n",
+           (unsigned long long)(sim.sw_incomplete + sim.sw.pending));
+    series_print("released", &sim.sw_released);
+    series_print("shift", &sim.sw_reasserted);
+  }
+  sim_board_t *boards[] = {&sim.a, &sim.b};
+  static const keyboard_report_t released = {0};
+  bool stuck = false;
+  for (int i = 0; i < 2; i++) {
+    held_keys_stats_t *held = &boards[i]->fw->state->held_keys_stats;
+    bool active = boards[i]->fw->role == sim.a.fw->state->shared.active_output;
+    const keyboard_report_t *expected = active ? &sim.kbd_state : &released;
+    bool wrong = memcmp(&boards[i]->pc_keys, expected, sizeof(*expected));
+    printf("%s held keys: %u released, %u reasserted, %u timed out, "
+           "%s PC %s\n",
+           boards[i]->fw->name, held->released, held->reasserted,
+           held->timed_out, active ? "active" : "inactive",
+           wrong ? "holds the wrong keys" : "holds what it should");
+    stuck |= wrong;
+  }
+  printf("latency from report generation on A's USB host port:\n");
+  for (uint8_t itf = 0; itf < ITF_NUM_TOTAL; itf++) {
+    series_print("->device", &sim.to_device[itf]);
+    series_print("->pc", &sim.to_pc[itf]);
+  }
+  printf("per stage, as measured by the boards:\n");
+  board_latency_print(sim.a.fw);
+  board_latency_print(sim.b.fw);
+  board_telemetry_print(sim.a.fw);
+  board_telemetry_print(sim.b.fw);
+
+  return stuck || sim.a.wrong_report_id || sim.b.wrong_report_id ? 1 : 0;
+}
@@ -0,0 +1,253 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Runs the flash config store against the RAM-backed flash of the stub HAL:
+ *
+ *   - blank flash boots with the defaults
+ *   - every save is what the next boot loads, also after the ring wrapped
+ *   - saving an unchanged config doesn't touch the flash
+ *   - the erases are spread evenly over the store's sectors, nothing outside
+ *     of them is touched
+ *   - power lost after any number of bytes of an erase or a program boots
+ *     with either the old or the new config, and the next save works
+ *   - a config saved to flash is what the board boots with
+ *
+ * and times config_load(), with the newest record intact and torn.
+ */
+
+#include "bench.h"
+#include "host.h"
+
+#define DEFAULT_SAVES 5000
+#define LOAD_RUNS 20000
+
+static uint32_t failures = 0;
+
+#define CHECK(cond, ...)                                                       \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      printf("FAIL: " __VA_ARGS__);                                            \
+      printf("\n");                                                            \
+      failures++;                                                              \
+    }                                                                          \
+  } while (0)
+
+/* A valid config that differs from the defaults and from its neighbours */
+static user_config_t make_config(uint32_t n) {
+  user_config_t config;
+  config_defaults(&config);
+  config.os[PICO_A] = n & 1 ? MACOS : LINUX;
+  config.os[PICO_B] = n & 2 ? MACOS : LINUX;
+  config.screensaver_enabled = n & 4;
+  config.screensaver_idle_us = 1000000 + n;
+  config.hotkey_count = 1 + n % MAX_HOTKEYS;
+  for (int i = 0; i < config.hotkey_count; i++) {
+    config.hotkeys[i].mask = (keyboard_mask_t){0};
+    config.hotkeys[i].mask.report.keycode[i] = 1 << (n % 8);
+    config.hotkeys[i].action = (n + i) % ACTION_COUNT;
+    config.hotkeys[i].pass_to_os = (n + i) & 1;
+  }
+  return config;
+}
+
+static bool same(const user_config_t *a, const user_config_t *b) {
+  return !memcmp(a, b, sizeof(*a));
+}
+
+/* What the board would come up with */
+static user_config_t reboot(void) {
+  user_config_t config;
+  config_load(&config);
+  return config;
+}
+
+static void check_blank(void) {
+  user_config_t defaults, config;
+
+  host_flash_reset();
+  config_defaults(&defaults);
+  CHECK(!config_load(&config), "blank flash has a config");
+  CHECK(same(&config, &defaults), "blank flash doesn't load the defaults");
+}
+
+static void check_saves(uint32_t saves) {
+  uint32_t first = CONFIG_STORE_OFFSET / FLASH_SECTOR_SIZE;
+  uint32_t sectors = PICO_FLASH_SIZE_BYTES / FLASH_SECTOR_SIZE;
+  uint32_t erases = 0, least = UINT32_MAX, most = 0;
+  static uint8_t before[PICO_FLASH_SIZE_BYTES];
+
+  host_flash_reset();
+  reboot();
+
+  for (uint32_t n = 0; n < saves; n++) {
+    user_config_t config = make_config(n);
+    config_save(&config);
+    user_config_t loaded = reboot();
+    CHECK(same(&loaded, &config), "save %u didn't load back", n);
+
+    memcpy(before, host_flash_base(), sizeof(before));
+    config_save(&config);
+    CHECK(!memcmp(before, host_flash_base(), sizeof(before)),
+          "save %u again touched the flash", n);
+  }
+
+  for (uint32_t sector = 0; sector < sectors; sector++) {
+    uint32_t count = host_flash_erases(sector);
+    if (sector < first) {
+      CHECK(!count, "sector %u outside of the store erased", sector);
+      continue;
+    }
+    erases += count;
+    least = MIN(least, count);
+    most = MAX(most, count);
+  }
+  CHECK(most - least <= 1, "uneven wear, %u to %u erases", least, most);
+
+  printf("%u saves: %u erases over %u sectors, %u to %u each\n", saves,
+         erases, CONFIG_STORE_SECTORS, least, most);
+}
+
+/* Cuts the power at every byte of the next save, once in the middle of a
+ * sector and once where it has to erase the next one first. */
+static void check_power_loss(void) {
+  static uint8_t image[PICO_FLASH_SIZE_BYTES];
+  uint32_t cuts = 0, old_config = 0, new_config = 0;
+
+  for (uint32_t position = 0; position < 2; position++) {
+    host_flash_reset();
+    reboot();
+
+    /* Fill the first sector, or stop somewhere inside it */
+    uint32_t saves = position ? FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE : 5;
+    for (uint32_t n = 0; n < saves; n++) {
+      user_config_t config = make_config(n);
+      config_save(&config);
+    }
+    user_config_t old = make_config(saves - 1);
+    user_config_t new = make_config(saves);
+    user_config_t next = make_config(saves + 1);
+    memcpy(image, host_flash_base(), sizeof(image));
+
+    for (int32_t bytes = 0;; bytes++) {
+      memcpy(host_flash_base(), image, sizeof(image));
+      reboot();
+
+      host_flash_cut(bytes);
+      config_save(&new);
+      bool cut = host_flash_was_cut();
+      host_flash_cut(-1);
+      if (!cut) {
+        break;
+      }
+      cuts++;
+
+      user_config_t loaded = reboot();
+      if (same(&loaded, &old)) {
+        old_config++;
+      } else if (same(&loaded, &new)) {
+        new_config++;
+      } else {
+        CHECK(false, "cut after %d bytes loads neither config", bytes);
+      }
+
+      config_save(&next);
+      loaded = reboot();
+      CHECK(same(&loaded, &next), "save after a cut at %d bytes lost", bytes);
+    }
+  }
+
+  printf("%u power cuts: %u booted the old config, %u the new one\n", cuts,
+         old_config, new_config);
+}
+
+/* A config in flash is what the hotkeys and the screensaver go by */
+static void check_boot(void) {
+  user_config_t config;
+  device_t *state = host_board()->state;
+  keyboard_report_t caps_lock = {0};
+  caps_lock.keycode[get_byte_offset(HID_KEY_CAPS_LOCK)] =
+      1 << get_pos_in_byte(HID_KEY_CAPS_LOCK);
+
+  host_flash_reset();
+  host_boot();
+  CHECK(check_all_hotkeys(&caps_lock), "default hotkeys not loaded");
+
+  config_defaults(&config);
+  config.hotkey_count = 0;
+  config.screensaver_enabled = false;
+  config.os[PICO_A] = MACOS;
+  config_save(&config);
+
+  host_boot();
+  CHECK(same(state->config, &config), "boot didn't load the saved config");
+  CHECK(!check_all_hotkeys(&caps_lock), "hotkeys from flash not used");
+}
+
+static void time_load(void) {
+  user_config_t config;
+
+  host_flash_reset();
+  reboot();
+  for (uint32_t n = 0; n < 3 * FLASH_SECTOR_SIZE / FLASH_PAGE_SIZE; n++) {
+    config = make_config(n);
+    config_save(&config);
+  }
+
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < LOAD_RUNS; i++) {
+    config_load(&config);
+    bench_keep(&config);
+  }
+  bench_print("config_load", bench_now_ns() - start, LOAD_RUNS);
+
+  /* Tear the newest record, it falls back to the one before */
+  uint8_t *newest = NULL;
+  for (uint32_t offset = CONFIG_STORE_OFFSET; offset < PICO_FLASH_SIZE_BYTES;
+       offset += FLASH_PAGE_SIZE) {
+    if (host_flash_base()[offset] != 0xFF) {
+      newest = &host_flash_base()[offset];
+    }
+  }
+  newest[FLASH_PAGE_SIZE / 2] ^= 0x01;
+
+  start = bench_now_ns();
+  for (int i = 0; i < LOAD_RUNS; i++) {
+    config_load(&config);
+    bench_keep(&config);
+  }
+  bench_print("config_load, newest torn", bench_now_ns() - start, LOAD_RUNS);
+}
+
+int main(int argc, char **argv) {
+  uint32_t saves = DEFAULT_SAVES;
+  if (argc > 1) {
+    saves = (uint32_t)strtoul(argv[1], NULL, 0);
+  }
+
+  check_blank();
+  check_saves(saves);
+  check_power_loss();
+  check_boot();
+  time_load();
+
+  if (failures) {
+    printf("%u checks failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,172 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Hammers the shared state from several threads, the way both cores do on
+ * the board. A "core1" thread keeps switching outputs and stamping its loop
+ * pass and activity timestamps, a "core0" thread flips tud_connected, and
+ * reader threads check every snapshot they take:
+ *
+ *   - output_switches and active_output change together, so active_output
+ *     has to be output_switches & 1 (torn output selection)
+ *   - both timestamps carry the switch count in their upper half and were
+ *     written in the same section as it (torn 64-bit value, mixed writes)
+ *   - nothing goes back in time, and nothing is older than what the writer
+ *     had finished before the snapshot started (stale output selection)
+ *
+ * The same checks run against plain copies of the struct, to show what the
+ * seqlock is there for.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "host.h"
+
+#define READERS 3
+#define DEFAULT_SWITCHES 2000000
+
+typedef struct {
+  uint64_t snapshots;
+  uint64_t torn;
+  uint64_t stale;
+  uint64_t elapsed_ns;
+} reader_result_t;
+
+static device_t *state;
+static uint32_t switches = DEFAULT_SWITCHES;
+static volatile bool running = true;
+static volatile uint32_t published = 0; // switches the writer has finished
+
+static bool plain_copy = false;
+
+static uint64_t stamp(uint32_t switch_count, uint32_t low) {
+  return (uint64_t)switch_count << 32 | low;
+}
+
+/* Like core1: switch outputs, then stamp the loop pass and activity */
+static void *core1_thread(void *arg) {
+  (void)arg;
+  for (uint32_t i = 1; i <= switches; i++) {
+    uint32_t irq_state = shared_state_write_begin();
+    state->shared.active_output = i & 1;
+    state->shared.output_switches = i;
+    state->shared.core1_last_loop_pass = stamp(i, ~i);
+    state->shared.last_activity = stamp(i, i);
+    shared_state_write_end(irq_state);
+
+    set_active_output(i & 1); // no change, only exercises the setter
+    __atomic_store_n(&published, i, __ATOMIC_RELEASE);
+  }
+  running = false;
+  return NULL;
+}
+
+/* Like core0: the USB device side comes and goes */
+static void *core0_thread(void *arg) {
+  (void)arg;
+  bool connected = false;
+  while (running) {
+    set_tud_connected(connected = !connected);
+  }
+  return NULL;
+}
+
+static shared_state_t take_snapshot(void) {
+  if (!plain_copy) {
+    return read_shared_state();
+  }
+  shared_state_t copy;
+  memcpy(&copy, (const void *)&state->shared, sizeof(copy));
+  return copy;
+}
+
+static void *reader_thread(void *arg) {
+  reader_result_t *result = arg;
+  uint32_t last_switches = 0;
+  uint64_t start = bench_now_ns();
+
+  while (running) {
+    uint32_t done = __atomic_load_n(&published, __ATOMIC_ACQUIRE);
+    shared_state_t snap = take_snapshot();
+    uint32_t n = snap.output_switches;
+
+    result->snapshots++;
+    if (snap.active_output != (n & 1) ||
+        snap.last_activity != stamp(n, n) ||
+        (n && snap.core1_last_loop_pass != stamp(n, ~n))) {
+      result->torn++;
+    }
+    if (n < done || n < last_switches) {
+      result->stale++;
+    }
+    last_switches = n;
+  }
+
+  result->elapsed_ns = bench_now_ns() - start;
+  return NULL;
+}
+
+static uint64_t run(const char *name) {
+  pthread_t writer, device, readers[READERS];
+  reader_result_t results[READERS] = {0};
+
+  memset((void *)&state->shared, 0, sizeof(state->shared));
+  published = 0;
+  running = true;
+
+  pthread_create(&device, NULL, core0_thread, NULL);
+  for (int i = 0; i < READERS; i++) {
+    pthread_create(&readers[i], NULL, reader_thread, &results[i]);
+  }
+  pthread_create(&writer, NULL, core1_thread, NULL);
+
+  pthread_join(writer, NULL);
+  pthread_join(device, NULL);
+
+  reader_result_t total = {0};
+  for (int i = 0; i < READERS; i++) {
+    pthread_join(readers[i], NULL);
+    total.snapshots += results[i].snapshots;
+    total.torn += results[i].torn;
+    total.stale += results[i].stale;
+    total.elapsed_ns += results[i].elapsed_ns;
+  }
+
+  printf("%-12s %12llu snapshots %10llu torn %10llu stale %8.1f ns/snapshot\n",
+         name, (unsigned long long)total.snapshots,
+         (unsigned long long)total.torn, (unsigned long long)total.stale,
+         total.snapshots ? (double)total.elapsed_ns / total.snapshots : 0.0);
+  return total.torn + total.stale;
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    switches = (uint32_t)strtoul(argv[1], NULL, 0);
+  }
+
+  state = host_board()->state;
+  host_boot();
+
+  printf("%u output switches, %d readers\n", switches, READERS);
+  uint64_t failures = run("seqlock");
+
+  plain_copy = true;
+  run("plain copy");
+
+  return failures ? 1 : 0;
+}
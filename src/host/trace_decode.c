@@ -0,0 +1,181 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decodes the binary trace a DH_DEBUG + DH_TRACE_BINARY build writes to
+ * UART1, e.g.
+ *
+ *   stty -F /dev/ttyUSB0 raw 115200 && cat /dev/ttyUSB0 > trace.bin
+ *   trace_decode trace.bin
+ *
+ * Anything that isn't a frame (boot messages from printf) is skipped.
+ * Records come out sorted by time, both cores merged.
+ *
+ * --demo runs board A in-process instead: it causes a few traced events,
+ * dumps them with trace_encode() and decodes that. It then compares the cost
+ * of recording an event against formatting the old printf line.
+ */
+
+#include <stdlib.h>
+
+#include "bench.h"
+#include "host.h"
+
+#define ITERATIONS 10000000
+
+typedef struct {
+  trace_record_t *records;
+  size_t count;
+  size_t capacity;
+} trace_list_t;
+
+static void list_add(trace_list_t *list, const trace_record_t *record) {
+  if (list->count == list->capacity) {
+    list->capacity = list->capacity ? 2 * list->capacity : 1024;
+    list->records =
+        realloc(list->records, list->capacity * sizeof(trace_record_t));
+  }
+  list->records[list->count++] = *record;
+}
+
+/* Frames with an event id we don't know are noise that happened to look like
+ * the magic, skip a byte and keep looking */
+static void decode(const uint8_t *data, size_t len, trace_list_t *list) {
+  size_t skipped = 0;
+
+  for (size_t i = 0; i < len;) {
+    trace_record_t record;
+    if (len - i >= TRACE_FRAME_LENGTH && data[i] == TRACE_FRAME_MAGIC_0 &&
+        data[i + 1] == TRACE_FRAME_MAGIC_1) {
+      memcpy(&record, &data[i + 2], sizeof(record));
+      if (record.event < TRACE_EVENT_COUNT && record.core < 2) {
+        list_add(list, &record);
+        i += TRACE_FRAME_LENGTH;
+        continue;
+      }
+    }
+    skipped++;
+    i++;
+  }
+
+  if (skipped) {
+    fprintf(stderr, "skipped %zu bytes that weren't trace frames\n", skipped);
+  }
+}
+
+static int by_time(const void *a, const void *b) {
+  const trace_record_t *ra = a, *rb = b;
+  /* The timestamps wrap after ~71 minutes, compare the difference */
+  int32_t diff = (int32_t)(ra->time_us - rb->time_us);
+  return diff < 0 ? -1 : diff > 0;
+}
+
+static void print(trace_list_t *list) {
+  char line[128];
+  qsort(list->records, list->count, sizeof(trace_record_t), by_time);
+  for (size_t i = 0; i < list->count; i++) {
+    trace_format(&list->records[i], line, sizeof(line));
+    printf("%s\n", line);
+  }
+}
+
+static int decode_file(const char *path) {
+  FILE *file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+  if (!file) {
+    perror(path);
+    return 1;
+  }
+
+  size_t len = 0, capacity = 65536;
+  uint8_t *data = malloc(capacity);
+  size_t n;
+  while ((n = fread(&data[len], 1, capacity - len, file)) > 0) {
+    len += n;
+    if (len == capacity) {
+      capacity *= 2;
+      data = realloc(data, capacity);
+    }
+  }
+  if (file != stdin) {
+    fclose(file);
+  }
+
+  trace_list_t list = {0};
+  decode(data, len, &list);
+  print(&list);
+  free(data);
+  return 0;
+}
+
+static int demo(void) {
+  static const uint8_t desc_kb[] = {TUD_HID_REPORT_DESC_LOGI_KB()};
+  uint8_t dump[64 * TRACE_FRAME_LENGTH];
+  const uint8_t report[8] = {0};
+
+  host_boot();
+  tud_mount_cb();
+  tuh_hid_mount_cb(1, 0, desc_kb, sizeof(desc_kb));
+  tuh_hid_report_received_cb(1, 0, report, 0);
+  host_set_tud_ready(false);
+  send_tud_report(ITF_NUM_HID_KB, REPORT_ID_KEYBOARD, sizeof(report), report);
+  host_core0_pass();
+  host_set_tud_ready(true);
+  tud_umount_cb();
+
+  /* Noise in front, like boot messages on the same UART */
+  size_t len = 0;
+  dump[len++] = 'x';
+  dump[len++] = TRACE_FRAME_MAGIC_0;
+  len += trace_encode(&dump[len], sizeof(dump) - len);
+
+  trace_list_t list = {0};
+  decode(dump, len, &list);
+  printf("%zu records in a %zu byte dump:\n", list.count, len);
+  print(&list);
+  printf("\n");
+
+  char line[128];
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    trace(TRACE_TUD_NOT_READY, i & 3, 0);
+  }
+  bench_print("trace() record", bench_now_ns() - start, ITERATIONS);
+
+  start = bench_now_ns();
+  for (int i = 0; i < ITERATIONS; i++) {
+    snprintf(line, sizeof(line), "x[report] tud not ready, interface %d\r\n",
+             i & 3);
+    bench_keep(line);
+  }
+  bench_print("snprintf() of the same line", bench_now_ns() - start,
+              ITERATIONS);
+  printf("(the old printf also had to get the line out at %d baud, %.1f ms)\n",
+         UART_ONE_BAUD_RATE,
+         strlen(line) * 10 * 1000.0 / UART_ONE_BAUD_RATE);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 2 && !strcmp(argv[1], "--demo")) {
+    return demo();
+  }
+  if (argc == 2 && (argv[1][0] != '-' || !strcmp(argv[1], "-"))) {
+    return decode_file(argv[1]);
+  }
+
+  fprintf(stderr, "usage: %s FILE|-|--demo\n", argv[0]);
+  return 1;
+}
@@ -17,36 +17,28 @@
 
 #include "main.h"
 
-hotkey_combo_t hotkeys[] = {
+#define RALT_RSHIFT (KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT)
+
+/* Key and modifier masks are expanded at compile time, see HOTKEY_MASK. These
+ * are the defaults, the config in flash can replace them. */
+static const hotkey_combo_t default_hotkeys[] = {
     /* Main keyboard switching hotkey */
-    {.modifier = 0,
-     .keys = {HID_KEY_CAPS_LOCK},
-     .key_count = 1,
+    {.mask = HOTKEY_MASK(0, HID_KEY_CAPS_LOCK),
      .pass_to_os = false,
-     .action_handler = &toggle_output},
-    {.modifier = KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT,
-     .keys = {HID_KEY_L},
-     .key_count = 1,
+     .action = ACTION_TOGGLE_OUTPUT},
+    {.mask = HOTKEY_MASK(RALT_RSHIFT, HID_KEY_L),
      .pass_to_os = false,
-     .action_handler = &lock_screen},
-    {.modifier = KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT,
-     .keys = {HID_KEY_Q},
-     .key_count = 1,
+     .action = ACTION_LOCK_SCREEN},
+    {.mask = HOTKEY_MASK(RALT_RSHIFT, HID_KEY_Q),
      .pass_to_os = false,
-     .action_handler = &suspend_active_pc},
-    {.modifier = KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT,
-     .keys = {HID_KEY_S},
-     .key_count = 1,
+     .action = ACTION_SUSPEND_ACTIVE_PC},
+    {.mask = HOTKEY_MASK(RALT_RSHIFT, HID_KEY_S),
      .pass_to_os = false,
-     .action_handler = &suspend_all_pcs},
-    {.modifier = KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT,
-     .keys = {HID_KEY_D},
-     .key_count = 1,
+     .action = ACTION_SUSPEND_ALL_PCS},
+    {.mask = HOTKEY_MASK(RALT_RSHIFT, HID_KEY_D),
      .pass_to_os = false,
-     .action_handler = &enable_debug},
-    {.modifier = KEYBOARD_MODIFIER_RIGHTALT | KEYBOARD_MODIFIER_RIGHTSHIFT,
-     .keys = {HID_KEY_R},
-     .key_count = 1,
+     .action = ACTION_ENABLE_DEBUG},
+    {.mask = HOTKEY_MASK(RALT_RSHIFT, HID_KEY_R),
      .pass_to_os = false,
-     .action_handler = &request_reboot},
+     .action = ACTION_REQUEST_REBOOT},
 };
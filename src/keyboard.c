@@ -15,9 +15,18 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "hotkeys.h"
 #include "main.h"
 
+/* enum hotkey_action_e -> what it does */
+static const action_handler_t hotkey_actions[ACTION_COUNT] = {
+    [ACTION_TOGGLE_OUTPUT] = toggle_output,
+    [ACTION_LOCK_SCREEN] = lock_screen,
+    [ACTION_SUSPEND_ACTIVE_PC] = suspend_active_pc,
+    [ACTION_SUSPEND_ALL_PCS] = suspend_all_pcs,
+    [ACTION_ENABLE_DEBUG] = enable_debug,
+    [ACTION_REQUEST_REBOOT] = request_reboot,
+};
+
 uint8_t get_byte_offset(uint8_t key) {
   uint8_t offset = (key - HID_KEY_A) / 8;
   return offset;
@@ -28,40 +37,27 @@ uint8_t get_pos_in_byte(uint8_t key) {
   return pos;
 }
 
-/* Tries to find if the keyboard report contains key, returns true/false */
-bool key_in_report(uint8_t key, const keyboard_report_t *report) {
-  uint8_t off = get_byte_offset(key);
-  uint8_t pos = get_pos_in_byte(key);
-  uint8_t val = 1 << pos;
-
-  if (report->keycode[off] == val) {
-    return true;
+/* Every modifier and key of the hotkey has to be held, others don't matter */
+static inline bool hotkey_matches(const keyboard_mask_t *hotkey,
+                                  const keyboard_mask_t *pressed) {
+  uint32_t missing = 0;
+  for (int i = 0; i < ARRAY_SIZE(hotkey->words); i++) {
+    missing |= hotkey->words[i] & ~pressed->words[i];
   }
-  return false;
+  return !missing;
 }
 
-/* Check if the current report matches a specific hotkey passed on */
-bool check_specific_hotkey(hotkey_combo_t keypress,
-                           const keyboard_report_t *report) {
-  /* We expect all modifiers specified to be detected in the report */
-  if (keypress.modifier != (report->modifier & keypress.modifier))
-    return false;
+/* Go through the list of hotkeys, check if any of them match. */
+const hotkey_combo_t *check_all_hotkeys(const keyboard_report_t *report) {
+  keyboard_mask_t pressed;
 
-  for (int n = 0; n < keypress.key_count; n++) {
-    if (!key_in_report(keypress.keys[n], report)) {
-      return false;
-    }
-  }
+  /* The report is byte aligned, the mask isn't */
+  memcpy(&pressed.report, report, sizeof(pressed.report));
 
-  /* Getting here means all of the keys were found. */
-  return true;
-}
-
-/* Go through the list of hotkeys, check if any of them match. */
-hotkey_combo_t *check_all_hotkeys(keyboard_report_t *report) {
-  for (int n = 0; n < ARRAY_SIZE(hotkeys); n++) {
-    if (check_specific_hotkey(hotkeys[n], report)) {
-      return &hotkeys[n];
+  const user_config_t *config = global_state.config;
+  for (int n = 0; n < config->hotkey_count; n++) {
+    if (hotkey_matches(&config->hotkeys[n].mask, &pressed)) {
+      return &config->hotkeys[n];
     }
   }
   return NULL;
@@ -69,7 +65,7 @@ hotkey_combo_t *check_all_hotkeys(keyboard_report_t *report) {
 
 bool process_keyboard_report(uint8_t const *report, uint8_t len) {
   keyboard_report_t *keyboard_report = (keyboard_report_t *)report;
-  hotkey_combo_t *hotkey = NULL;
+  const hotkey_combo_t *hotkey = NULL;
   bool pass_to_os = true;
 
   hotkey = check_all_hotkeys(keyboard_report);
@@ -77,7 +73,7 @@ bool process_keyboard_report(uint8_t const *report, uint8_t len) {
   /* ... and take appropriate action */
   if (hotkey != NULL) {
     /* Execute the corresponding handler */
-    hotkey->action_handler(keyboard_report);
+    hotkey_actions[hotkey->action](keyboard_report);
 
     /* And pass the key to the output PC if configured to do so. */
     pass_to_os = hotkey->pass_to_os;
@@ -86,12 +82,57 @@ bool process_keyboard_report(uint8_t const *report, uint8_t len) {
   return pass_to_os;
 }
 
-bool release_all_keys(void) {
-  // release keys if any were pressed
-  if (!global_state.tud_connected) {
-    return false;
+/**================================================== *
+ * =================  Held keys  ==================== *
+ * ================================================== */
+
+/* What the active output was told last about our keyboards. Core1 only. */
+static struct {
+  keyboard_report_t report;
+  bool held;        // Any key or modifier in it
+  uint64_t sent_at; // When it was sent, or sent again
+} routed = {0};
+
+static void routed_send(void) {
+  routed.sent_at = time_us_64();
+  send_x_report(KEYBOARD_REPORT_MSG, ITF_NUM_HID_KB, REPORT_ID_KEYBOARD,
+                sizeof(routed.report), (uint8_t *)&routed.report);
+}
+
+/* Core1, a keyboard report is about to go to the active output */
+void held_keys_routed(uint8_t const *report, uint8_t len) {
+  static const keyboard_report_t released = {0};
+
+  if (len != sizeof(keyboard_report_t)) {
+    return;
+  }
+  memcpy(&routed.report, report, sizeof(routed.report));
+  routed.held = memcmp(&routed.report, &released, sizeof(released)) != 0;
+  routed.sent_at = time_us_64();
+}
+
+/* Core1, the output changed. The old one lets go of everything it holds, the
+ * new one gets the modifiers that are still held instead of waiting for the
+ * next key, e.g. for a shift-click right after the switch. Keys aren't pressed
+ * again, that would type them. */
+void switch_held_keys(uint8_t output) {
+  if (output != BOARD_ROLE) {
+    release_held_keys();
+  }
+
+  memset(routed.report.keycode, 0, sizeof(routed.report.keycode));
+  routed.held = routed.report.modifier != 0;
+  if (routed.held) {
+    routed_send();
+    global_state.held_keys_stats.reasserted++;
+  }
+}
+
+/* Core1 loop. Keys still held are sent again every HELD_KEYS_REFRESH_US, if
+ * that stops, held_keys_task() on the output takes them for stuck. */
+void held_keys_refresh_task(device_t *state) {
+  (void)state;
+  if (routed.held && time_us_64() - routed.sent_at >= HELD_KEYS_REFRESH_US) {
+    routed_send();
   }
-  keyboard_report_t release_keys = {0};
-  return send_tud_report(ITF_NUM_HID_KB, REPORT_ID_KEYBOARD,
-                         sizeof(keyboard_report_t), (uint8_t *)&release_keys);
 }
@@ -0,0 +1,120 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+/**================================================== *
+ * ================  Recording  ===================== *
+ * ================================================== */
+
+/* Every stage has a single writer (core1, core0 or under the UART TX lock), so
+ * plain increments will do. The clocks of the two boards aren't in sync, each
+ * board only measures its own stages. */
+void __not_in_flash_func(latency_record)(enum latency_stage_e stage,
+                                         uint32_t since) {
+  latency_hist_t *hist = &global_state.latency[stage];
+  uint32_t us = time_us_32() - since;
+  uint32_t bucket = us ? 32 - __builtin_clz(us) : 0;
+
+  if (bucket >= LATENCY_BUCKETS) {
+    bucket = LATENCY_BUCKETS - 1;
+  }
+  hist->buckets[bucket]++;
+  if (us > hist->max_us) {
+    hist->max_us = us;
+  }
+}
+
+/* Core1 only: the report being handled right now, where it came from and
+ * when. Consumed by latency_routed(). */
+static struct {
+  uint32_t start;
+  bool from_host; // from a USB device, not from the other board
+  bool valid;
+} current = {0};
+
+/* Entry of tuh_hid_report_received_cb() */
+void latency_host_report(void) {
+  current.start = time_us_32();
+  current.from_host = true;
+  current.valid = true;
+}
+
+/* A report packet from the other board, received_at is when its last byte
+ * was taken from the UART */
+void latency_link_report(uint32_t received_at) {
+  latency_record(LATENCY_LINK_RX, received_at);
+  current.start = received_at;
+  current.from_host = false;
+  current.valid = true;
+}
+
+/* The report is on its way to the device stack or the link. Returns what the
+ * next stage is measured from: now for reports from a USB device, the time
+ * they arrived for reports from the other board. */
+uint32_t latency_routed(void) {
+  uint32_t now = time_us_32();
+
+  /* Made up here, e.g. keys released on an output switch */
+  if (!current.valid) {
+    return now;
+  }
+  current.valid = false;
+
+  if (!current.from_host) {
+    return current.start;
+  }
+  latency_record(LATENCY_HOST_TO_ROUTED, current.start);
+  return now;
+}
+
+/**================================================== *
+ * ==================  Reading  ===================== *
+ * ================================================== */
+
+/* The histograms don't fit into one feature report, so they are read in
+ * pages: stage, index of the first word, word count and up to
+ * LATENCY_PAGE_WORDS words of latency_hist_t (little endian). Every read
+ * moves on to the next page, LATENCY_PAGES reads in a row return all of them.
+ * Core0 only, from tud_hid_get_report_cb(). */
+static struct {
+  uint8_t stage;
+  uint8_t word;
+} page = {0};
+
+uint16_t latency_get_report(uint8_t *buffer, uint16_t reqlen) {
+  const uint32_t *words = (const uint32_t *)&global_state.latency[page.stage];
+  uint8_t count = LATENCY_WORDS - page.word;
+
+  if (count > LATENCY_PAGE_WORDS) {
+    count = LATENCY_PAGE_WORDS;
+  }
+  if (reqlen < 3 + 4 * count) {
+    return 0;
+  }
+
+  buffer[0] = page.stage;
+  buffer[1] = page.word;
+  buffer[2] = count;
+  memcpy(&buffer[3], &words[page.word], 4 * count);
+
+  page.word += count;
+  if (page.word == LATENCY_WORDS) {
+    page.word = 0;
+    page.stage = (page.stage + 1) % LATENCY_STAGE_COUNT;
+  }
+  return 3 + 4 * count;
+}
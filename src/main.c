@@ -21,17 +21,26 @@ device_t global_state = {0};
 device_t *state = &global_state;
 
 void core1_main() {
+  // core0 parks us while it writes the flash, see config_store.c
+  multicore_lockout_victim_init();
+
   sleep_ms(10);
 
   uart_packet_t in_packet = {0};
+  uint64_t last_pass = time_us_64();
 
   while (true) {
     // USB host task, needs to run as often as possible
     if (tuh_inited()) {
       tuh_task();
     }
-    state->core1_last_loop_pass = time_us_64();
-    uart_receive_char(&in_packet, state);
+    record_loop_time(&state->loop_stats.core1_max_us, last_pass);
+    last_pass = time_us_64();
+    set_core1_last_loop_pass(last_pass);
+    uart_receive_packets(&in_packet, state);
+    uart_retransmit_task(state);
+    mouse_link_task(state);
+    held_keys_refresh_task(state);
   }
 }
 
@@ -43,14 +52,32 @@ int main() {
 
   watchdog_enable(WATCHDOG_DELAY_MS, WATCHDOG_PAUSE_DEBUG);
 
+  absolute_time_t next_tick = get_absolute_time();
+
   while (true) {
-    kick_watchdog_task(state);
-    // USB device task, needs to run as often as possible
+    uint64_t woke = time_us_64();
+
+    // USB device task, the USB interrupt wakes us up for it
     tud_task();
 
-    screensaver_task(state);
+    // Reports handed over by core1, it sends an event for each one
+    hid_queue_task();
+
+    // Housekeeping doesn't need more than the tick
+    if (time_reached(next_tick)) {
+      next_tick = make_timeout_time_us(CORE0_TICK_US);
+      kick_watchdog_task(state);
+      screensaver_task(state);
+      held_keys_task(state);
+      config_task(state);
+      config_store_task(state);
+      trace_task();
+      stdio_flush();
+    }
+
+    record_loop_time(&state->loop_stats.core0_max_us, woke);
 
-    stdio_flush();
-    sleep_us(10);
+    // Sleep until an interrupt, an event from core1 or the next tick
+    best_effort_wfe_or_timeout(next_tick);
   }
 }
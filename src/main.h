@@ -17,7 +17,13 @@
 
 #pragma once
 // INCLUDES
+#ifdef DH_HOST
+#include "host/hal.h"
+#else
 #include "hardware/clocks.h"
+#include "hardware/flash.h"
+#include "hardware/irq.h"
+#include "hardware/sync.h"
 #include "hardware/watchdog.h"
 #include "pico/binary_info.h"
 #include "pico/bootrom.h"
@@ -25,6 +31,7 @@
 #include "pico/stdlib.h"
 #include "pio_usb.h"
 #include "tusb.h"
+#endif
 #include "tusb_descriptors.h"
 #include "user_config.h"
 #include <stdbool.h>
@@ -41,6 +48,7 @@
 #define WATCHDOG_DELAY_MS 500  // milliseconds
 #define WATCHDOG_PAUSE_DEBUG 1 // Pause watchdog on debug
 #define CORE1_TIMEOUT_US WATCHDOG_DELAY_MS * 1000 // Convert to microseconds
+#define CORE0_TICK_US 10000 // Watchdog and screensaver run this often
 
 // UART CONFIG
 #define UART_ZERO uart0
@@ -49,6 +57,34 @@
 #define UART_ONE_BAUD_RATE 115200
 #define UART_ONE_TX_PIN 4
 #define UART_ONE_RX_PIN 5
+#define MOUSE_LINK_BACKLOG 32 // Merge mouse motion while more bytes wait to go
+
+// CONFIG STORE
+#define CONFIG_STORE_SECTORS 4 // At the end of the flash, written as a ring
+#define CONFIG_STORE_OFFSET                                                    \
+  (PICO_FLASH_SIZE_BYTES - CONFIG_STORE_SECTORS * FLASH_SECTOR_SIZE)
+#define CONFIG_STORE_MAGIC 0x4C504844 // "DHPL"
+#define CONFIG_STORE_VERSION 1        // Bump when user_config_t changes
+#define CONFIG_STORE_DELAY_US 1000000 // Wait for more changes before writing
+#define MAX_HOTKEYS 10
+#define CONFIG_MAX_IDLE_S (UINT32_MAX / 1000000) // Screensaver, fits in us
+#define CONFIG_SYNC_RETRY_US 100000 // Send it all again if there is no ACK
+#define CONFIG_SYNC_ROUNDS 10       // Give up after this many tries
+#define CONFIG_SYNC_BACKLOG 128     // Leave the link to reports when busier
+
+// HELD KEYS
+#define HELD_KEYS_REFRESH_US 500000  // Held keys are sent again this often
+#define HELD_KEYS_TIMEOUT_US 2000000 // Stuck if not sent again meanwhile
+#define HELD_KEYS_LINK_VERSION 3     // Boards from here on send them again
+
+// LATENCY HISTOGRAMS
+#define LATENCY_BUCKETS 20 // Log2 buckets in microseconds, the last open ended
+#define LATENCY_WORDS (LATENCY_BUCKETS + 1) // latency_hist_t in words
+#define LATENCY_PAGE_WORDS 7 // Histogram words per feature report
+#define LATENCY_PAGE_LENGTH (3 + 4 * LATENCY_PAGE_WORDS)
+#define LATENCY_PAGES                                                          \
+  (LATENCY_STAGE_COUNT *                                                       \
+   ((LATENCY_WORDS + LATENCY_PAGE_WORDS - 1) / LATENCY_PAGE_WORDS))
 #if BOARD_ROLE == PICO_A
 #define BOARD_NAME "PICO_A"
 #define UART_TX_PIN 12
@@ -66,6 +102,26 @@
  * - 1 checksum byte ends the packet
  *      - checksum includes **only** the packet data
  *      - checksum is simply calculated by XORing all bytes together
+ *
+ * Version 2 packets are COBS encoded and delimited by 0x00, a zero byte
+ * always means a packet boundary, so re-sync is immediate:
+ * - 0x00 (only when the line might have been idle)
+ * - COBS(type, interface, report_id, report_len, data[report_len], crc16)
+ *      - only report_len data bytes are sent
+ *      - crc16 (CRC-16/CCITT-FALSE, big endian) covers everything before it
+ * - 0x00
+ *
+ * Every board announces its version at boot (LINK_VERSION_MSG, always sent as
+ * version 1) and only uses version 2 once the other board announced it
+ * understands it.
+ *
+ * Control messages (output select, lock screen, suspend, reboot) to a version
+ * 2 board carry 0x80 | sequence number as report_id. The receiver answers
+ * each with an ACK_MSG holding the same report_id and drops duplicates, the
+ * sender retransmits until it gets the ACK. HID reports are never ACKed.
+ *
+ * Version 3 boards send the keyboard state again while keys are held, so the
+ * other board can tell a lost release from a key that is still held.
  */
 
 enum packet_type_e {
@@ -79,44 +135,175 @@ enum packet_type_e {
   // SYNC_BORDERS_MSG = 8,
   // FLASH_LED_MSG = 9,
   // SCREENSAVER_MSG = 10,
-  // WIPE_CONFIG_MSG = 11,
+  WIPE_CONFIG_MSG = 11,
   // SWAP_OUTPUTS_MSG = 12,
   // HEARTBEAT_MSG = 13,
-  // OUTPUT_CONFIG_MSG = 14,
+  OUTPUT_CONFIG_MSG = 14,
   CONSUMER_CONTROL_MSG = 15,
   LOCK_SCREEN_MSG = 16,
   SUSPEND_PC_MSG = 17,
   ENABLE_DEBUG_MSG = 18,
   REQUEST_REBOOT_MSG = 19,
   OUTPUT_GET_MSG = 20,
+  LINK_VERSION_MSG = 21,
+  ACK_MSG = 22,
+  PACKET_TYPE_COUNT, // keep last
 };
-typedef enum { IDLE, READING_PACKET, PROCESSING_PACKET } uart_state_t;
+
+enum msg_class_e {
+  MSG_CLASS_REPORT,  // HID traffic, latency matters most, never ACKed
+  MSG_CLASS_CONTROL, // changes state on both boards, ACKed and retransmitted
+  MSG_CLASS_LINK,    // keeps the link itself going
+  MSG_CLASS_CHUNK,   // part of something bigger, ACKed once it's complete
+};
+
+/* Events in the trace ring, trace.c has what the two arguments mean */
+enum trace_event_e {
+  TRACE_LOST,              // Records overwritten before core0 read them
+  TRACE_TUD_CONNECTED,     // set_tud_connected()
+  TRACE_TUD_NOT_READY,     // Report dropped, device stack not ready
+  TRACE_BAD_REPORT_LEN,    // send_x_report() got a report it can't send
+  TRACE_CHECKSUM_ERROR,    // UART packet failed its checksum
+  TRACE_RX_REJECTED,       // UART packet refused by process_packet()
+  TRACE_DEVICE_MOUNT,      // tud_mount_cb()
+  TRACE_DEVICE_UMOUNT,     // tud_umount_cb()
+  TRACE_DEVICE_SUSPEND,    // tud_suspend_cb()
+  TRACE_DEVICE_RESUME,     // tud_resume_cb()
+  TRACE_GET_REPORT,        // tud_hid_get_report_cb()
+  TRACE_SET_REPORT,        // tud_hid_set_report_cb()
+  TRACE_HOST_MOUNT,        // tuh_hid_mount_cb()
+  TRACE_HOST_REPORT_INFO,  // One report of the descriptor we pass on
+  TRACE_HOST_UMOUNT,       // tuh_hid_umount_cb()
+  TRACE_HOST_EMPTY_REPORT, // tuh_hid_report_received_cb() with no data
+  TRACE_HOST_RECEIVE_FAIL, // tuh_hid_receive_report() failed
+  TRACE_CONFIG_SET,        // The PC wrote the config report
+  TRACE_HOST_UNROUTED,     // Report we don't pass on, or too short
+  TRACE_CONFIG_LOAD,       // config_load() at boot
+  TRACE_CONFIG_SAVE,       // config_save() wrote a record to flash
+  TRACE_CONFIG_APPLIED,    // A new config snapshot is live
+  TRACE_CONFIG_SYNC,       // Sending the config to the other board
+  TRACE_KEYS_RELEASED,     // Let go of what our PC still held
+  TRACE_HOST_PLANS_FULL,   // No room left for the reports of a device
+  TRACE_EVENT_COUNT,       // keep last
+};
+
+/* Stages of a report's way through one board, each gets a histogram */
+enum latency_stage_e {
+  LATENCY_HOST_TO_ROUTED, // USB host callback until routed, hotkeys included
+  LATENCY_ROUTED_TO_LINK, // Routed until in the UART TX queue
+  LATENCY_LINK_TX,        // UART TX queue until the last byte is in the FIFO
+  LATENCY_LINK_RX,        // Last byte received until core1 processes it
+  LATENCY_TO_DEVICE,      // Routed or received until tud_hid_n_report()
+  LATENCY_STAGE_COUNT,    // keep last
+};
+
+/* One trace record, also the binary format of a dump (little endian) */
+typedef struct TU_ATTR_PACKED {
+  uint32_t time_us; // time_us_32() when it was recorded
+  uint8_t event;    // enum trace_event_e
+  uint8_t core;     // Core that recorded it
+  uint16_t arg0;
+  uint32_t arg1;
+} trace_record_t;
 
 enum os_type_e {
   LINUX = 1,
   MACOS,
 };
 
+
 typedef struct {
-  uint8_t os;
-} device_config_t;
+  uint32_t tx_packets;         // Packets queued for sending
+  uint32_t tx_dropped;         // Packets dropped, TX queue was full
+  uint32_t tx_high_water;      // Most bytes ever waiting in the TX queue
+  uint32_t rx_packets;         // Packets received with a valid checksum
+  uint32_t rx_checksum_errors; // Packets dropped, checksum mismatch
+  uint32_t rx_resyncs;         // Times we had to skip bytes to find a packet
+  uint32_t rx_overruns;        // Bytes lost, RX ring buffer was full
+  uint32_t rx_rejected;        // Unknown type, bad length or not for us
+  uint32_t ctrl_retransmits;   // Control messages sent again, no ACK yet
+  uint32_t ctrl_duplicates;    // Control messages received more than once
+  uint32_t ctrl_failed;        // Control messages given up on
+  uint32_t mouse_coalesced;    // Mouse reports merged, the link was backed up
+} uart_stats_t;
 
 typedef struct {
-  uint8_t active_output;         // Currently selected output (0 = A, 1 = B)
-  uint64_t core1_last_loop_pass; // when core1 loop went through last
-  uint64_t last_activity;        // Timestamp of the last input activity
-  bool tud_connected;            // Are we connected to the host
-  bool reboot_requested;         // Are we gonna reboot soon
-  uart_state_t
-      uart_state; // Storing the state for the simple receiver state machine
-  device_config_t device_config[NUM_DEVICES];
-} device_t;
+  uint32_t queued;     // Reports that had to wait for the IN endpoint
+  uint32_t coalesced;  // Reports merged into one that was already waiting
+  uint32_t dropped;    // Reports lost, queue was full
+  uint32_t high_water; // Most reports ever waiting
+} hid_queue_stats_t;
+
+typedef struct {
+  uint32_t handed_over;   // Reports core1 passed to core0
+  uint32_t dropped;       // Reports lost, core0 fell too far behind
+  uint32_t high_water;    // Most reports ever waiting for core0
+  uint32_t wait_max_us;   // Longest a report waited for core0
+  uint64_t wait_total_us; // Sum of all waits, for the mean
+} core_queue_stats_t;
+
+/* Bucket n counts times below 2^n us (and from 2^(n-1) us), the last one
+ * everything longer. Also the word order of the feature report pages. */
+typedef struct {
+  uint32_t buckets[LATENCY_BUCKETS];
+  uint32_t max_us; // Longest time seen
+} latency_hist_t;
+
+typedef struct {
+  uint32_t core0_max_us; // Longest core0 loop pass, not counting the sleep
+  uint32_t core1_max_us; // Longest time between two core1 loop passes
+} loop_stats_t;
+
+typedef struct {
+  uint32_t released;   // Reports that let go of keys after a switch
+  uint32_t reasserted; // Modifiers pressed again on the new output
+  uint32_t timed_out;  // Reports that let go of stuck keys
+} held_keys_stats_t;
+
+/* Feature report REPORT_ID_TELEMETRY (little endian), the 16 bit counters
+ * stop at 0xFFFF */
+#define TELEMETRY_VERSION 1
+typedef struct TU_ATTR_PACKED {
+  uint8_t version;             // TELEMETRY_VERSION
+  uint8_t active_output;       // 0 = A, 1 = B
+  uint32_t tx_packets;         // UART packets queued for sending
+  uint32_t rx_packets;         // UART packets received
+  uint16_t rx_checksum_errors; // UART packets with a bad checksum
+  uint16_t rx_resyncs;         // Times the receiver had to skip bytes
+  uint16_t rx_overruns;        // Bytes lost, RX ring buffer was full
+  uint16_t rx_rejected;        // UART packets refused by process_packet()
+  uint16_t ctrl_failed;        // Control messages given up on
+  uint16_t dropped;            // Lost in the HID, core1 -> core0 or TX queue
+  uint16_t tx_high_water;      // Bytes, UART TX queue
+  uint8_t hid_high_water;      // Reports, fullest HID queue
+  uint8_t core_high_water;     // Reports, core1 -> core0 queue
+  uint16_t core0_loop_max_us;
+  uint16_t core1_loop_max_us;
+} telemetry_report_t;
+
+// tusb_d.c
+enum { ITF_NUM_HID_KB, ITF_NUM_HID_MS, ITF_NUM_HID_CD, ITF_NUM_TOTAL };
+
+/* Everything both cores look at. Never read it in place, take a consistent
+ * copy with read_shared_state() and write through the setters in utils.c.
+ * The comments say which core writes the field. */
+typedef struct {
+  uint8_t active_output;         // core1: Selected output (0 = A, 1 = B)
+  bool tud_connected;            // both: Are we connected to the host
+  bool reboot_requested;         // both: Are we gonna reboot soon
+  uint32_t output_switches;      // core1: Times active_output has changed
+  uint64_t core1_last_loop_pass; // core1: when core1 loop went through last
+  uint64_t last_activity;        // core1: Timestamp of the last input activity
+} shared_state_t;
 
 typedef void (*action_handler_t)();
 
-typedef struct { // Maps message type -> message handler function
-  enum packet_type_e type;
+typedef struct { // Message type (the index) -> handler and what to expect
   action_handler_t handler;
+  uint8_t min_len;   // Shortest valid report_len
+  uint8_t max_len;   // Longest valid report_len
+  uint8_t msg_class; // enum msg_class_e
+  uint8_t roles;     // Boards that accept it, 1 << BOARD_ROLE
 } uart_handler_t;
 
 // Logitech HID Report Protocol Keyboard Report.
@@ -135,26 +322,187 @@ typedef struct TU_ATTR_PACKED {
 } mouse_report_t;
 
 typedef struct TU_ATTR_PACKED {
-  uint8_t logitech[4];
+  uint8_t logitech[4]; // two usage slots, 16 bit each, 0 is none
   uint8_t apple;
 } consumer_report_t;
 
+#define CONSUMER_USAGE_SLOTS 2
+#define CONSUMER_USAGE_MAX 0x2FF // Logical maximum of our usage slots
+
+/* Where a report of a USB device goes, picked by its top level collection */
+enum hid_route_e {
+  ROUTE_NONE, // vendor pages and anything else we don't pass on
+  ROUTE_KEYBOARD,
+  ROUTE_MOUSE,
+  ROUTE_CONSUMER,
+  ROUTE_COUNT, // keep last
+};
+
+/* How one field of a device's input report gets into our own report */
+enum hid_field_kind_e {
+  HID_FIELD_BITS, // count bits, copied to bit dst of our report
+  HID_FIELD_KEYS, // count key usages, each sets its bit in keyboard_report_t
+  HID_FIELD_AXIS, // one value, clamped into dst_size bytes at byte dst
+  HID_FIELD_USAGES, // count consumer usages, each into a free usage slot
+  HID_FIELD_USAGE,  // one bit, if set usage_base goes into a free usage slot
+};
+
+typedef struct {
+  uint16_t offset;    // in bits, after the report ID
+  uint8_t size;       // bits per element
+  uint8_t count;      // elements
+  uint8_t kind;       // enum hid_field_kind_e
+  uint8_t dst;        // bit (BITS) or byte (AXIS) in our report
+  uint8_t dst_size;   // AXIS: int8_t or int16_t
+  bool is_signed;     // AXIS: logical minimum below 0
+  int16_t usage_base; // KEYS, USAGES: the usage a value of 0 stands for
+} hid_field_t;
+
+#define HID_PLAN_FIELDS 8
+
+/* One input report of a USB device, compiled from its report descriptor at
+ * mount by hid_parser.c */
+typedef struct {
+  uint8_t report_id;
+  uint8_t route;       // enum hid_route_e
+  bool passthrough;    // laid out like ours, sent on as it is
+  uint8_t min_len;     // shortest report holding every field, in bytes
+  uint8_t field_count;
+  hid_field_t fields[HID_PLAN_FIELDS];
+} hid_plan_t;
+
+/* A report translated into our layout, with a spare byte for bit copies
+ * spilling over the end */
+typedef union {
+  keyboard_report_t keyboard;
+  mouse_report_t mouse;
+  consumer_report_t consumer;
+  uint8_t bytes[sizeof(keyboard_report_t) + 1];
+} hid_translated_t;
+
+/* A keyboard report viewed as words, for matching a whole report at once */
+typedef union {
+  keyboard_report_t report;
+  uint32_t words[sizeof(keyboard_report_t) / sizeof(uint32_t)];
+} keyboard_mask_t;
+
+/* Bit of key in byte of the keycode bitmap, 0 if it lives elsewhere */
+#define KEY_MASK_BIT(key, byte)                                                \
+  ((key) >= HID_KEY_A && ((key) - HID_KEY_A) / 8 == (byte)                     \
+       ? 1 << (((key) - HID_KEY_A) % 8)                                        \
+       : 0)
+#define KEY_MASK_BYTE(byte, k1, k2, k3, k4)                                    \
+  (KEY_MASK_BIT(k1, byte) | KEY_MASK_BIT(k2, byte) | KEY_MASK_BIT(k3, byte) |  \
+   KEY_MASK_BIT(k4, byte))
+#define KEY_MASK_4(...)                                                        \
+  {KEY_MASK_BYTE(0, __VA_ARGS__),  KEY_MASK_BYTE(1, __VA_ARGS__),              \
+   KEY_MASK_BYTE(2, __VA_ARGS__),  KEY_MASK_BYTE(3, __VA_ARGS__),              \
+   KEY_MASK_BYTE(4, __VA_ARGS__),  KEY_MASK_BYTE(5, __VA_ARGS__),              \
+   KEY_MASK_BYTE(6, __VA_ARGS__),  KEY_MASK_BYTE(7, __VA_ARGS__),              \
+   KEY_MASK_BYTE(8, __VA_ARGS__),  KEY_MASK_BYTE(9, __VA_ARGS__),              \
+   KEY_MASK_BYTE(10, __VA_ARGS__), KEY_MASK_BYTE(11, __VA_ARGS__),             \
+   KEY_MASK_BYTE(12, __VA_ARGS__), KEY_MASK_BYTE(13, __VA_ARGS__),             \
+   KEY_MASK_BYTE(14, __VA_ARGS__)}
+#define KEY_MASK_(k1, k2, k3, k4, ...) KEY_MASK_4(k1, k2, k3, k4)
+
+/* Modifier plus up to 4 keys, expanded into a keyboard_mask_t initializer */
+#define HOTKEY_MASK(mod, ...)                                                  \
+  {.report = {.modifier = (mod), .keycode = KEY_MASK_(__VA_ARGS__, 0, 0, 0)}}
+
+/* What a hotkey does, the index into hotkey_actions[] in keyboard.c. A number
+ * instead of a function pointer, so hotkeys can be stored in flash. */
+enum hotkey_action_e {
+  ACTION_TOGGLE_OUTPUT,
+  ACTION_LOCK_SCREEN,
+  ACTION_SUSPEND_ACTIVE_PC,
+  ACTION_SUSPEND_ALL_PCS,
+  ACTION_ENABLE_DEBUG,
+  ACTION_REQUEST_REBOOT,
+  ACTION_COUNT, // keep last
+};
+
 typedef struct {
-  uint8_t modifier;  // Which modifier is pressed
-  uint8_t keys[14];  // Which keys need to be pressed
-  uint8_t key_count; // How many keys are pressed
-  action_handler_t
-      action_handler; // What to execute when the key combination is detected
-  bool pass_to_os;    // True if we are to pass the key to the OS too
-  bool acknowledge;   // True if we are to notify the user about registering
-                      // keypress
+  keyboard_mask_t mask; // Modifiers and keys that all need to be pressed
+  uint8_t action;       // enum hotkey_action_e
+  bool pass_to_os;      // True if we are to pass the key to the OS too
 } hotkey_combo_t;
 
+/* Everything that can be changed without rebuilding. Kept in flash by
+ * config_store.c, the defaults come from user_config.h and hotkeys.h. */
+typedef struct {
+  uint8_t os[NUM_DEVICES];       // enum os_type_e per output
+  bool screensaver_enabled;      // Jiggle the mouse when idle
+  uint8_t hotkey_count;          // Used entries of hotkeys[]
+  uint32_t screensaver_idle_us;  // Idle this long before the jiggling starts
+  hotkey_combo_t hotkeys[MAX_HOTKEYS];
+} user_config_t;
+
+/* Feature report REPORT_ID_CONFIG (little endian). Reads go round the
+ * general page and one page per hotkey. Writes change a staged copy of the
+ * config, CONFIG_OP_COMMIT applies it on both boards. */
+#define CONFIG_VERSION 2
+enum config_op_e {
+  CONFIG_OP_GENERAL, // OS per output, screensaver and the hotkey count
+  CONFIG_OP_HOTKEY,  // Entry index of the hotkey table
+  CONFIG_OP_COMMIT,  // Check what was staged, apply, save and sync it
+  CONFIG_OP_WIPE,    // Back to the defaults, on both boards
+};
+
+typedef struct TU_ATTR_PACKED {
+  uint8_t version; // CONFIG_VERSION
+  uint8_t op;      // enum config_op_e
+  uint8_t index;   // CONFIG_OP_HOTKEY: entry of the hotkey table
+  union {
+    struct TU_ATTR_PACKED {
+      uint8_t os[NUM_DEVICES]; // enum os_type_e per output
+      uint8_t screensaver_enabled;
+      uint8_t hotkey_count;
+      uint16_t screensaver_idle_s; // CONFIG_MAX_IDLE_S at most
+    } general;
+    struct TU_ATTR_PACKED {
+      keyboard_report_t mask; // Modifiers and keys that all need to be held
+      uint8_t action;         // enum hotkey_action_e
+      uint8_t pass_to_os;
+    } hotkey;
+  };
+} config_report_t;
+
+/* The config as it goes over the link in OUTPUT_CONFIG_MSG chunks:
+ * generation, chunk index and up to CONFIG_CHUNK_LENGTH bytes of it */
+#define CONFIG_CHUNK_LENGTH (PACKET_DATA_LENGTH - 2)
+#define CONFIG_SYNC_LENGTH (sizeof(user_config_t) + CRC_LENGTH)
+#define CONFIG_SYNC_CHUNKS                                                     \
+  ((CONFIG_SYNC_LENGTH + CONFIG_CHUNK_LENGTH - 1) / CONFIG_CHUNK_LENGTH)
+
+typedef struct {
+  shared_state_t shared;         // Seqlock protected, see read_shared_state()
+  volatile uint32_t shared_seq;  // Odd while a write is in progress
+  uint8_t peer_link_version;     // Packet version the other board understands
+  const user_config_t *volatile config; // core0 swaps it, see config.c
+  uart_stats_t uart_stats;
+  hid_queue_stats_t hid_stats[ITF_NUM_TOTAL];
+  core_queue_stats_t core_queue_stats;
+  latency_hist_t latency[LATENCY_STAGE_COUNT];
+  loop_stats_t loop_stats;
+  held_keys_stats_t held_keys_stats;
+} device_t;
+
+/*********  Trace parameters  **********/
+#define TRACE_SIZE 128 // Records per core, power of two
+#define TRACE_MASK (TRACE_SIZE - 1)
+#define TRACE_FRAME_MAGIC_0 0xA5
+#define TRACE_FRAME_MAGIC_1 0x5A
+#define TRACE_FRAME_LENGTH (2 + sizeof(trace_record_t))
+#define TRACE_REPORT_RECORDS 2 // Per feature report, they are 32 bytes at most
+#define TRACE_REPORT_LENGTH (1 + TRACE_REPORT_RECORDS * sizeof(trace_record_t))
+
 /*********  Packet parameters  **********/
 
 #define START1 0xAA
 #define START2 0x55
 #define START_LENGTH 2
+#define LINK_VERSION 3
+#define DELIMITER 0x00
 
 #define TYPE_LENGTH 1
 #define INTERFACE_LENGTH 1
@@ -164,11 +512,24 @@ typedef struct {
 #define PACKET_DATA_LENGTH 16
 #define CHECKSUM_LENGTH 1
 
-#define PACKET_LENGTH                                                          \
-  (TYPE_LENGTH + INTERFACE_LENGTH + REPORT_ID_LENGTH + REPORT_LEN_LENGTH +     \
-   PACKET_DATA_LENGTH + CHECKSUM_LENGTH)
+#define HEADER_LENGTH                                                          \
+  (TYPE_LENGTH + INTERFACE_LENGTH + REPORT_ID_LENGTH + REPORT_LEN_LENGTH)
+#define PACKET_LENGTH (HEADER_LENGTH + PACKET_DATA_LENGTH + CHECKSUM_LENGTH)
 #define RAW_PACKET_LENGTH (START_LENGTH + PACKET_LENGTH)
 
+// Control messages
+#define CTRL_SEQ_FLAG 0x80
+#define CTRL_SEQ_MASK 0x7F
+#define CTRL_PENDING 4             // Unacknowledged control messages in flight
+#define CTRL_RETRANSMIT_US 5000    // Resend if there is no ACK after this long
+#define CTRL_MAX_RETRANSMITS 20
+
+// Version 2
+#define CRC_LENGTH 2
+#define COBS_DATA_LENGTH (HEADER_LENGTH + PACKET_DATA_LENGTH + CRC_LENGTH)
+#define COBS_LENGTH (COBS_DATA_LENGTH + 1) // one code byte per 254 bytes
+#define COBS_FRAME_LENGTH (COBS_LENGTH + 2) // including both delimiters
+
 /* Data structure defining packets of information transferred */
 typedef struct {
   uint8_t type;                     // Enum field describing the type of packet
@@ -183,6 +544,23 @@ typedef struct {
 // MACRO CONSTANT TYPEDEF PROTYPES
 //--------------------------------------------------------------------+
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+// config.c
+void config_apply(const user_config_t *config, bool sync);
+uint16_t config_get_report(uint8_t *buffer, uint16_t reqlen);
+void config_init(const user_config_t *config);
+void config_set_report(uint8_t const *buffer, uint16_t bufsize);
+void config_sync_ack(uint8_t generation);
+void config_sync_reset(void);
+void config_task(device_t *state);
+void handle_uart_output_config_msg(uart_packet_t *packet, device_t *state);
+void handle_uart_wipe_config_msg(uart_packet_t *packet, device_t *state);
+// config_store.c
+void config_defaults(user_config_t *config);
+bool config_load(user_config_t *config);
+void config_save(const user_config_t *config);
+void config_save_later(void);
+void config_store_task(device_t *state);
+bool config_valid(const user_config_t *config);
 // setup.c
 void core1_main(void);
 void initial_setup(device_t *state);
@@ -209,25 +587,69 @@ void handle_keyboard(uint8_t instance, uint8_t report_id, uint8_t protocol,
                      uint8_t const *report, uint8_t len);
 void handle_mouse(uint8_t instance, uint8_t report_id, uint8_t protocol,
                   uint8_t const *report, uint8_t len);
+void mouse_link_task(device_t *state);
 void handle_consumer(uint8_t instance, uint8_t report_id, uint8_t protocol,
                      uint8_t const *report, uint8_t len);
 void handle_uart_enable_debug_msg(uart_packet_t *packet, device_t *state);
 void handle_uart_generic_msg(uart_packet_t *packet, device_t *state);
+void handle_uart_link_version_msg(uart_packet_t *packet, device_t *state);
 void handle_uart_output_select_msg(uart_packet_t *packet, device_t *state);
 void handle_uart_output_get_msg(uart_packet_t *packet, device_t *state);
 void handle_uart_request_reboot_msg(uart_packet_t *packet, device_t *state);
+// hid_parser.c
+const hid_plan_t *hid_boot_plan(uint8_t itf_protocol);
+uint8_t hid_key_bit(uint16_t usage);
+uint8_t hid_translate(const hid_plan_t *plan, uint8_t const *report,
+                      uint16_t len, hid_translated_t *out);
+uint8_t parse_report_descriptor(hid_plan_t *plans, uint8_t max_plans,
+                                bool *report_ids, uint8_t const *desc,
+                                uint16_t desc_len);
 // keyboard.c
 uint8_t get_byte_offset(uint8_t key);
 uint8_t get_pos_in_byte(uint8_t key);
+const hotkey_combo_t *check_all_hotkeys(const keyboard_report_t *report);
+void held_keys_refresh_task(device_t *state);
+void held_keys_routed(uint8_t const *report, uint8_t len);
 bool process_keyboard_report(uint8_t const *report, uint8_t len);
-bool release_all_keys(void);
+void switch_held_keys(uint8_t output);
+// latency.c
+uint16_t latency_get_report(uint8_t *buffer, uint16_t reqlen);
+void latency_host_report(void);
+void latency_link_report(uint32_t received_at);
+void latency_record(enum latency_stage_e stage, uint32_t since);
+uint32_t latency_routed(void);
+// telemetry.c
+uint16_t telemetry_get_report(uint8_t *buffer, uint16_t reqlen);
+// trace.c
+void trace(enum trace_event_e event, uint16_t arg0, uint32_t arg1);
+void trace_enable_output(void);
+size_t trace_encode(uint8_t *dst, size_t size);
+int trace_format(const trace_record_t *record, char *buf, size_t size);
+uint16_t trace_get_report(uint8_t *buffer, uint16_t reqlen);
+uint32_t trace_read(trace_record_t *records, uint32_t max);
+void trace_task(void);
 // uart.c
-void uart_receive_char(uart_packet_t *packet, device_t *state);
+void handle_uart_ack_msg(uart_packet_t *packet, device_t *state);
+void uart_control_init(void);
+void uart_control_reset(void);
+void uart_irq_handler(void);
+void uart_receive_packets(uart_packet_t *packet, device_t *state);
 void uart_send_packet(enum packet_type_e packet_type, uint8_t interface,
                       uint8_t report_id, uint8_t report_len,
                       const uint8_t *data);
+void uart_send_link_version(bool reply);
 void uart_send_value(enum packet_type_e packet_type, const uint8_t value);
+void uart_retransmit_task(device_t *state);
+uint32_t uart_tx_backlog(void);
+void uart_tx_init(void);
 // usb.c
+void held_keys_task(device_t *state);
+void hid_queue_reset(void);
+void hid_queue_send_next(uint8_t interface);
+void hid_queue_task(void);
+void release_held_keys(void);
+void disconnect_pc(void);
+void request_remote_wakeup(void);
 bool send_tud_report(uint8_t interface, uint8_t report_id, uint8_t report_len,
                      uint8_t const *report);
 bool send_x_report(enum packet_type_e packet_type, uint8_t interface,
@@ -235,14 +657,25 @@ bool send_x_report(enum packet_type_e packet_type, uint8_t interface,
                    uint8_t const *report);
 // utils.c
 uint8_t calc_checksum(const uint8_t *data, int length);
+uint16_t calc_crc16(const uint8_t *data, int length);
+bool merge_mouse_report(mouse_report_t *into, const mouse_report_t *report);
 void kick_watchdog_task(device_t *state);
+void record_loop_time(uint32_t *max_us, uint64_t since);
+void shared_state_init(void);
+uint32_t shared_state_write_begin(void);
+void shared_state_write_end(uint32_t irq_state);
+shared_state_t read_shared_state(void);
+bool set_active_output(uint8_t output);
 void set_tud_connected(bool connected);
+void set_tud_disconnected(void);
+void set_reboot_requested(void);
+void set_last_activity(uint64_t time);
+void set_core1_last_loop_pass(uint64_t time);
 void remote_wakeup(void);
 bool verify_checksum(const uart_packet_t *packet);
 // stdio.h
 int printf(const char *format, ...);
 int puts(const char *s);
-// tusb_d.c
-enum { ITF_NUM_HID_KB, ITF_NUM_HID_MS, ITF_NUM_HID_CD, ITF_NUM_TOTAL };
 /*********  Global variables (don't judge)  **********/
 extern device_t global_state;
+extern const uart_handler_t uart_handler[PACKET_TYPE_COUNT];
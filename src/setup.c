@@ -22,12 +22,19 @@ void setup_uart(void) {
   gpio_set_function((uint)UART_TX_PIN, GPIO_FUNC_UART);
   gpio_set_function((uint)UART_RX_PIN, GPIO_FUNC_UART);
   uart_init(UART_ZERO, UART_ZERO_BAUD_RATE);
+  // receive into and send from ring buffers, serviced on core0
+  uart_tx_init();
+  uart_control_init();
+  irq_set_exclusive_handler(UART0_IRQ, uart_irq_handler);
+  irq_set_enabled(UART0_IRQ, true);
+  uart_set_irq_enables(UART_ZERO, true, false);
   bi_decl(bi_2pins_with_func(UART_TX_PIN, UART_RX_PIN, GPIO_FUNC_UART));
 
 #ifdef DH_DEBUG
   // init uart1 and configure stdio driver
   stdio_uart_init_full(UART_ONE, UART_ONE_BAUD_RATE, UART_ONE_TX_PIN,
                        UART_ONE_RX_PIN);
+  trace_enable_output();
   bi_decl(bi_2pins_with_func(UART_ONE_TX_PIN, UART_ONE_RX_PIN, GPIO_FUNC_UART));
 #endif
 }
@@ -51,13 +58,15 @@ void setup_tuh(void) {
   bi_decl(bi_1pin_with_name(PIO_USB_DP_PIN_DEFAULT, "USB DP"));
 }
 
+/* From flash if there is a valid config, otherwise the defaults */
 void set_user_config(device_t *state) {
   const char *os_type_str[] = {"undefined", "Linux", "macOS"};
+  user_config_t config;
 
-  state->device_config[PICO_A].os = PICO_A_OS;
-  state->device_config[PICO_B].os = PICO_B_OS;
+  config_load(&config);
+  config_init(&config);
   printf("PICO_%s OS: %s\r\n", BOARD_ROLE ? "B" : "A",
-         os_type_str[state->device_config[BOARD_ROLE].os]);
+         os_type_str[config.os[BOARD_ROLE]]);
 }
 
 void initial_setup(device_t *state) {
@@ -69,17 +78,22 @@ void initial_setup(device_t *state) {
   gpio_set_dir(GPIO_LED_PIN, GPIO_OUT);
   bi_decl(bi_1pin_with_name(GPIO_LED_PIN, "LED"));
 
+  shared_state_init();
+
   setup_uart();
 
   sleep_ms(10);
 
+  // before core1 starts, it checks the hotkeys
+  set_user_config(state);
+
   setup_tuh();
 
   multicore_reset_core1();
 
   multicore_launch_core1(core1_main);
 
-  set_user_config(state);
-
   query_active_output(state);
+
+  uart_send_link_version(false);
 }
@@ -0,0 +1,59 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+static uint16_t saturate16(uint32_t value) {
+  return value > UINT16_MAX ? UINT16_MAX : value;
+}
+
+/* A snapshot of the counters for the PC, core0 only, from
+ * tud_hid_get_report_cb(). Core1 keeps counting meanwhile, every counter is
+ * a single word, so none of them can be seen half written. */
+uint16_t telemetry_get_report(uint8_t *buffer, uint16_t reqlen) {
+  const device_t *state = &global_state;
+  const uart_stats_t *uart = &state->uart_stats;
+  telemetry_report_t report = {
+      .version = TELEMETRY_VERSION,
+      .active_output = read_shared_state().active_output,
+      .tx_packets = uart->tx_packets,
+      .rx_packets = uart->rx_packets,
+      .rx_checksum_errors = saturate16(uart->rx_checksum_errors),
+      .rx_resyncs = saturate16(uart->rx_resyncs),
+      .rx_overruns = saturate16(uart->rx_overruns),
+      .rx_rejected = saturate16(uart->rx_rejected),
+      .ctrl_failed = saturate16(uart->ctrl_failed),
+      .tx_high_water = saturate16(uart->tx_high_water),
+      .core_high_water = state->core_queue_stats.high_water,
+      .core0_loop_max_us = saturate16(state->loop_stats.core0_max_us),
+      .core1_loop_max_us = saturate16(state->loop_stats.core1_max_us),
+  };
+  uint32_t dropped = uart->tx_dropped + state->core_queue_stats.dropped;
+
+  for (int i = 0; i < ITF_NUM_TOTAL; i++) {
+    dropped += state->hid_stats[i].dropped;
+    if (state->hid_stats[i].high_water > report.hid_high_water) {
+      report.hid_high_water = state->hid_stats[i].high_water;
+    }
+  }
+  report.dropped = saturate16(dropped);
+
+  if (reqlen < sizeof(report)) {
+    return 0;
+  }
+  memcpy(buffer, &report, sizeof(report));
+  return sizeof(report);
+}
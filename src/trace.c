@@ -0,0 +1,201 @@
+/*
+ * This file is part of DeskHopL.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "main.h"
+
+/**================================================== *
+ * ================  Recording  ===================== *
+ * ================================================== */
+
+/* One ring per core, so recording needs no lock: only the owning core moves
+ * head, only core0 moves tail. Don't record from interrupt handlers, they
+ * could land in the middle of a record on the same core. */
+static struct {
+  trace_record_t records[TRACE_SIZE];
+  volatile uint32_t head;
+  uint32_t tail;
+} trace_ring[2] = {0};
+
+static bool trace_output = false;
+
+/* A handful of stores, nothing gets formatted until someone reads it */
+void __not_in_flash_func(trace)(enum trace_event_e event, uint16_t arg0,
+                                uint32_t arg1) {
+  uint core = get_core_num();
+  uint32_t head = trace_ring[core].head;
+
+  trace_ring[core].records[head & TRACE_MASK] = (trace_record_t){
+      .time_us = time_us_32(),
+      .event = event,
+      .core = core,
+      .arg0 = arg0,
+      .arg1 = arg1,
+  };
+
+  __dmb();
+  trace_ring[core].head = head + 1;
+}
+
+/**================================================== *
+ * ==================  Reading  ===================== *
+ * ================================================== */
+
+/* Core0 only. Takes up to max records not read yet, core0's first. When a
+ * core recorded faster than we read, a TRACE_LOST record says how many. */
+uint32_t trace_read(trace_record_t *records, uint32_t max) {
+  uint32_t count = 0;
+
+  for (uint core = 0; core < 2 && count < max; core++) {
+    typeof(trace_ring[0]) *ring = &trace_ring[core];
+    uint32_t head = ring->head;
+    __dmb();
+
+    if (head - ring->tail > TRACE_SIZE) {
+      uint32_t lost = head - ring->tail - TRACE_SIZE;
+      ring->tail = head - TRACE_SIZE;
+      records[count++] = (trace_record_t){
+          .time_us = time_us_32(),
+          .event = TRACE_LOST,
+          .core = core,
+          .arg0 = lost > UINT16_MAX ? UINT16_MAX : lost};
+    }
+
+    for (; ring->tail != head && count < max; ring->tail++) {
+      records[count++] = ring->records[ring->tail & TRACE_MASK];
+    }
+  }
+  return count;
+}
+
+/* Binary dump, every record behind a two byte magic. Returns bytes used. */
+size_t trace_encode(uint8_t *dst, size_t size) {
+  trace_record_t record;
+  size_t used = 0;
+
+  while (size - used >= TRACE_FRAME_LENGTH && trace_read(&record, 1)) {
+    dst[used++] = TRACE_FRAME_MAGIC_0;
+    dst[used++] = TRACE_FRAME_MAGIC_1;
+    memcpy(&dst[used], &record, sizeof(record));
+    used += sizeof(record);
+  }
+  return used;
+}
+
+/* Feature report REPORT_ID_TRACE: a record count and that many records, the
+ * rest is zero. The PC polls it to stream the trace without UART1, a count of
+ * 0 means it has caught up. Takes the records trace_task() would print. */
+uint16_t trace_get_report(uint8_t *buffer, uint16_t reqlen) {
+  trace_record_t records[TRACE_REPORT_RECORDS];
+
+  if (reqlen < TRACE_REPORT_LENGTH) {
+    return 0;
+  }
+
+  uint32_t count = trace_read(records, TRACE_REPORT_RECORDS);
+  memset(buffer, 0, TRACE_REPORT_LENGTH);
+  buffer[0] = count;
+  memcpy(&buffer[1], records, count * sizeof(trace_record_t));
+  return TRACE_REPORT_LENGTH;
+}
+
+/**================================================== *
+ * =================  Formatting  =================== *
+ * ================================================== */
+
+/* printf formats, each gets arg0 and arg1 as unsigned */
+static const char *const trace_formats[TRACE_EVENT_COUNT] = {
+    [TRACE_LOST] = "trace: %u records lost",
+    [TRACE_TUD_CONNECTED] = "tud connected: %u",
+    [TRACE_TUD_NOT_READY] = "x[report] tud not ready, interface %u",
+    [TRACE_BAD_REPORT_LEN] = "x[report] bad length %u, stop flooding on "
+                             "disconnects?",
+    [TRACE_CHECKSUM_ERROR] = "uart: checksum failed, type %u, version %u",
+    [TRACE_RX_REJECTED] = "uart: rejected type %u, length %u",
+    [TRACE_DEVICE_MOUNT] = "d[mount]",
+    [TRACE_DEVICE_UMOUNT] = "d[umount]",
+    [TRACE_DEVICE_SUSPEND] = "d[suspend] wakeup: %u",
+    [TRACE_DEVICE_RESUME] = "d[resume]",
+    [TRACE_GET_REPORT] = "d[get_report] instance: %u, report_id: %u",
+    [TRACE_SET_REPORT] = "d[set_report] instance: %u, type/buf: %#06x",
+    [TRACE_HOST_MOUNT] = "h[mount] dev_addr/instance: %#06x, len: %u",
+    [TRACE_HOST_REPORT_INFO] = "h[mount] report_id/route: %#06x, "
+                               "fields/passthrough: %#06x",
+    [TRACE_HOST_UMOUNT] = "h[umount] dev_addr/instance: %#06x",
+    [TRACE_HOST_EMPTY_REPORT] = "h[report] dev_addr/instance: %#06x, empty",
+    [TRACE_HOST_RECEIVE_FAIL] = "h[report] dev_addr/instance: %#06x, can't "
+                                "request the next report",
+    [TRACE_CONFIG_SET] = "config: op %u, index %u",
+    [TRACE_HOST_UNROUTED] = "h[report] dev_addr/instance: %#06x, "
+                            "report_id/len: %#08x, not passed on",
+    [TRACE_CONFIG_LOAD] = "config: slot %u of the flash store, sequence %u "
+                          "(slot 65535: defaults)",
+    [TRACE_CONFIG_SAVE] = "config: saved to slot %u, took %u us",
+    [TRACE_CONFIG_APPLIED] = "config: applied, sync %u, %u hotkeys",
+    [TRACE_CONFIG_SYNC] = "config: generation %u, done after %u retries "
+                          "(CONFIG_SYNC_ROUNDS: gave up)",
+    [TRACE_KEYS_RELEASED] = "x[report] released report_id %u, timed out %u",
+    [TRACE_HOST_PLANS_FULL] = "h[mount] dev_addr/instance: %#06x, %u reports "
+                              "not passed on, no room",
+};
+
+int trace_format(const trace_record_t *record, char *buf, size_t size) {
+  int len = snprintf(buf, size, "%10u us core%u ", (unsigned)record->time_us,
+                     (unsigned)record->core);
+  if (len < 0 || (size_t)len >= size) {
+    return len;
+  }
+
+  if (record->event >= TRACE_EVENT_COUNT || !trace_formats[record->event]) {
+    return len + snprintf(&buf[len], size - len, "event %u: %u %u",
+                          (unsigned)record->event, (unsigned)record->arg0,
+                          (unsigned)record->arg1);
+  }
+
+  return len + snprintf(&buf[len], size - len, trace_formats[record->event],
+                        (unsigned)record->arg0, (unsigned)record->arg1);
+}
+
+/**================================================== *
+ * ==================  Output  ====================== *
+ * ================================================== */
+
+/* Once UART1 is set up for debugging, the core0 tick drains the trace to it */
+void trace_enable_output(void) {
+  trace_output = true;
+}
+
+void trace_task(void) {
+  if (!trace_output) {
+    return;
+  }
+
+#ifdef DH_TRACE_BINARY
+  uint8_t frames[8 * TRACE_FRAME_LENGTH];
+  size_t len;
+
+  while ((len = trace_encode(frames, sizeof(frames))) > 0) {
+    uart_write_blocking(UART_ONE, frames, len);
+  }
+#else
+  trace_record_t record;
+  char line[96];
+
+  while (trace_read(&record, 1)) {
+    trace_format(&record, line, sizeof(line));
+    printf("%s\r\n", line);
+  }
+#endif
+}
@@ -123,7 +123,7 @@ extern "C" {
 // Size of buffer to hold descriptors and other data used for enumeration
 #define CFG_TUH_ENUMERATION_BUFSIZE 256
 
-#define CFG_TUH_HUB 0                            // number of supported hubs
+#define CFG_TUH_HUB 1                            // number of supported hubs
 #define CFG_TUH_DEVICE_MAX (3 * CFG_TUH_HUB + 1) // 1 hub typically has 4 ports
 #define CFG_TUH_CDC 0                            // CDC ACM
 #define CFG_TUH_CDC_FTDI 0                       // FTDI Serial.
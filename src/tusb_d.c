@@ -19,13 +19,13 @@
 
 // Invoked when device is mounted
 void tud_mount_cb(void) {
-  printf("d[mount]\n");
+  trace(TRACE_DEVICE_MOUNT, 0, 0);
   set_tud_connected(true);
 }
 
 // Invoked when device is unmounted
 void tud_umount_cb(void) {
-  printf("d[umount]\n");
+  trace(TRACE_DEVICE_UMOUNT, 0, 0);
   set_tud_connected(false);
 }
 
@@ -33,15 +33,14 @@ void tud_umount_cb(void) {
 // remote_wakeup_en : if host allow us to perform remote wakeup
 // Within 7ms, device must draw an average of current less than 2.5 mA from bus
 void tud_suspend_cb(bool remote_wakeup_en) {
-  // (void)remote_wakeup_en;
-  printf("d[suspend] wakeup: %s\n", remote_wakeup_en ? "true" : "false");
+  trace(TRACE_DEVICE_SUSPEND, remote_wakeup_en, 0);
   set_tud_connected(false);
 }
 
 // Invoked when usb bus is resumed
 void tud_resume_cb(void) {
-  printf("d[resume]\n");
-  // if (global_state.device_config[BOARD_ROLE].os == MACOS) {
+  trace(TRACE_DEVICE_RESUME, 0, 0);
+  // if (global_state.config->os[BOARD_ROLE] == MACOS) {
   //   tud_deinit(BOARD_TUD_RHPORT);
   //   tud_init(BOARD_TUD_RHPORT);
   // }
@@ -56,6 +55,7 @@ void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report,
   // printf("d[report-complete] instance: %d\r\n", instance);
   (void)report;
   (void)len;
+  hid_queue_send_next(instance);
 }
 
 // Invoked when received GET_REPORT control request
@@ -64,13 +64,22 @@ void tud_hid_report_complete_cb(uint8_t instance, uint8_t const *report,
 uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id,
                                hid_report_type_t report_type, uint8_t *buffer,
                                uint16_t reqlen) {
-  // TODO not Implemented
-  printf("d[2] instance: %d\r\n", instance);
-  (void)report_id;
-  (void)report_type;
-  (void)buffer;
-  (void)reqlen;
+  // only our vendor feature reports, the rest is TODO. They are polled, so
+  // they don't go into the trace.
+  if (instance == ITF_NUM_HID_CD && report_type == HID_REPORT_TYPE_FEATURE) {
+    switch (report_id) {
+    case REPORT_ID_LATENCY:
+      return latency_get_report(buffer, reqlen);
+    case REPORT_ID_TELEMETRY:
+      return telemetry_get_report(buffer, reqlen);
+    case REPORT_ID_TRACE:
+      return trace_get_report(buffer, reqlen);
+    case REPORT_ID_CONFIG:
+      return config_get_report(buffer, reqlen);
+    }
+  }
 
+  trace(TRACE_GET_REPORT, instance, report_id);
   return 0;
 }
 
@@ -79,10 +88,13 @@ uint16_t tud_hid_get_report_cb(uint8_t instance, uint8_t report_id,
 void tud_hid_set_report_cb(uint8_t instance, uint8_t report_id,
                            hid_report_type_t report_type, uint8_t const *buffer,
                            uint16_t bufsize) {
-  (void)report_id;
-  (void)bufsize;
+  trace(TRACE_SET_REPORT, instance,
+        report_type << 8 | (bufsize ? buffer[0] : 0));
+
+  if (instance == ITF_NUM_HID_CD && report_type == HID_REPORT_TYPE_FEATURE &&
+      report_id == REPORT_ID_CONFIG) {
+    config_set_report(buffer, bufsize);
+  }
   // mostly we get type out reports from host to update keyboard leds.
   // we ignore these reports for now.
-  printf("d[set_report] idx: %x, type: %x, buf: %x\r\n", instance, report_type,
-         buffer[0]);
 }
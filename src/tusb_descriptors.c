@@ -106,11 +106,11 @@ uint8_t const desc_configuration[] = {
     // address, size & polling interval
     TUD_HID_DESCRIPTOR(ITF_NUM_HID_KB, 0, HID_ITF_PROTOCOL_KEYBOARD,
                        sizeof(desc_hid_report_kb), EPNUM_HID_KB,
-                       CFG_TUD_HID_EP_BUFSIZE, 5),
+                       CFG_TUD_HID_EP_BUFSIZE, HID_POLL_INTERVAL_MS),
 
     TUD_HID_DESCRIPTOR(ITF_NUM_HID_MS, 0, HID_ITF_PROTOCOL_MOUSE,
                        sizeof(desc_hid_report_ms), EPNUM_HID_MS,
-                       CFG_TUD_HID_EP_BUFSIZE, 5),
+                       CFG_TUD_HID_EP_BUFSIZE, HID_POLL_INTERVAL_MS),
 
     TUD_HID_DESCRIPTOR(ITF_NUM_HID_CD, 0, HID_ITF_PROTOCOL_NONE,
                        sizeof(desc_hid_report_cd), EPNUM_HID_CD,
@@ -33,6 +33,20 @@ enum {
   REPORT_ID_COUNT
 };
 
+/* How often the PC polls the keyboard and mouse endpoints, in ms. A report
+ * per interface per poll, the rest waits or gets merged in the HID queue. */
+#ifdef DH_HIGH_RATE
+#define HID_POLL_INTERVAL_MS 1
+#else
+#define HID_POLL_INTERVAL_MS 5
+#endif
+
+/* Vendor page feature reports on the consumer control interface */
+#define REPORT_ID_LATENCY 0x12   // Latency histogram pages, see latency.c
+#define REPORT_ID_TELEMETRY 0x13 // Link and queue counters, see telemetry.c
+#define REPORT_ID_TRACE 0x14     // Trace records, see trace.c
+#define REPORT_ID_CONFIG 0x15    // Read and write the config, see config.c
+
 #define TUD_HID_REPORT_DESC_LOGI_KB(...)                                       \
   0x05, 0x01, 0x09, 0x06, 0xA1, 0x01, __VA_ARGS__ 0x05, 0x07, 0x19, 0xE0,      \
       0x29, 0xE7, 0x15, 0x00, 0x25, 0x01, 0x75, 0x01, 0x95, 0x08, 0x81, 0x02,  \
@@ -63,6 +77,16 @@ enum {
       0x08, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x09, 0x01, 0x81, 0x00, 0x09, 0x01,  \
       0x91, 0x00, 0xC0, 0x06, 0x00, 0xFF, 0x09, 0x02, 0xA1, 0x01, 0x85, 0x11,  \
       0x95, 0x13, 0x75, 0x08, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x09, 0x02, 0x81,  \
-      0x00, 0x09, 0x02, 0x91, 0x00, 0xC0
+      0x00, 0x09, 0x02, 0x91, 0x00, 0xC0, 0x06, 0x00, 0xFF, 0x09, 0x03, 0xA1,  \
+      0x01, 0x85, REPORT_ID_LATENCY, 0x95, LATENCY_PAGE_LENGTH, 0x75, 0x08,    \
+      0x15, 0x00, 0x26, 0xFF, 0x00, 0x09, 0x03, 0xB1, 0x02, 0xC0, 0x06, 0x00,  \
+      0xFF, 0x09, 0x04, 0xA1, 0x01, 0x85, REPORT_ID_TELEMETRY, 0x95,           \
+      sizeof(telemetry_report_t), 0x75, 0x08, 0x15, 0x00, 0x26, 0xFF, 0x00,    \
+      0x09, 0x04, 0xB1, 0x02, 0xC0, 0x06, 0x00, 0xFF, 0x09, 0x05, 0xA1, 0x01,  \
+      0x85, REPORT_ID_TRACE, 0x95, TRACE_REPORT_LENGTH, 0x75, 0x08, 0x15,      \
+      0x00, 0x26, 0xFF, 0x00, 0x09, 0x05, 0xB1, 0x02, 0xC0, 0x06, 0x00, 0xFF,  \
+      0x09, 0x06, 0xA1, 0x01, 0x85, REPORT_ID_CONFIG, 0x95,                    \
+      sizeof(config_report_t), 0x75, 0x08, 0x15, 0x00, 0x26, 0xFF, 0x00, 0x09, \
+      0x06, 0xB1, 0x02, 0xC0
 
 #endif /* USB_DESCRIPTORS_H_ */
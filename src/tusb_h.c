@@ -17,112 +17,180 @@
 
 #include "main.h"
 
-#define MAX_REPORT 4
-
-// Each HID instance can have multiple reports
-static struct {
-  uint8_t report_count;
-  tuh_hid_report_info_t report_info[MAX_REPORT];
-} hid_info[CFG_TUH_HID];
+#define MAX_HID_INSTANCE 4 // HID interfaces per device we keep track of
+#define MAX_REPORT 32      // Reports we pass on, of all devices together
+
+typedef void (*report_handler_t)(uint8_t instance, uint8_t report_id,
+                                 uint8_t protocol, uint8_t const *report,
+                                 uint8_t len);
+
+typedef struct {
+  report_handler_t handler;
+  uint8_t itf;       // our interface it goes out on
+  uint8_t report_id; // and the ID of ours it goes out with
+  uint8_t min_len;   // shorter reports would be read past their end
+} hid_route_t;
+
+// The usage decides which of our interfaces it goes out on, behind a hub
+// every device has its own instance 0. The device's own report ID means
+// nothing to the PC, it only knows ours.
+static const hid_route_t routes[ROUTE_COUNT] = {
+    [ROUTE_NONE] = {NULL, 0, 0, 0},
+    [ROUTE_KEYBOARD] = {handle_keyboard, ITF_NUM_HID_KB, REPORT_ID_KEYBOARD,
+                        sizeof(keyboard_report_t)},
+    [ROUTE_MOUSE] = {handle_mouse, ITF_NUM_HID_MS, REPORT_ID_MOUSE, 1},
+    [ROUTE_CONSUMER] = {handle_consumer, ITF_NUM_HID_MS,
+                        REPORT_ID_CONSUMER_CONTROL, sizeof(consumer_report_t)},
+};
+
+// Built from the report descriptor at mount, so a report only needs a table
+// lookup by its ID. TinyUSB numbers the HID interfaces of every device from
+// 0, so the address is part of the key.
+typedef struct {
+  bool report_ids;                 // reports start with their ID
+  const hid_plan_t *boot_plan;     // boot protocol has no IDs
+  uint8_t first_plan;              // its plans in hid_plans[]
+  uint8_t plan_count;
+  uint8_t plan_for[UINT8_MAX + 1]; // report ID -> 1 + index from first_plan
+} hid_info_t;
+
+static hid_info_t hid_info[CFG_TUH_DEVICE_MAX][MAX_HID_INSTANCE];
+
+// Shared, so a receiver with many reports still fits next to a keyboard that
+// has only one. Kept packed in mount order.
+static hid_plan_t hid_plans[MAX_REPORT];
+static uint8_t hid_plan_count;
+
+// NULL if we don't keep track of this one
+static hid_info_t *get_hid_info(uint8_t dev_addr, uint8_t instance) {
+  if (!dev_addr || dev_addr > CFG_TUH_DEVICE_MAX ||
+      instance >= MAX_HID_INSTANCE) {
+    return NULL;
+  }
+  return &hid_info[dev_addr - 1][instance];
+}
 
 void tuh_hid_report_received_cb(uint8_t dev_addr, uint8_t instance,
                                 uint8_t const *report, uint16_t len) {
+  latency_host_report();
+
   if (!len) {
-    printf("skipping empty report\r\n");
+    trace(TRACE_HOST_EMPTY_REPORT, dev_addr << 8 | instance, 0);
     tuh_hid_receive_report(dev_addr, instance);
     return;
   }
 
-  // lets dertermine protocol mode first
-  uint8_t protocol = tuh_hid_get_protocol(dev_addr, instance);
-  // printf("h[report] dev_addr: %d instance: %d protocol: %d\r\n", dev_addr,
-  //        instance, protocol);
+  hid_info_t *info = get_hid_info(dev_addr, instance);
+  if (!info) {
+    return;
+  }
 
-  uint8_t report_id = 0, usage = 0;
-  uint16_t usage_page = 0;
+  uint8_t protocol = tuh_hid_get_protocol(dev_addr, instance);
+  uint8_t report_id = 0;
+  const hid_plan_t *plan = info->boot_plan;
 
   if (protocol == HID_PROTOCOL_REPORT) {
-    // do we have more then one report
-    if (hid_info[instance].report_count > 1) {
-      // we should have a report_id for this, right?
+    if (info->report_ids) {
       report_id = report[0];
       report++;
       len--;
     }
-    // dertermine usage_page/usage from parsed reports
-    for (uint8_t i = 0; i < hid_info[instance].report_count; i++) {
-      if (report_id == hid_info[instance].report_info[i].report_id) {
-        usage_page = hid_info[instance].report_info[i].usage_page;
-        usage = hid_info[instance].report_info[i].usage;
-        break;
-      }
+    uint8_t index = info->plan_for[report_id];
+    plan = index ? &hid_plans[info->first_plan + index - 1] : NULL;
+  }
+
+  // Devices laid out differently get their report translated into ours
+  hid_translated_t translated;
+  if (plan && !plan->passthrough) {
+    if (len >= plan->min_len) {
+      len = hid_translate(plan, report, len, &translated);
+      report = translated.bytes;
+    } else {
+      plan = NULL;
     }
-  } else { // HID_PROTOCOL_BOOT
-    usage_page = hid_info[instance].report_info[0].usage_page;
-    usage = hid_info[instance].report_info[0].usage;
   }
 
-  // printf("report_id: %d, usage_page: %#06x, usage: %#04x, len: %d\r\n",
-  //        report_id, usage_page, usage, len);
+  const hid_route_t *to = &routes[plan ? plan->route : ROUTE_NONE];
+  if (to->handler && len >= to->min_len) {
+    to->handler(to->itf, to->report_id, protocol, report, len);
+  } else {
+    trace(TRACE_HOST_UNROUTED, dev_addr << 8 | instance, report_id << 16 | len);
+  }
+  tuh_hid_receive_report(dev_addr, instance);
+}
 
-  // for (uint8_t i = 0; i < len; i++) {
-  //   printf("%02x ", report[i]);
-  // }
-  // printf("\r\n");
+// Give its plans back, the ones mounted after it move down
+static void release_plans(hid_info_t *info) {
+  uint8_t first = info->first_plan, count = info->plan_count;
+  if (!count) {
+    return;
+  }
 
-  if (usage_page == HID_USAGE_PAGE_DESKTOP) {
-    if (usage == HID_USAGE_DESKTOP_KEYBOARD) {
-      handle_keyboard(instance, report_id, protocol, report, len);
-    } else if (usage == HID_USAGE_DESKTOP_MOUSE) {
-      handle_mouse(instance, report_id, protocol, report, len);
-    }
-  } else if (usage_page == HID_USAGE_PAGE_CONSUMER) {
-    if (usage == HID_USAGE_CONSUMER_CONTROL) {
-      handle_consumer(instance, report_id, protocol, report, len);
+  memmove(&hid_plans[first], &hid_plans[first + count],
+          (hid_plan_count - first - count) * sizeof(hid_plan_t));
+  hid_plan_count -= count;
+
+  hid_info_t *other = &hid_info[0][0];
+  for (int i = 0; i < CFG_TUH_DEVICE_MAX * MAX_HID_INSTANCE; i++, other++) {
+    if (other->plan_count && other->first_plan > first) {
+      other->first_plan -= count;
     }
-  } else if (usage_page == HID_USAGE_PAGE_VENDOR) {
-    // usage 0x01 Vendor
-    // usage 0x02 Vendor
   }
-  tuh_hid_receive_report(dev_addr, instance);
+  info->plan_count = 0;
 }
 
 void tuh_hid_umount_cb(uint8_t dev_addr, uint8_t instance) {
-  printf("h[umount] dev_addr: %d, instance: %d\r\n", dev_addr, instance);
+  trace(TRACE_HOST_UMOUNT, dev_addr << 8 | instance, 0);
+
+  hid_info_t *info = get_hid_info(dev_addr, instance);
+  if (info) {
+    release_plans(info);
+    memset(info, 0, sizeof(*info));
+  }
   // https://github.com/hrvach/deskhop/issues/36
-  global_state.reboot_requested = true;
+  set_reboot_requested();
 }
 
 void tuh_hid_mount_cb(uint8_t dev_addr, uint8_t instance,
                       uint8_t const *desc_report, uint16_t desc_len) {
-  printf("h[mount] dev_addr: %d, instance: %d, len: %d\r\n", dev_addr, instance,
-         desc_len);
+  trace(TRACE_HOST_MOUNT, dev_addr << 8 | instance, desc_len);
 
-  // Interface protocol (hid_interface_protocol_enum_t)
-  const char *protocol_str[] = {"None", "Keyboard", "Mouse"};
-  uint8_t const itf_protocol = tuh_hid_interface_protocol(dev_addr, instance);
+  // By default host stack will use activate boot protocol on supported
+  // interface, those reports have a fixed layout
+  hid_info_t *info = get_hid_info(dev_addr, instance);
+  if (!info) {
+    return;
+  }
 
-  printf("HID Interface Protocol = %s\r\n", protocol_str[itf_protocol]);
+  release_plans(info);
+  memset(info, 0, sizeof(*info));
+  info->boot_plan =
+      hid_boot_plan(tuh_hid_interface_protocol(dev_addr, instance));
 
-  // By default host stack will use activate boot protocol on supported
-  // interface. Therefore for this simple example, we only need to parse generic
-  // report descriptor (with built-in parser)
-  hid_info[instance].report_count = tuh_hid_parse_report_descriptor(
-      hid_info[instance].report_info, MAX_REPORT, desc_report, desc_len);
-  printf("HID has %u reports \r\n", hid_info[instance].report_count);
-
-  if (hid_info[instance].report_count > 1) {
-    for (uint8_t i = 0; i < hid_info[instance].report_count; i++) {
-      printf("report: %d, usage: %#04x, usage_page: %#06x\r\n",
-             hid_info[instance].report_info[i].report_id,
-             hid_info[instance].report_info[i].usage,
-             hid_info[instance].report_info[i].usage_page);
-    }
+  static hid_plan_t parsed[MAX_REPORT]; // only needed while mounting
+  uint8_t count = parse_report_descriptor(parsed, MAX_REPORT, &info->report_ids,
+                                          desc_report, desc_len);
+
+  uint8_t room = MAX_REPORT - hid_plan_count;
+  if (count > room) {
+    trace(TRACE_HOST_PLANS_FULL, dev_addr << 8 | instance, count - room);
+    count = room;
+  }
+  info->first_plan = hid_plan_count;
+  info->plan_count = count;
+  memcpy(&hid_plans[hid_plan_count], parsed, count * sizeof(hid_plan_t));
+  hid_plan_count += count;
+
+  for (uint8_t i = 0; i < count; i++) {
+    hid_plan_t *plan = &hid_plans[info->first_plan + i];
+    trace(TRACE_HOST_REPORT_INFO, plan->report_id << 8 | plan->route,
+          plan->field_count << 8 | plan->passthrough);
+    info->plan_for[plan->report_id] = i + 1;
   }
 
   // request to receive report
   // tuh_hid_report_received_cb() will be invoked when report is available
   if (!tuh_hid_receive_report(dev_addr, instance)) {
-    printf("Error: cannot request to receive report\r\n");
+    trace(TRACE_HOST_RECEIVE_FAIL, dev_addr << 8 | instance, 0);
   }
 }
@@ -21,9 +21,146 @@
  * ===============  Sending Packets  ================ *
  * ================================================== */
 
+/* Outgoing packets are queued here and drained by the TX interrupt, nobody
+ * waits for the wire anymore. Both cores send, so producers and the ISR take
+ * the spin lock. If a packet doesn't fit, it is dropped as a whole. */
+#define UART_TX_BUFFER_SIZE 512
+#define UART_TX_BUFFER_MASK (UART_TX_BUFFER_SIZE - 1)
+
+/* Where the queued packets end and when they were queued, for
+ * LATENCY_LINK_TX. With more packets waiting, the rest go unmeasured. */
+#define UART_TX_MARKS 16
+#define UART_TX_MARKS_MASK (UART_TX_MARKS - 1)
+
+static struct {
+  uint8_t data[UART_TX_BUFFER_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  struct {
+    uint32_t end;
+    uint32_t queued_at;
+  } marks[UART_TX_MARKS];
+  uint32_t mark_head;
+  uint32_t mark_tail;
+  spin_lock_t *lock;
+} uart_tx = {0};
+
+void uart_tx_init(void) {
+  uart_tx.lock = spin_lock_init(spin_lock_claim_unused(true));
+}
+
+/* Bytes still waiting for the wire, a hint only, so no lock */
+uint32_t uart_tx_backlog(void) { return uart_tx.head - uart_tx.tail; }
+
+/* Top up the hardware FIFO, keep the TX interrupt only while there is more.
+ * Must be called with the lock held. */
+static void __not_in_flash_func(uart_tx_fill_fifo)(void) {
+  while (uart_tx.tail != uart_tx.head && uart_is_writable(UART_ZERO)) {
+    uart_putc_raw(UART_ZERO, uart_tx.data[uart_tx.tail++ & UART_TX_BUFFER_MASK]);
+  }
+
+  /* Packets that made it into the hardware FIFO completely */
+  while (uart_tx.mark_tail != uart_tx.mark_head) {
+    typeof(uart_tx.marks[0]) *mark =
+        &uart_tx.marks[uart_tx.mark_tail & UART_TX_MARKS_MASK];
+    if ((int32_t)(uart_tx.tail - mark->end) < 0) {
+      break;
+    }
+    latency_record(LATENCY_LINK_TX, mark->queued_at);
+    uart_tx.mark_tail++;
+  }
+  uart_set_irq_enables(UART_ZERO, true, uart_tx.tail != uart_tx.head);
+}
+
+static bool uart_tx_enqueue(const uint8_t *src, uint32_t len) {
+  uart_stats_t *stats = &global_state.uart_stats;
+  uint32_t irq_state = spin_lock_blocking(uart_tx.lock);
+
+  uint32_t used = uart_tx.head - uart_tx.tail;
+
+  /* A leading delimiter is redundant right after the previous trailing one */
+  if (len && src[0] == DELIMITER && used &&
+      uart_tx.data[(uart_tx.head - 1) & UART_TX_BUFFER_MASK] == DELIMITER) {
+    src++;
+    len--;
+  }
+
+  bool fits = used + len <= UART_TX_BUFFER_SIZE;
+
+  if (fits) {
+    for (uint32_t i = 0; i < len; i++) {
+      uart_tx.data[uart_tx.head++ & UART_TX_BUFFER_MASK] = src[i];
+    }
+    used += len;
+    if (uart_tx.mark_head - uart_tx.mark_tail < UART_TX_MARKS) {
+      uint32_t mark = uart_tx.mark_head++ & UART_TX_MARKS_MASK;
+      uart_tx.marks[mark].end = uart_tx.head;
+      uart_tx.marks[mark].queued_at = time_us_32();
+    }
+    if (used > stats->tx_high_water) {
+      stats->tx_high_water = used;
+    }
+    stats->tx_packets++;
+  } else {
+    stats->tx_dropped++;
+  }
+
+  uart_tx_fill_fifo();
+  spin_unlock(uart_tx.lock, irq_state);
+  return fits;
+}
+
+/* COBS: every zero is replaced by the distance to the next one, so the
+ * encoded data never contains the delimiter */
+static uint32_t cobs_encode(const uint8_t *src, uint32_t len, uint8_t *dst) {
+  uint32_t code_index = 0, out = 1;
+  uint8_t code = 1;
+
+  for (uint32_t i = 0; i < len; i++) {
+    if (src[i]) {
+      dst[out++] = src[i];
+      code++;
+    }
+    if (!src[i] || code == 0xFF) {
+      dst[code_index] = code;
+      code = 1;
+      code_index = out++;
+    }
+  }
+  dst[code_index] = code;
+
+  return out;
+}
+
+static void uart_send_packet_v2(enum packet_type_e packet_type,
+                                uint8_t interface, uint8_t report_id,
+                                uint8_t report_len, const uint8_t *data) {
+  uint8_t packet[COBS_DATA_LENGTH] = {packet_type, interface, report_id,
+                                      report_len};
+  uint8_t frame[COBS_FRAME_LENGTH] = {DELIMITER};
+  uint32_t length = HEADER_LENGTH + report_len;
+
+  if (report_len > 0)
+    memcpy(&packet[HEADER_LENGTH], data, report_len);
+
+  uint16_t crc = calc_crc16(packet, length);
+  packet[length++] = crc >> 8;
+  packet[length++] = crc & 0xFF;
+
+  length = 1 + cobs_encode(packet, length, &frame[1]);
+  frame[length++] = DELIMITER;
+
+  uart_tx_enqueue(frame, length);
+}
+
 void uart_send_packet(enum packet_type_e packet_type, uint8_t interface,
                       uint8_t report_id, uint8_t report_len,
                       const uint8_t *data) {
+  if (global_state.peer_link_version >= 2 && packet_type != LINK_VERSION_MSG) {
+    uart_send_packet_v2(packet_type, interface, report_id, report_len, data);
+    return;
+  }
+
   uint8_t raw_packet[RAW_PACKET_LENGTH] = {[0] = START1,
                                            [1] = START2,
                                            [2] = packet_type,
@@ -35,116 +172,493 @@ void uart_send_packet(enum packet_type_e packet_type, uint8_t interface,
                                                calc_checksum(data, report_len)};
 
   if (report_len > 0)
-    memcpy(&raw_packet[START_LENGTH + TYPE_LENGTH + INTERFACE_LENGTH +
-                       REPORT_ID_LENGTH + REPORT_LEN_LENGTH],
-           data, report_len);
+    memcpy(&raw_packet[START_LENGTH + HEADER_LENGTH], data, report_len);
+
+  uart_tx_enqueue(raw_packet, RAW_PACKET_LENGTH);
+}
 
-  /* Packets are short, fixed length, high speed and there is no flow control to
-   * block this */
-  uart_write_blocking(UART_ZERO, raw_packet, RAW_PACKET_LENGTH);
+/* Tell the other board which packet version we understand */
+void uart_send_link_version(bool reply) {
+  const uint8_t data[2] = {LINK_VERSION, reply};
+  uart_send_packet(LINK_VERSION_MSG, 0, 0, sizeof(data), data);
+}
+
+/**================================================== *
+ * ==============  Control Messages  ================ *
+ * ================================================== */
+
+/* A lost control message leaves the boards disagreeing (e.g. about the active
+ * output), so these are kept until the other board ACKs them and sent again
+ * otherwise. HID reports never wait for anything. */
+typedef struct {
+  bool used;
+  uint8_t type;
+  uint8_t seq;
+  uint8_t value;
+  uint8_t retransmits;
+  uint64_t sent_at;
+} ctrl_pending_t;
+
+static struct {
+  ctrl_pending_t pending[CTRL_PENDING];
+  uint8_t in_flight;
+  uint8_t next_seq;
+  spin_lock_t *lock;
+  /* Receive side, only touched by core1 */
+  bool seen[CTRL_SEQ_MASK + 1];
+  uint8_t last_seen;
+} uart_ctrl = {0};
+
+void uart_control_init(void) {
+  uart_ctrl.lock = spin_lock_init(spin_lock_claim_unused(true));
+}
+
+static bool is_control_msg(uint8_t packet_type) {
+  return packet_type < PACKET_TYPE_COUNT &&
+         uart_handler[packet_type].msg_class == MSG_CLASS_CONTROL;
+}
+
+static void uart_send_control(enum packet_type_e packet_type, uint8_t value) {
+  uart_stats_t *stats = &global_state.uart_stats;
+  uint32_t irq_state = spin_lock_blocking(uart_ctrl.lock);
+  ctrl_pending_t *slot = NULL;
+
+  /* A newer message of the same type makes the pending one pointless */
+  for (int i = 0; i < CTRL_PENDING; i++) {
+    ctrl_pending_t *p = &uart_ctrl.pending[i];
+    if (p->used && p->type == packet_type) {
+      slot = p;
+      break;
+    }
+    if (!p->used && !slot) {
+      slot = p;
+    }
+  }
+
+  /* All slots busy, give up on the oldest one */
+  if (!slot) {
+    slot = &uart_ctrl.pending[0];
+    for (int i = 1; i < CTRL_PENDING; i++) {
+      if (uart_ctrl.pending[i].sent_at < slot->sent_at) {
+        slot = &uart_ctrl.pending[i];
+      }
+    }
+    stats->ctrl_failed++;
+  }
+
+  if (!slot->used) {
+    uart_ctrl.in_flight++;
+  }
+
+  *slot = (ctrl_pending_t){
+      .used = true,
+      .type = packet_type,
+      .seq = CTRL_SEQ_FLAG | (uart_ctrl.next_seq++ & CTRL_SEQ_MASK),
+      .value = value,
+      .sent_at = time_us_64(),
+  };
+  uint8_t seq = slot->seq;
+  spin_unlock(uart_ctrl.lock, irq_state);
+
+  uart_send_packet(packet_type, 0, seq, sizeof(value), &value);
 }
 
 void uart_send_value(enum packet_type_e packet_type, const uint8_t value) {
   const uint8_t data = value;
+
+  /* Older boards would neither ACK nor drop duplicates */
+  if (is_control_msg(packet_type) && global_state.peer_link_version >= 2) {
+    uart_send_control(packet_type, value);
+    return;
+  }
+
   uart_send_packet(packet_type, 0, 0, sizeof(uint8_t), &data);
 }
 
+void handle_uart_ack_msg(uart_packet_t *packet, device_t *state) {
+  (void)state;
+
+  /* Without the flag, it's for a whole config, see config.c */
+  if (!(packet->report_id & CTRL_SEQ_FLAG)) {
+    config_sync_ack(packet->report_id);
+    return;
+  }
+
+  uint32_t irq_state = spin_lock_blocking(uart_ctrl.lock);
+
+  for (int i = 0; i < CTRL_PENDING; i++) {
+    ctrl_pending_t *p = &uart_ctrl.pending[i];
+    if (p->used && p->seq == packet->report_id) {
+      p->used = false;
+      uart_ctrl.in_flight--;
+    }
+  }
+
+  spin_unlock(uart_ctrl.lock, irq_state);
+}
+
+/* Resend whatever wasn't ACKed in time, called from the core1 loop */
+void uart_retransmit_task(device_t *state) {
+  ctrl_pending_t resend[CTRL_PENDING];
+  int count = 0;
+
+  if (!uart_ctrl.in_flight) {
+    return;
+  }
+
+  uint64_t now = time_us_64();
+  uint32_t irq_state = spin_lock_blocking(uart_ctrl.lock);
+
+  for (int i = 0; i < CTRL_PENDING; i++) {
+    ctrl_pending_t *p = &uart_ctrl.pending[i];
+    if (!p->used || now - p->sent_at < CTRL_RETRANSMIT_US) {
+      continue;
+    }
+    if (p->retransmits == CTRL_MAX_RETRANSMITS) {
+      p->used = false;
+      uart_ctrl.in_flight--;
+      state->uart_stats.ctrl_failed++;
+      continue;
+    }
+    p->retransmits++;
+    p->sent_at = now;
+    state->uart_stats.ctrl_retransmits++;
+    resend[count++] = *p;
+  }
+
+  spin_unlock(uart_ctrl.lock, irq_state);
+
+  for (int i = 0; i < count; i++) {
+    uart_send_packet(resend[i].type, 0, resend[i].seq, sizeof(uint8_t),
+                     &resend[i].value);
+  }
+}
+
+/* The other board rebooted and starts counting from scratch */
+void uart_control_reset(void) {
+  memset(uart_ctrl.seen, 0, sizeof(uart_ctrl.seen));
+  uart_ctrl.last_seen = 0;
+}
+
+/* Remembers sequence numbers up to half the sequence space back */
+static bool uart_control_first_seen(uint8_t seq) {
+  const uint8_t window = (CTRL_SEQ_MASK + 1) / 2;
+  uint8_t ahead = (seq - uart_ctrl.last_seen) & CTRL_SEQ_MASK;
+
+  if (ahead < window) {
+    while (uart_ctrl.last_seen != seq) {
+      uart_ctrl.last_seen = (uart_ctrl.last_seen + 1) & CTRL_SEQ_MASK;
+      uart_ctrl.seen[(uart_ctrl.last_seen + window) & CTRL_SEQ_MASK] = false;
+    }
+  }
+
+  if (uart_ctrl.seen[seq]) {
+    return false;
+  }
+  uart_ctrl.seen[seq] = true;
+  return true;
+}
+
 /**================================================== *
  * ===============  Parsing Packets  ================ *
  * ================================================== */
-const uart_handler_t uart_handler[] = {
-    {.type = KEYBOARD_REPORT_MSG, .handler = handle_uart_generic_msg},
-    {.type = MOUSE_REPORT_MSG, .handler = handle_uart_generic_msg},
-    {.type = CONSUMER_CONTROL_MSG, .handler = handle_uart_generic_msg},
-    {.type = OUTPUT_SELECT_MSG, .handler = handle_uart_output_select_msg},
-    {.type = LOCK_SCREEN_MSG, .handler = send_lock_screen_report},
-    {.type = SUSPEND_PC_MSG, .handler = send_suspend_pc_report},
-    {.type = ENABLE_DEBUG_MSG, .handler = handle_uart_enable_debug_msg},
-    {.type = REQUEST_REBOOT_MSG, .handler = handle_uart_request_reboot_msg},
-    {.type = OUTPUT_GET_MSG, .handler = handle_uart_output_get_msg},
-    // {.type = FIRMWARE_UPGRADE_MSG, .handler = handle_fw_upgrade_msg},
-    // {.type = MOUSE_ZOOM_MSG, .handler = handle_mouse_zoom_msg},
-    // {.type = KBD_SET_REPORT_MSG, .handler = handle_set_report_msg},
-    // {.type = SWITCH_LOCK_MSG, .handler = handle_switch_lock_msg},
-    // {.type = SYNC_BORDERS_MSG, .handler = handle_sync_borders_msg},
-    // {.type = FLASH_LED_MSG, .handler = handle_flash_led_msg},
-    // {.type = SCREENSAVER_MSG, .handler = handle_screensaver_msg},
-    // {.type = WIPE_CONFIG_MSG, .handler = handle_wipe_config_msg},
-    // {.type = OUTPUT_CONFIG_MSG, .handler = handle_output_config_msg},
+#define ANY_BOARD (1 << PICO_A | 1 << PICO_B)
+
+#define REPORT_MSG(fn)                                                         \
+  {.handler = fn,                                                              \
+   .min_len = 1,                                                               \
+   .max_len = PACKET_DATA_LENGTH,                                              \
+   .msg_class = MSG_CLASS_REPORT,                                              \
+   .roles = ANY_BOARD}
+
+#define CONTROL_MSG(fn)                                                        \
+  {.handler = fn,                                                              \
+   .min_len = 1,                                                               \
+   .max_len = 1,                                                               \
+   .msg_class = MSG_CLASS_CONTROL,                                             \
+   .roles = ANY_BOARD}
+
+#define CHUNK_MSG(fn)                                                          \
+  {.handler = fn,                                                              \
+   .min_len = 3,                                                               \
+   .max_len = PACKET_DATA_LENGTH,                                              \
+   .msg_class = MSG_CLASS_CHUNK,                                               \
+   .roles = ANY_BOARD}
+
+#define LINK_MSG(fn, len)                                                      \
+  {.handler = fn,                                                              \
+   .min_len = len,                                                             \
+   .max_len = len,                                                             \
+   .msg_class = MSG_CLASS_LINK,                                                \
+   .roles = ANY_BOARD}
+
+/* Indexed by packet type, holes have no handler and are rejected */
+const uart_handler_t uart_handler[PACKET_TYPE_COUNT] = {
+    [KEYBOARD_REPORT_MSG] = REPORT_MSG(handle_uart_generic_msg),
+    [MOUSE_REPORT_MSG] = REPORT_MSG(handle_uart_generic_msg),
+    [CONSUMER_CONTROL_MSG] = REPORT_MSG(handle_uart_generic_msg),
+    [OUTPUT_SELECT_MSG] = CONTROL_MSG(handle_uart_output_select_msg),
+    [LOCK_SCREEN_MSG] = CONTROL_MSG(send_lock_screen_report),
+    [SUSPEND_PC_MSG] = CONTROL_MSG(send_suspend_pc_report),
+    [REQUEST_REBOOT_MSG] = CONTROL_MSG(handle_uart_request_reboot_msg),
+    [WIPE_CONFIG_MSG] = CONTROL_MSG(handle_uart_wipe_config_msg),
+    [OUTPUT_CONFIG_MSG] = CHUNK_MSG(handle_uart_output_config_msg),
+    [ENABLE_DEBUG_MSG] = LINK_MSG(handle_uart_enable_debug_msg, 1),
+    [OUTPUT_GET_MSG] = LINK_MSG(handle_uart_output_get_msg, 1),
+    [LINK_VERSION_MSG] = LINK_MSG(handle_uart_link_version_msg, 2),
+    [ACK_MSG] = LINK_MSG(handle_uart_ack_msg, 0),
+    // [FIRMWARE_UPGRADE_MSG] = handle_fw_upgrade_msg,
+    // [MOUSE_ZOOM_MSG] = handle_mouse_zoom_msg,
+    // [KBD_SET_REPORT_MSG] = handle_set_report_msg,
+    // [SWITCH_LOCK_MSG] = handle_switch_lock_msg,
+    // [SYNC_BORDERS_MSG] = handle_sync_borders_msg,
+    // [FLASH_LED_MSG] = handle_flash_led_msg,
+    // [SCREENSAVER_MSG] = handle_screensaver_msg,
 };
 
+/* Reports are measured from the interrupt that stored their last byte, as
+ * good as it gets without timestamping every byte */
+static uint32_t rx_received_at = 0;
+
 void process_packet(uart_packet_t *packet, device_t *state) {
-  if (!verify_checksum(packet)) {
-    printf("Checksum verification failed.\r\n");
+  if (packet->type >= PACKET_TYPE_COUNT) {
+    state->uart_stats.rx_rejected++;
+    trace(TRACE_RX_REJECTED, packet->type, packet->report_len);
+    return;
+  }
+
+  const uart_handler_t *msg = &uart_handler[packet->type];
+
+  if (!msg->handler || !(msg->roles & 1 << BOARD_ROLE) ||
+      packet->report_len < msg->min_len || packet->report_len > msg->max_len) {
+    state->uart_stats.rx_rejected++;
+    trace(TRACE_RX_REJECTED, packet->type, packet->report_len);
     return;
   }
 
-  for (int i = 0; i < ARRAY_SIZE(uart_handler); i++) {
-    if (uart_handler[i].type == packet->type) {
-      uart_handler[i].handler(packet, state);
+  /* ACK duplicates too, it might have been our ACK that got lost */
+  if (msg->msg_class == MSG_CLASS_CONTROL &&
+      packet->report_id & CTRL_SEQ_FLAG) {
+    uart_send_packet(ACK_MSG, 0, packet->report_id, 0, NULL);
+    if (!uart_control_first_seen(packet->report_id & CTRL_SEQ_MASK)) {
+      state->uart_stats.ctrl_duplicates++;
       return;
     }
   }
+
+  if (msg->msg_class == MSG_CLASS_REPORT) {
+    latency_link_report(rx_received_at);
+  }
+
+  msg->handler(packet, state);
 }
 
 /**================================================== *
  * ==============  Receiving Packets  =============== *
  * ================================================== */
 
-/* We are in IDLE state until we detect the packet start (0xAA 0x55) */
-void handle_idle_state(uint8_t *raw_packet, device_t *state) {
-  if (!uart_is_readable(UART_ZERO)) {
-    return;
+/* UART0 RX lands here from the RX/RX-timeout interrupt, so the 32 byte
+ * hardware FIFO can't overrun while core1 is busy with PIO-USB. Indexes are
+ * free-running, the ISR only writes head and core1 only writes tail. */
+#define UART_RX_BUFFER_SIZE 512
+#define UART_RX_BUFFER_MASK (UART_RX_BUFFER_SIZE - 1)
+
+static struct {
+  uint8_t data[UART_RX_BUFFER_SIZE];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+  volatile uint32_t received_at; // time_us_32() of the last bytes stored
+} uart_rx = {0};
+
+static inline void __not_in_flash_func(uart_rx_drain_fifo)(void) {
+  uint32_t head = uart_rx.head;
+
+  while (uart_is_readable(UART_ZERO)) {
+    uint8_t c = (uint8_t)uart_getc(UART_ZERO);
+    if (head - uart_rx.tail >= UART_RX_BUFFER_SIZE) {
+      global_state.uart_stats.rx_overruns++;
+      continue;
+    }
+    uart_rx.data[head & UART_RX_BUFFER_MASK] = c;
+    head++;
   }
 
-  raw_packet[0] = raw_packet[1]; /* Remember the previous byte received */
-  raw_packet[1] = uart_getc(UART_ZERO); /* Try to match packet start */
+  if (head != uart_rx.head) {
+    uart_rx.received_at = time_us_32();
+  }
 
-  /* If we found 0xAA 0x55, we're in sync and can move on to read/process the
-   * packet */
-  if (raw_packet[0] == START1 && raw_packet[1] == START2) {
-    state->uart_state = READING_PACKET;
+  /* Make sure the data is visible before core1 can see the new head */
+  __dmb();
+  uart_rx.head = head;
+}
+
+/* UART0 interrupt, serves both the RX ring buffer and the TX queue */
+void __not_in_flash_func(uart_irq_handler)(void) {
+  uart_rx_drain_fifo();
+
+  uint32_t irq_state = spin_lock_blocking(uart_tx.lock);
+  uart_tx_fill_fifo();
+  spin_unlock(uart_tx.lock, irq_state);
+}
+
+static inline uint8_t uart_rx_peek(uint32_t index) {
+  return uart_rx.data[index & UART_RX_BUFFER_MASK];
+}
+
+/* Decode the COBS data between two delimiters, returns the decoded length or
+ * -1 if this can't be a version 2 packet */
+static int cobs_decode(uint32_t index, uint32_t end, uint8_t *dst) {
+  int out = 0;
+
+  while (index != end) {
+    uint8_t code = uart_rx_peek(index++);
+    for (uint8_t i = 1; i < code; i++) {
+      if (index == end || out == COBS_DATA_LENGTH) {
+        return -1;
+      }
+      dst[out++] = uart_rx_peek(index++);
+    }
+    if (code != 0xFF && index != end) {
+      if (out == COBS_DATA_LENGTH) {
+        return -1;
+      }
+      dst[out++] = 0;
+    }
   }
+
+  return out;
 }
 
-/* Read a character off the line until we reach fixed packet length */
-void handle_reading_state(uint8_t *raw_packet, device_t *state, int *count) {
-  while (uart_is_readable(UART_ZERO) && *count < PACKET_LENGTH) {
-    /* Read and store the incoming byte */
-    raw_packet[(*count)++] = uart_getc(UART_ZERO);
+/* Version 2 packet between the delimiters at start and end? */
+static bool uart_rx_read_v2(uart_packet_t *packet, uint32_t start,
+                            uint32_t end) {
+  uint8_t decoded[COBS_DATA_LENGTH];
+  int length = cobs_decode(start + 1, end, decoded);
+  if (length < HEADER_LENGTH + CRC_LENGTH) {
+    return false;
+  }
+
+  uint8_t report_len = decoded[HEADER_LENGTH - 1];
+  if (report_len > PACKET_DATA_LENGTH ||
+      length != HEADER_LENGTH + report_len + CRC_LENGTH) {
+    return false;
   }
 
-  /* Check if a complete packet is received */
-  if (*count >= PACKET_LENGTH) {
-    state->uart_state = PROCESSING_PACKET;
+  uint16_t crc = decoded[length - 2] << 8 | decoded[length - 1];
+  if (crc != calc_crc16(decoded, length - CRC_LENGTH)) {
+    global_state.uart_stats.rx_checksum_errors++;
+    trace(TRACE_CHECKSUM_ERROR, decoded[0], 2);
+    return false;
   }
+
+  memcpy(packet, decoded, HEADER_LENGTH + report_len);
+  memset(&packet->data[report_len], 0, PACKET_DATA_LENGTH - report_len);
+  return true;
 }
 
-/* Process that packet, restart counters and state machine to have it back to
- * IDLE */
-void handle_processing_state(uart_packet_t *packet, device_t *state,
-                             int *count) {
-  process_packet(packet, state);
-  state->uart_state = IDLE;
-  *count = 0;
+/* Once the other board speaks version 2, only a board that just booted still
+ * sends version 1: its output query and version announcement. Anything else
+ * starting with 0xAA 0x55 is part of a version 2 frame, waiting for the rest
+ * of it would hold up the frames behind. */
+static bool uart_rx_v1_expected(const device_t *state, uint8_t type) {
+  return state->peer_link_version < 2 || type == LINK_VERSION_MSG ||
+         type == OUTPUT_GET_MSG;
 }
 
-/* Very simple state machine to receive and process packets over serial */
-void uart_receive_char(uart_packet_t *packet, device_t *state) {
+/* Version 1 packet, the 0xAA 0x55 start is at index */
+static bool uart_rx_read_v1(uart_packet_t *packet, uint32_t index) {
   uint8_t *raw_packet = (uint8_t *)packet;
-  static int count = 0;
 
-  switch (state->uart_state) {
-  case IDLE:
-    handle_idle_state(raw_packet, state);
-    break;
+  for (int i = 0; i < PACKET_LENGTH; i++) {
+    raw_packet[i] = uart_rx_peek(index + START_LENGTH + i);
+  }
+
+  if (!verify_checksum(packet)) {
+    global_state.uart_stats.rx_checksum_errors++;
+    trace(TRACE_CHECKSUM_ERROR, packet->type, 1);
+    return false;
+  }
+  return true;
+}
+
+/* Pull every complete packet out of the ring buffer and process it. A packet
+ * that is still on the wire stays in the buffer until the next call. */
+void uart_receive_packets(uart_packet_t *packet, device_t *state) {
+  static uint32_t skipped = 0;
+  uart_stats_t *stats = &state->uart_stats;
+  uint32_t tail = uart_rx.tail;
+  uint32_t head = uart_rx.head;
+  __dmb();
+  rx_received_at = uart_rx.received_at;
+
+  while (head != tail) {
+    uint8_t c = uart_rx_peek(tail);
+    bool valid = false;
 
-  case READING_PACKET:
-    handle_reading_state(raw_packet, state, &count);
-    break;
+    if (c == DELIMITER) {
+      /* Version 2: everything up to the next delimiter */
+      uint32_t end = tail + 1;
+      while (end != head && uart_rx_peek(end) != DELIMITER &&
+             end - tail <= COBS_LENGTH) {
+        end++;
+      }
+      if (end == head && end - tail <= COBS_LENGTH + 1) {
+        break; // rest is still on the wire
+      }
+      if (end - tail == 1) {
+        tail++; // back to back delimiters
+        continue;
+      }
+      if (uart_rx_peek(end) == DELIMITER) {
+        valid = uart_rx_read_v2(packet, tail, end);
+      }
+      /* The closing delimiter opens the next packet */
+      if (valid) {
+        tail = end;
+      }
+    } else if (c == START1) {
+      /* Version 1: 0xAA 0x55 and a fixed length */
+      if (head - tail < START_LENGTH + 1) {
+        break;
+      }
+      if (uart_rx_peek(tail + 1) == START2 &&
+          uart_rx_v1_expected(state, uart_rx_peek(tail + START_LENGTH))) {
+        if (head - tail < RAW_PACKET_LENGTH) {
+          break;
+        }
+        /* A false start inside a payload only costs us the start byte */
+        valid = uart_rx_read_v1(packet, tail);
+        if (!valid) {
+          tail++;
+          skipped++;
+          continue;
+        }
+        tail += RAW_PACKET_LENGTH;
 
-  case PROCESSING_PACKET:
-    handle_processing_state(packet, state, &count);
-    break;
+        /* A freshly booted board asks for the output first, until it
+         * announces its version we have to assume it is an older firmware */
+        if (packet->type == OUTPUT_GET_MSG) {
+          state->peer_link_version = 1;
+        }
+      }
+    }
+
+    if (!valid) {
+      tail++;
+      skipped++;
+      continue;
+    }
+
+    stats->rx_packets++;
+    if (skipped) {
+      stats->rx_resyncs++;
+      skipped = 0;
+    }
+
+    /* Hand the space back before processing, handlers may take a while */
+    uart_rx.tail = tail;
+    process_packet(packet, state);
   }
+
+  uart_rx.tail = tail;
 }
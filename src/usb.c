@@ -1,44 +1,455 @@
 #include "main.h"
 
-bool send_tud_report(uint8_t interface, uint8_t report_id, uint8_t report_len,
-                     uint8_t const *report) {
-  bool success = false;
-  if (tud_ready()) {
-    if (global_state.tud_connected) {
-      success = tud_hid_n_report(interface, report_id, report, report_len);
-    }
-    // printf("x[report] interface %d report_id %d len %d\r\n", interface,
-    //        report_id, report_len);
-    // for (uint8_t i = 0; i < report_len; i++) {
-    //   printf("%02x ", report[i]);
-    // }
-    // printf("\r\n");
-    // if (!success) {
-    //   printf("success: %s\r\n", success ? "true" : "false");
-    // }
-  } else {
-    printf("x[report] tud not ready\r\n");
+/**================================================== *
+ * ===============  HID report queue  =============== *
+ * ================================================== */
+
+/* Only one IN transfer per interface can be in flight, whatever comes in
+ * meanwhile waits here until tud_hid_report_complete_cb() sends the next one.
+ * Only core0 touches these, core1 hands its reports over through the core
+ * queue below. */
+#define HID_QUEUE_SIZE 8
+#define HID_QUEUE_MASK (HID_QUEUE_SIZE - 1)
+
+typedef struct {
+  uint8_t report_id;
+  uint8_t len;
+  uint8_t data[PACKET_DATA_LENGTH];
+  uint32_t since; // LATENCY_TO_DEVICE is measured from here
+} hid_queued_report_t;
+
+static struct {
+  hid_queued_report_t entries[HID_QUEUE_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  bool busy; // an IN transfer is in flight
+} hid_queue[ITF_NUM_TOTAL] = {0};
+
+static void held_keys_sent(uint8_t interface, uint8_t report_id, uint8_t len,
+                           uint8_t const *report);
+
+/* Requests from either core, carried out by core0 in hid_queue_task() */
+static volatile bool hid_reset_requested = false;
+static volatile bool wakeup_requested = false;
+
+/* After a bus reset or suspend, the pending transfers never complete */
+void hid_queue_reset(void) {
+  hid_reset_requested = true;
+  __sev();
+}
+
+void request_remote_wakeup(void) {
+  wakeup_requested = true;
+  __sev();
+}
+
+/* Mouse motion adds up, as long as the buttons stay the same no click is
+ * lost. Returns false if the report has to be queued on its own. */
+static bool hid_queue_coalesce(hid_queued_report_t *last, uint8_t report_id,
+                               uint8_t len, uint8_t const *report) {
+  if (last->report_id != report_id || last->len != len) {
+    return false;
+  }
+
+  if (report_id == REPORT_ID_MOUSE && len == sizeof(mouse_report_t)) {
+    return merge_mouse_report((mouse_report_t *)last->data,
+                              (const mouse_report_t *)report);
+  }
+
+  /* Keyboard and consumer reports are state, a repeat changes nothing */
+  return !memcmp(last->data, report, len);
+}
+
+static bool hid_queue_push(uint8_t interface, uint8_t report_id, uint8_t len,
+                           uint8_t const *report, uint32_t since) {
+  hid_queue_stats_t *stats = &global_state.hid_stats[interface];
+  typeof(hid_queue[0]) *queue = &hid_queue[interface];
+  uint32_t depth = queue->head - queue->tail;
+  hid_queued_report_t *entry = &queue->entries[queue->head & HID_QUEUE_MASK];
+
+  if (depth) {
+    hid_queued_report_t *last =
+        &queue->entries[(queue->head - 1) & HID_QUEUE_MASK];
+
+    if (hid_queue_coalesce(last, report_id, len, report)) {
+      stats->coalesced++;
+      return true;
+    }
+
+    /* Overwriting the last entry could lose a key press and its release,
+     * keyboard reports from core1 wait in the core queue instead */
+    if (depth == HID_QUEUE_SIZE) {
+      stats->dropped++;
+      return false;
+    }
+  }
+
+  if (depth || queue->busy) {
+    stats->queued++;
+  }
+
+  entry->report_id = report_id;
+  entry->len = len;
+  memcpy(entry->data, report, len);
+  entry->since = since;
+  queue->head++;
+
+  if (depth + 1 > stats->high_water) {
+    stats->high_water = depth + 1;
+  }
+  return true;
+}
+
+static bool hid_queue_full(uint8_t interface) {
+  return hid_queue[interface].head - hid_queue[interface].tail ==
+         HID_QUEUE_SIZE;
+}
+
+static void hid_queue_send_first(uint8_t interface) {
+  typeof(hid_queue[0]) *queue = &hid_queue[interface];
+
+  if (queue->busy || queue->head == queue->tail) {
+    return;
+  }
+
+  hid_queued_report_t *entry = &queue->entries[queue->tail & HID_QUEUE_MASK];
+  if (tud_hid_n_report(interface, entry->report_id, entry->data, entry->len)) {
+    latency_record(LATENCY_TO_DEVICE, entry->since);
+    queue->tail++;
+    queue->busy = true;
+  }
+}
+
+/* Called when the previous report on this interface went out */
+void hid_queue_send_next(uint8_t interface) {
+  if (interface >= ITF_NUM_TOTAL) {
+    return;
+  }
+
+  hid_queue[interface].busy = false;
+  hid_queue_send_first(interface);
+}
+
+/* Core0 only, queue the report for the device stack */
+static bool hid_queue_submit(uint8_t interface, uint8_t report_id,
+                             uint8_t report_len, uint8_t const *report,
+                             uint32_t since) {
+  if (!tud_ready()) {
+    trace(TRACE_TUD_NOT_READY, interface, 0);
     remote_wakeup();
+    return false;
+  }
+
+  if (!read_shared_state().tud_connected) {
+    return false;
+  }
+
+  bool success =
+      hid_queue_push(interface, report_id, report_len, report, since);
+  if (success) {
+    held_keys_sent(interface, report_id, report_len, report);
   }
+  hid_queue_send_first(interface);
   return success;
 }
 
+/**================================================== *
+ * =================  Held keys  ==================== *
+ * ================================================== */
+
+/*
+ * What our PC was told last per report ID, so a switch away from us can let
+ * go of exactly what it still holds. The input board sends held keyboard keys
+ * again every HELD_KEYS_REFRESH_US (see keyboard.c), if that stops for
+ * HELD_KEYS_TIMEOUT_US their release got lost on the way. Core0 only.
+ */
+typedef struct {
+  uint8_t interface;
+  uint8_t len;
+  bool held;
+  uint64_t sent_at;
+} held_report_t;
+
+static held_report_t held_keys[REPORT_ID_COUNT] = {0};
+
+static void held_keys_sent(uint8_t interface, uint8_t report_id, uint8_t len,
+                           uint8_t const *report) {
+  if (!report_id || report_id >= REPORT_ID_COUNT) {
+    return;
+  }
+
+  /* Mouse motion holds nothing, only the buttons do */
+  uint8_t holding = report_id == REPORT_ID_MOUSE
+                        ? MIN(len, offsetof(mouse_report_t, x))
+                        : len;
+
+  held_report_t *held = &held_keys[report_id];
+  held->interface = interface;
+  held->len = len;
+  held->held = false;
+  held->sent_at = time_us_64();
+  for (uint8_t i = 0; i < holding; i++) {
+    held->held |= report[i] != 0;
+  }
+}
+
+/* An all zero report lets go of everything, for each of our report IDs. A PC
+ * that is asleep isn't woken up for it, the timeout tries again later. */
+static bool held_keys_release(uint8_t report_id, bool timed_out) {
+  static const uint8_t released[PACKET_DATA_LENGTH] = {0};
+  held_report_t *held = &held_keys[report_id];
+
+  if (!held->held || !tud_ready()) {
+    return false;
+  }
+
+  if (!hid_queue_submit(held->interface, report_id, held->len, released,
+                        time_us_32())) {
+    return false;
+  }
+  trace(TRACE_KEYS_RELEASED, report_id, timed_out);
+  return true;
+}
+
+static void held_keys_release_all(void) {
+  for (uint8_t report_id = 1; report_id < REPORT_ID_COUNT; report_id++) {
+    if (held_keys_release(report_id, false)) {
+      global_state.held_keys_stats.released++;
+    }
+  }
+}
+
+/* Core0, every tick. On the active output only keyboard keys are sent again
+ * while held, so only they can time out there. Anything left on an inactive
+ * output is a release that didn't get through. */
+void held_keys_task(device_t *state) {
+  bool active = read_shared_state().active_output == BOARD_ROLE;
+  /* Older boards don't send held keys again, nothing to go by */
+  bool refreshed = !state->peer_link_version ||
+                   state->peer_link_version >= HELD_KEYS_LINK_VERSION;
+  uint64_t now = time_us_64();
+
+  for (uint8_t report_id = 1; report_id < REPORT_ID_COUNT; report_id++) {
+    held_report_t *held = &held_keys[report_id];
+    if (!held->held || now - held->sent_at < HELD_KEYS_TIMEOUT_US) {
+      continue;
+    }
+    if (active && !(report_id == REPORT_ID_KEYBOARD && refreshed)) {
+      continue;
+    }
+    if (held_keys_release(report_id, true)) {
+      state->held_keys_stats.timed_out++;
+    }
+  }
+}
+
+/**================================================== *
+ * ==============  Core1 -> core0 queue  ============ *
+ * ================================================== */
+
+/* Reports generated on core1 (USB host and UART side) wait here until core0
+ * picks them up. One producer and one consumer, so the free-running indexes
+ * and a barrier are all the locking it needs. A shared RAM ring rather than
+ * the SIO FIFO, a report doesn't fit into its 8 words. */
+#define CORE_QUEUE_SIZE 32
+#define CORE_QUEUE_MASK (CORE_QUEUE_SIZE - 1)
+#define CORE_QUEUE_RELEASE ITF_NUM_TOTAL // Not a report, release_held_keys()
+#define CORE_QUEUE_DISCONNECT (ITF_NUM_TOTAL + 1) // Nor this, disconnect_pc()
+#define CORE_QUEUE_RESERVED 8 // Only for entries that must not be dropped
+
+typedef struct {
+  uint8_t interface;
+  hid_queued_report_t report;
+  uint64_t queued_at;
+} core_queued_report_t;
+
+static struct {
+  core_queued_report_t entries[CORE_QUEUE_SIZE];
+  volatile uint32_t head; // written by core1 only
+  volatile uint32_t tail; // written by core0 only
+} core_queue = {0};
+
+/* Keyboard reports and the markers change what the PC holds or gets, a lost
+ * one can leave a key stuck or a keystroke missing. Mouse and consumer
+ * reports can't take their reserved slots, these only run out when the PC
+ * stopped polling for a long while. Every drop is counted. */
+static bool core_queue_keeps(uint8_t interface) {
+  return interface == ITF_NUM_HID_KB || interface == CORE_QUEUE_RELEASE ||
+         interface == CORE_QUEUE_DISCONNECT;
+}
+
+/* While there is no room for a keyboard report in the HID queue, it and
+ * everything after it waits in the core queue */
+static bool core_queue_must_wait(const core_queued_report_t *entry) {
+  if (entry->interface == CORE_QUEUE_RELEASE) {
+    return hid_queue_full(ITF_NUM_HID_KB) || hid_queue_full(ITF_NUM_HID_MS);
+  }
+  return entry->interface == ITF_NUM_HID_KB && hid_queue_full(ITF_NUM_HID_KB);
+}
+
+/* Core1 only */
+static bool core_queue_push(uint8_t interface, uint8_t report_id,
+                            uint8_t report_len, uint8_t const *report,
+                            uint32_t since) {
+  core_queue_stats_t *stats = &global_state.core_queue_stats;
+  uint32_t head = core_queue.head;
+  uint32_t depth = head - core_queue.tail;
+  uint32_t room = core_queue_keeps(interface)
+                      ? CORE_QUEUE_SIZE
+                      : CORE_QUEUE_SIZE - CORE_QUEUE_RESERVED;
+
+  if (depth >= room) {
+    stats->dropped++;
+    return false;
+  }
+
+  core_queued_report_t *entry = &core_queue.entries[head & CORE_QUEUE_MASK];
+  entry->interface = interface;
+  entry->report.report_id = report_id;
+  entry->report.len = report_len;
+  memcpy(entry->report.data, report, report_len);
+  entry->report.since = since;
+  entry->queued_at = time_us_64();
+
+  if (depth + 1 > stats->high_water) {
+    stats->high_water = depth + 1;
+  }
+
+  /* The entry has to be complete before core0 can see the new head */
+  __dmb();
+  core_queue.head = head + 1;
+
+  /* core0 may be asleep in __wfe() */
+  __sev();
+  return true;
+}
+
+/* Core0 only, runs from the main loop right after tud_task() */
+void hid_queue_task(void) {
+  core_queue_stats_t *stats = &global_state.core_queue_stats;
+  uint32_t tail = core_queue.tail;
+  uint32_t head = core_queue.head;
+  __dmb();
+
+  if (hid_reset_requested) {
+    hid_reset_requested = false;
+    for (int i = 0; i < ITF_NUM_TOTAL; i++) {
+      hid_queue[i].head = hid_queue[i].tail = 0;
+      hid_queue[i].busy = false;
+    }
+  }
+
+  if (wakeup_requested) {
+    wakeup_requested = false;
+    remote_wakeup();
+  }
+
+  if (head == tail) {
+    return;
+  }
+
+  uint64_t now = time_us_64();
+  for (; tail != head; tail++) {
+    core_queued_report_t *entry = &core_queue.entries[tail & CORE_QUEUE_MASK];
+    if (tud_ready() && core_queue_must_wait(entry)) {
+      break; // tud_hid_report_complete_cb() makes room
+    }
+    uint32_t wait = (uint32_t)(now - entry->queued_at);
+
+    stats->handed_over++;
+    stats->wait_total_us += wait;
+    if (wait > stats->wait_max_us) {
+      stats->wait_max_us = wait;
+    }
+
+    if (entry->interface == CORE_QUEUE_RELEASE) {
+      held_keys_release_all();
+      continue;
+    }
+    if (entry->interface == CORE_QUEUE_DISCONNECT) {
+      set_tud_disconnected();
+      continue;
+    }
+    hid_queue_submit(entry->interface, entry->report.report_id,
+                     entry->report.len, entry->report.data,
+                     entry->report.since);
+  }
+
+  /* Done reading the entries before core1 may reuse them */
+  __dmb();
+  core_queue.tail = tail;
+}
+
+/* Callable from either core, only core0 ever calls into the device stack */
+static bool queue_tud_report(uint8_t interface, uint8_t report_id,
+                             uint8_t report_len, uint8_t const *report,
+                             uint32_t since) {
+  if (interface >= ITF_NUM_TOTAL || report_len > PACKET_DATA_LENGTH) {
+    return false;
+  }
+
+  if (get_core_num() == 1) {
+    return core_queue_push(interface, report_id, report_len, report, since);
+  }
+
+  /* Whatever core1 queued earlier goes first */
+  hid_queue_task();
+  return hid_queue_submit(interface, report_id, report_len, report, since);
+}
+
+/* Either core, once the output switched away from us. Queued like a report,
+ * so whatever was sent to our PC before goes out first. If the core queue is
+ * full, held_keys_task() catches it. */
+void release_held_keys(void) {
+  if (get_core_num() == 1) {
+    const uint8_t none = 0;
+    core_queue_push(CORE_QUEUE_RELEASE, 0, 0, &none, time_us_32());
+    return;
+  }
+
+  hid_queue_task();
+  held_keys_release_all();
+}
+
+/* Either core, after the last report for a PC we sent to sleep. Queued like a
+ * report, so the ones before it are still accepted. */
+void disconnect_pc(void) {
+  if (get_core_num() == 1) {
+    const uint8_t none = 0;
+    core_queue_push(CORE_QUEUE_DISCONNECT, 0, 0, &none, time_us_32());
+    return;
+  }
+
+  hid_queue_task();
+  set_tud_disconnected();
+}
+
+bool send_tud_report(uint8_t interface, uint8_t report_id, uint8_t report_len,
+                     uint8_t const *report) {
+  return queue_tud_report(interface, report_id, report_len, report,
+                          time_us_32());
+}
+
 bool send_x_report(enum packet_type_e packet_type, uint8_t interface,
                    uint8_t report_id, uint8_t report_len,
                    uint8_t const *report) {
   bool success = false;
 
   if (!report_len || report_len > PACKET_DATA_LENGTH) {
-    printf("stop flooding on disconnects?\r\n");
+    trace(TRACE_BAD_REPORT_LEN, report_len, 0);
     return success;
   }
 
-  if (BOARD_ROLE == global_state.active_output) {
-    global_state.last_activity = time_us_64();
-    send_tud_report(interface, report_id, report_len, report);
+  uint32_t since = latency_routed();
+
+  /* One consistent look at the output, a switch can't land halfway through */
+  if (BOARD_ROLE == read_shared_state().active_output) {
+    set_last_activity(time_us_64());
+    queue_tud_report(interface, report_id, report_len, report, since);
   } else {
     uart_send_packet(packet_type, interface, report_id, report_len,
                      (uint8_t *)report);
+    latency_record(LATENCY_ROUTED_TO_LINK, since);
   }
 
   return success;
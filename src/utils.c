@@ -15,7 +15,6 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "device/usbd.h"
 #include "main.h"
 
 /**================================================== *
@@ -32,9 +31,55 @@ uint8_t calc_checksum(const uint8_t *data, int length) {
   return checksum;
 }
 
-void set_tud_connected(bool connected) {
-  global_state.tud_connected = connected;
-  printf("tud connected: %s\r\n", connected ? "true" : "false");
+/* CRC-16/CCITT-FALSE, polynomial 0x1021, initial value 0xFFFF. The lookup
+ * table is expanded by the preprocessor, so it's a plain constant. */
+#define CRC16_POLY 0x1021
+#define CRC16_BIT(c)                                                           \
+  ((uint16_t)(((c) << 1) ^ (((c) & 0x8000) ? CRC16_POLY : 0)))
+#define CRC16_BYTE(n)                                                          \
+  CRC16_BIT(CRC16_BIT(CRC16_BIT(CRC16_BIT(                                     \
+      CRC16_BIT(CRC16_BIT(CRC16_BIT(CRC16_BIT((uint16_t)((n) << 8)))))))))
+#define CRC16_4(n)                                                             \
+  CRC16_BYTE(n), CRC16_BYTE(n + 1), CRC16_BYTE(n + 2), CRC16_BYTE(n + 3)
+#define CRC16_16(n) CRC16_4(n), CRC16_4(n + 4), CRC16_4(n + 8), CRC16_4(n + 12)
+#define CRC16_64(n)                                                            \
+  CRC16_16(n), CRC16_16(n + 16), CRC16_16(n + 32), CRC16_16(n + 48)
+
+static const uint16_t crc16_table[256] = {
+    CRC16_64(0), CRC16_64(64), CRC16_64(128), CRC16_64(192)};
+
+uint16_t calc_crc16(const uint8_t *data, int length) {
+  uint16_t crc = 0xFFFF;
+
+  for (int i = 0; i < length; i++) {
+    crc = (crc << 8) ^ crc16_table[(crc >> 8) ^ data[i]];
+  }
+
+  return crc;
+}
+
+static int16_t add_sat16(int16_t a, int16_t b) {
+  int32_t sum = (int32_t)a + b;
+  return sum > INT16_MAX ? INT16_MAX : sum < INT16_MIN ? INT16_MIN : sum;
+}
+
+static int8_t add_sat8(int8_t a, int8_t b) {
+  int16_t sum = (int16_t)a + b;
+  return sum > INT8_MAX ? INT8_MAX : sum < INT8_MIN ? INT8_MIN : sum;
+}
+
+/* Relative motion adds up, saturating instead of wrapping around. Reports
+ * with different buttons can't be merged, a click would get lost. */
+bool merge_mouse_report(mouse_report_t *into, const mouse_report_t *report) {
+  if (memcmp(into->buttons, report->buttons, sizeof(report->buttons))) {
+    return false;
+  }
+
+  into->x = add_sat16(into->x, report->x);
+  into->y = add_sat16(into->y, report->y);
+  into->wheel = add_sat8(into->wheel, report->wheel);
+  into->pan = add_sat8(into->pan, report->pan);
+  return true;
 }
 
 bool verify_checksum(const uart_packet_t *packet) {
@@ -45,11 +90,12 @@ bool verify_checksum(const uart_packet_t *packet) {
 void kick_watchdog_task(device_t *state) {
   /* Read the timer AFTER duplicating the core1 timestamp,
      so it doesn't get updated in the meantime. */
-  uint64_t core1_last_loop_pass = state->core1_last_loop_pass;
+  shared_state_t shared = read_shared_state();
+  uint64_t core1_last_loop_pass = shared.core1_last_loop_pass;
   uint64_t current_time = time_us_64();
 
   /* If a reboot is requested, we'll stop updating watchdog */
-  if (state->reboot_requested) {
+  if (shared.reboot_requested) {
     return;
   }
 
@@ -60,11 +106,107 @@ void kick_watchdog_task(device_t *state) {
   }
 }
 
+/* Keeps the longest time since `since` in max_us */
+void record_loop_time(uint32_t *max_us, uint64_t since) {
+  uint64_t elapsed = time_us_64() - since;
+  if (elapsed > *max_us) {
+    *max_us = elapsed > UINT32_MAX ? UINT32_MAX : elapsed;
+  }
+}
+
 void remote_wakeup(void) {
   tud_remote_wakeup();
-  if (global_state.device_config[BOARD_ROLE].os == MACOS) {
+  if (global_state.config->os[BOARD_ROLE] == MACOS) {
     // workaround: so we can get another round of sleep
     // macOS will not allow to suspend otherwise
     request_reboot();
   }
 }
+
+/**================================================== *
+ * ================  Shared State  ================== *
+ * ================================================== */
+
+/* A seqlock: writers (from either core) take the spin lock and bump the
+ * sequence around the change, readers copy until they get the same even
+ * sequence on both sides. Readers never wait for a lock, and a 64-bit
+ * timestamp can't be seen half written on the M0+. */
+static spin_lock_t *shared_state_lock = NULL;
+
+void shared_state_init(void) {
+  shared_state_lock = spin_lock_init(spin_lock_claim_unused(true));
+}
+
+uint32_t shared_state_write_begin(void) {
+  uint32_t irq_state = spin_lock_blocking(shared_state_lock);
+  global_state.shared_seq++;
+  __dmb();
+  return irq_state;
+}
+
+void shared_state_write_end(uint32_t irq_state) {
+  __dmb();
+  global_state.shared_seq++;
+  spin_unlock(shared_state_lock, irq_state);
+}
+
+shared_state_t read_shared_state(void) {
+  shared_state_t copy;
+  uint32_t seq;
+
+  do {
+    seq = global_state.shared_seq;
+    __dmb();
+    copy = global_state.shared;
+    __dmb();
+  } while ((seq & 1) || seq != global_state.shared_seq);
+
+  return copy;
+}
+
+/* Returns true if that changed the output */
+bool set_active_output(uint8_t output) {
+  uint32_t irq_state = shared_state_write_begin();
+  bool changed = global_state.shared.active_output != output;
+  if (changed) {
+    global_state.shared.active_output = output;
+    global_state.shared.output_switches++;
+  }
+  shared_state_write_end(irq_state);
+  return changed;
+}
+
+static void write_tud_connected(bool connected) {
+  uint32_t irq_state = shared_state_write_begin();
+  global_state.shared.tud_connected = connected;
+  shared_state_write_end(irq_state);
+  trace(TRACE_TUD_CONNECTED, connected, 0);
+}
+
+/* The bus changed, transfers in flight won't complete */
+void set_tud_connected(bool connected) {
+  write_tud_connected(connected);
+  hid_queue_reset();
+}
+
+/* We sent our PC to sleep, what is already queued for it still goes out.
+ * Core0, see disconnect_pc(). */
+void set_tud_disconnected(void) { write_tud_connected(false); }
+
+void set_reboot_requested(void) {
+  uint32_t irq_state = shared_state_write_begin();
+  global_state.shared.reboot_requested = true;
+  shared_state_write_end(irq_state);
+}
+
+void set_last_activity(uint64_t time) {
+  uint32_t irq_state = shared_state_write_begin();
+  global_state.shared.last_activity = time;
+  shared_state_write_end(irq_state);
+}
+
+void set_core1_last_loop_pass(uint64_t time) {
+  uint32_t irq_state = shared_state_write_begin();
+  global_state.shared.core1_last_loop_pass = time;
+  shared_state_write_end(irq_state);
+}